@@ -4,6 +4,7 @@ String user_html = "";
 
 char*               ssid_pfix = (char*)"YourShortNameHere";
 unsigned long       lastPublishMillis = 0;
+int                 publishJob = -1;
 
 void publishData() {
     StaticJsonDocument<512> root;
@@ -11,36 +12,23 @@ void publishData() {
 
     // YOUR CODE for status reporting
 
-    serializeJson(root, msgBuffer);
-    client.publish(publishTopic, msgBuffer);
+    iotPublishChanged(publishTopic, root);
+    lastPublishMillis = millis();
 }
 
-void handleUserCommand(JsonDocument* root) {
+void handleUserCommand(const char* cmdId, JsonDocument* root) {
     JsonObject d = (*root)["d"];
 
     // YOUR CODE for command handling
 
 }
 
-void message(char* topic, byte* payload, unsigned int payloadLength) {
-    byte2buff(msgBuffer, payload, payloadLength);
-    StaticJsonDocument<512> root;
-    DeserializationError error = deserializeJson(root, String(msgBuffer));
-
-    if (error) {
-        Serial.println("handleCommand: payload parse FAILED");
-        return;
-    }
-
-    handleIOTCommand(topic, &root);
-    if (strstr(topic, "/device/update")) {
-        JsonObject meta = cfg["meta"];
+void handleMetaUpdate(const char* cmdId, JsonDocument* root) {
+    JsonObject meta = cfg["meta"];
+    iotReschedule(publishJob, pubInterval);
 
     // YOUR CODE for meta data synchronization
 
-    } else if (strstr(topic, "/cmd/")) {
-        handleUserCommand(&root);
-    }
 }
 
 void setup() {
@@ -49,33 +37,22 @@ void setup() {
 
     JsonObject meta = cfg["meta"];
     pubInterval = meta.containsKey("pubInterval") ? atoi((const char*)meta["pubInterval"]) : 0;
-    lastPublishMillis = - pubInterval;
+    lastPublishMillis = millis();
     startIOTWatchDog((void*)&lastPublishMillis, (int)(pubInterval * 5));
+    startIOTLoopWatchDog();                     // loop() runs iotLoop()
+    publishJob = iotEvery(pubInterval, publishData);
     // YOUR CODE for initialization of device/environment
 
     WiFi.mode(WIFI_STA);
     WiFi.begin((const char*)cfg["ssid"], (const char*)cfg["w_pw"]);
-    int i = 0;
-    while (WiFi.status() != WL_CONNECTED) {
-        delay(500);
-        Serial.print(".");
-        if(i++ > 10) reboot();
-    }
-    Serial.printf("\nIP address : "); Serial.println(WiFi.localIP());
-
-    client.setCallback(message);
+
+    iotOn("update", handleMetaUpdate);
+    iotOnCommand("+", handleUserCommand);
     set_iot_server();
 }
 
 void loop() {
-    if (!client.connected()) {
-        iot_connect();
-    }
-    client.loop();
+    iotLoop();
     // YOUR CODE for routine operation in loop
 
-    if ((pubInterval != 0) && (millis() - lastPublishMillis > pubInterval)) {
-        publishData();
-        lastPublishMillis = millis();
-    }
 }
@@ -0,0 +1,155 @@
+/*
+ * bench.cpp : the hot paths of IBMIOTF32.h on the host
+ *      Each case runs a tenth of its iterations to warm up, then the
+ *      iterations, and prints the wall time per operation and the heap
+ *      allocations of the benchmark thread per operation, those of
+ *      PubSubClient, ArduinoJson and the C++ library included. The times
+ *      are those of the host CPU, the allocations are the same on the ESP32.
+ *      The device is connected to a MiniBroker, so the publish cases include
+ *      the round trip of the loopback socket.
+ *
+ *          iotbench [filter]       only the cases whose name contains filter
+ */
+#include "HostDevice.h"
+
+const char*         benchFilter = NULL;
+
+template <typename Fn>
+void bench(const char* name, unsigned long iters, Fn fn, const char* note = "") {
+    if (benchFilter && !strstr(name, benchFilter)) return;
+    for (unsigned long i = 0; i < iters / 10 + 1; i++) fn();
+    host::resetAllocs();
+    host::countAllocs(true);
+    unsigned long long t0 = hostNanos();
+    for (unsigned long i = 0; i < iters; i++) fn();
+    unsigned long long t1 = hostNanos();
+    host::countAllocs(false);
+    host::AllocStats a = host::allocs();
+    printf("%-32s %9lu %11.1f ns/op %7.2f allocs/op %8.1f B/op  %s\n", name, iters,
+           (double)(t1 - t0) / iters, (double)a.count / iters, (double)a.bytes / iters, note);
+}
+
+volatile int        benchSink = 0;
+
+void benchHandler(const char* cmdId, JsonDocument* root) {
+    benchSink += (*root)["d"]["value"].as<int>();
+}
+
+const char          statusJson[] =
+    "{\"d\":{\"temperature\":23.5,\"humidity\":41,\"pm25\":12,\"fan\":\"on\",\"mode\":\"auto\","
+    "\"uptime\":123456,\"rssi\":-61,\"filter\":[98,97,95]}}";
+
+int main(int argc, char** argv) {
+    benchFilter = argc > 1 ? argv[1] : NULL;
+    host::setSerial(false);
+    MiniBroker broker;
+    uint16_t port = broker.start();
+    if (!port) {
+        printf("no broker\n");
+        host::exit(1);
+    }
+    hostDevice("iotbench.spiffs", port);
+    CHECK(waitConnected());
+    iotOnCommand("ping", benchHandler);
+    printf("%-32s %9s %14s %17s %13s\n", "case", "iters", "time", "allocs", "bytes");
+
+    // topics
+    char topic[200];
+    bench("toGatewayTopic", 200000, [&]() {
+        strcpy(topic, "iot-2/evt/status/fmt/json");
+        toGatewayTopic(topic, "hostType", "host1");
+    });
+    bench("gatewayTopic", 200000, [&]() {
+        benchSink += gatewayTopic(topic, sizeof(topic), iotTopicTemplates[4], "hostType", "host1");
+    });
+    char cmdId[IOT_CMD_ID_LENGTH], fmt[IOT_FMT_LENGTH];
+    char cmdTopic[IOT_DEVICE_TOPIC_LENGTH];
+    snprintf(cmdTopic, sizeof(cmdTopic), "%.*sping/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+    bench("iotMatchTopic", 200000, [&]() {
+        benchSink += iotMatchTopic(cmdTopic, cmdId, fmt);
+    });
+
+    // the receive path
+    const char command[] = "{\"d\":{\"value\":42,\"name\":\"bench\"}}";
+    strcpy(rxBuffer, command);
+    deserializeJson(rxDoc, rxBuffer);
+    bench("handleIOTCommand", 200000, [&]() {
+        handleIOTCommand(cmdTopic, &rxDoc);
+    }, "dispatch of a parsed command");
+    bench("iotCallback command", 100000, [&]() {
+        iotCallback(cmdTopic, (byte*)command, sizeof(command) - 1);
+    }, "copy, parse and dispatch");
+    bench("sketch callback, before", 100000, [&]() {
+        byte2buff(msgBuffer, (byte*)command, sizeof(command) - 1);
+        StaticJsonDocument<512> root;
+        deserializeJson(root, String(msgBuffer));
+        handleIOTCommand(cmdTopic, &root);
+    }, "byte2buff, String and a copying parse");
+    char update[] = "{\"d\":{\"fields\":[{\"field\":\"metadata\",\"value\":"
+                    "{\"pubInterval\":1000,\"fmt\":\"json\",\"site\":\"bench\"}}]}}";
+    char updTopic[IOT_DEVICE_TOPIC_LENGTH];
+    snprintf(updTopic, sizeof(updTopic), "%s", updateTopic);
+    bench("iotCallback metadata update", 20000, [&]() {
+        iotCallback(updTopic, (byte*)update, sizeof(update) - 1);
+    }, "iotUpdateMeta, cfg compacted");
+
+    // the config
+    bench("maskConfigTo", 100000, [&]() {
+        IOTWriter w(msgBuffer, sizeof(msgBuffer));
+        maskConfigTo(w, compile_date);
+    });
+    bench("save_config_json", 2000, [&]() {
+        save_config_json();
+    }, "write and rename on the host disk");
+    bench("load_config_json", 5000, [&]() {
+        benchSink += load_config_json(cfgFile);
+    });
+
+    // the serialization, json against msgpack
+    StaticJsonDocument<512> status;
+    deserializeJson(status, statusJson);
+    char buff[512];
+    char note[64];
+    const char* jsonTopic = "iot-2/type/hostType/id/host1/evt/status/fmt/json";
+    const char* packTopic = "iot-2/type/hostType/id/host1/evt/status/fmt/msgpack";
+    size_t jsonLen = iotSerialize(jsonTopic, status, buff, sizeof(buff));
+    snprintf(note, sizeof(note), "%u bytes", (unsigned)jsonLen);
+    bench("iotSerialize json", 200000, [&]() {
+        benchSink += iotSerialize(jsonTopic, status, buff, sizeof(buff));
+    }, note);
+    char json[512];
+    memcpy(json, buff, jsonLen);
+    size_t packLen = iotSerialize(packTopic, status, buff, sizeof(buff));
+    snprintf(note, sizeof(note), "%u bytes", (unsigned)packLen);
+    bench("iotSerialize msgpack", 200000, [&]() {
+        benchSink += iotSerialize(packTopic, status, buff, sizeof(buff));
+    }, note);
+    char pack[512];
+    memcpy(pack, buff, packLen);
+    bench("deserializeJson", 200000, [&]() {
+        memcpy(buff, json, jsonLen);
+        benchSink += (int)deserializeJson(rxDoc, buff, jsonLen).code();
+    }, "in place, as iotHandleMessage");
+    bench("deserializeMsgPack", 200000, [&]() {
+        memcpy(buff, pack, packLen);
+        benchSink += (int)deserializeMsgPack(rxDoc, buff, packLen).code();
+    }, "in place, as iotHandleMessage");
+
+    // the publishing, through the loopback socket
+    jsonLen = serializeJson(status, buff, sizeof(buff));
+    bench("iotPublish QoS 1 until PUBACK", 2000, [&]() {
+        iotPublish(publishTopic, buff, jsonLen);
+        while (inflightPending()) iotLoop();
+    }, "round trip");
+    bench("iotPublish QoS 1 window", 2000, [&]() {
+        while (!iotPublish(publishTopic, buff, jsonLen)) iotLoop();
+    }, "held past the window until inflightBuffer is full");
+    while (inflightPending()) iotLoop();
+    bench("iotPublishDoc", 2000, [&]() {
+        iotPublishDoc(publishTopic, status);
+        while (inflightPending()) iotLoop();
+    }, "serialize, publish, PUBACK");
+
+    fflush(stdout);
+    host::exit(0);
+}
@@ -0,0 +1,399 @@
+/*
+ * Arduino.cpp : the ESP32 Arduino core for the host build
+ */
+#include <Arduino.h>
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include "IOTHost.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <malloc.h>
+#include <unistd.h>
+
+static std::chrono::steady_clock::time_point   hostStart = std::chrono::steady_clock::now();
+static std::atomic<unsigned long>               hostSkew(0);        // us
+static std::mt19937                             hostRandom(12345);
+static std::mutex                               hostRandomLock;
+static std::atomic<bool>                        hostSerial(true);
+static std::atomic<unsigned long>               hostWdtResets(0);
+static std::atomic<int>                         hostWdtTasks(0);
+
+HardwareSerial      Serial;
+EspClass            ESP;
+
+unsigned long micros() {
+    auto t = std::chrono::steady_clock::now() - hostStart;
+    return std::chrono::duration_cast<std::chrono::microseconds>(t).count() + hostSkew;
+}
+
+unsigned long millis() {
+    return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {
+    std::this_thread::yield();
+}
+
+long random(long howbig) {
+    if (howbig <= 0) return 0;
+    std::lock_guard<std::mutex> lock(hostRandomLock);
+    return hostRandom() % howbig;
+}
+
+long random(long howsmall, long howbig) {
+    return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+void randomSeed(unsigned long seed) {
+    std::lock_guard<std::mutex> lock(hostRandomLock);
+    hostRandom.seed(seed);
+}
+
+uint32_t esp_random() {
+    std::lock_guard<std::mutex> lock(hostRandomLock);
+    return hostRandom();
+}
+
+void pinMode(uint8_t /* pin */, uint8_t /* mode */) {}
+int digitalRead(uint8_t /* pin */) { return HIGH; }               // the reset button is never pressed
+void digitalWrite(uint8_t /* pin */, uint8_t /* val */) {}
+void attachInterrupt(uint8_t /* pin */, void (*)(), int /* mode */) {}
+
+/*
+ * String, Print, Stream, IPAddress
+ */
+String::String(double v, unsigned digits) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", digits, v);
+    str = buf;
+}
+
+String String::substring(unsigned from, unsigned to) const {
+    if (from > to) std::swap(from, to);
+    if (from >= str.size()) return String();
+    return String(str.c_str() + from, std::min((size_t)to, str.size()) - from);
+}
+
+bool String::endsWith(const String& s) const {
+    return str.size() >= s.str.size() && str.compare(str.size() - s.str.size(), s.str.size(), s.str) == 0;
+}
+
+void String::replace(const String& from, const String& to) {
+    if (from.str.empty()) return;
+    for (size_t i = 0; (i = str.find(from.str, i)) != std::string::npos; i += to.str.size()) {
+        str.replace(i, from.str.size(), to.str);
+    }
+}
+
+void String::trim() {
+    size_t b = 0, e = str.size();
+    while (b < e && isspace((unsigned char)str[b])) b++;
+    while (e > b && isspace((unsigned char)str[e - 1])) e--;
+    str = str.substr(b, e - b);
+}
+
+void String::toLowerCase() {
+    for (size_t i = 0; i < str.size(); i++) str[i] = tolower((unsigned char)str[i]);
+}
+
+size_t Print::printf(const char* fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (n < 0) return 0;
+    if ((size_t)n < sizeof(buf)) return write((const uint8_t*)buf, n);
+    std::string big(n + 1, '\0');
+    va_start(args, fmt);
+    vsnprintf(&big[0], n + 1, fmt, args);
+    va_end(args);
+    return write((const uint8_t*)big.c_str(), n);
+}
+
+int Stream::timedRead() {
+    unsigned long start = millis();
+    do {
+        int c = read();
+        if (c >= 0) return c;
+        delay(1);
+    } while (millis() - start < timeout);
+    return -1;
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+    size_t n = 0;
+    for (; n < length; n++) {
+        int c = timedRead();
+        if (c < 0) break;
+        buffer[n] = c;
+    }
+    return n;
+}
+
+String Stream::readString() {
+    String s;
+    for (int c; (c = timedRead()) >= 0; ) s.concat((char)c);
+    return s;
+}
+
+bool IPAddress::fromString(const char* s) {
+    unsigned a[4];
+    char end;
+    if (!s || sscanf(s, "%u.%u.%u.%u%c", &a[0], &a[1], &a[2], &a[3], &end) != 4) return false;
+    for (int i = 0; i < 4; i++) {
+        if (a[i] > 255) return false;
+        bytes[i] = a[i];
+    }
+    return true;
+}
+
+String IPAddress::toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return String(buf);
+}
+
+/*
+ * Serial and ESP
+ */
+size_t HardwareSerial::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+    if (hostSerial) fwrite(buffer, 1, size, stdout);
+    return size;
+}
+
+void HardwareSerial::flush() {
+    fflush(stdout);
+}
+
+void EspClass::restart() {
+    fprintf(stdout, "\n[host] ESP.restart()\n");
+    host::exit(3);
+}
+
+uint64_t EspClass::getEfuseMac() {
+    return 0x240AC4000000ULL | (getpid() & 0xFFFFFF);
+}
+
+// the 320KB of an ESP32 less the heap in use
+uint32_t EspClass::getFreeHeap() {
+    unsigned long used = host::heapInUse();
+    return used < 320000 ? 320000 - used : 0;
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+    static std::atomic<uint32_t> low(320000);
+    uint32_t free = getFreeHeap();
+    uint32_t seen = low;
+    while (free < seen && !low.compare_exchange_weak(seen, free)) {}
+    return std::min(free, seen);
+}
+
+uint32_t EspClass::getMaxAllocHeap() {
+    return getFreeHeap();
+}
+
+/*
+ * FreeRTOS
+ */
+struct HostTask {
+    void            (*fn)(void*);
+    void*           arg;
+    std::string     name;
+};
+
+struct HostTaskExit {};
+
+static thread_local HostTask*   hostCurrentTask = NULL;
+
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void*), const char* name, uint32_t /* stack */, void* arg,
+                UBaseType_t /* prio */, TaskHandle_t* handle, BaseType_t /* core */) {
+    HostTask* task = new HostTask{fn, arg, name ? name : ""};
+    if (handle) *handle = task;
+    std::thread([task]() {
+        hostCurrentTask = task;
+        try {
+            task->fn(task->arg);
+        } catch (HostTaskExit&) {
+        }
+    }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(void (*fn)(void*), const char* name, uint32_t stack, void* arg,
+                UBaseType_t prio, TaskHandle_t* handle) {
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, 0);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    delay(ticks ? ticks : 0);
+    if (!ticks) yield();
+}
+
+// only a task can delete itself on the host
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == hostCurrentTask) {
+        throw HostTaskExit();
+    }
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return hostCurrentTask;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t /* task */) {
+    return 4096;                                    // not measured on the host
+}
+
+esp_err_t esp_task_wdt_init(uint32_t /* timeout */, bool /* panic */) { return ESP_OK; }
+
+esp_err_t esp_task_wdt_add(TaskHandle_t /* task */) {
+    hostWdtTasks++;
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_delete(TaskHandle_t /* task */) {
+    hostWdtTasks--;
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_reset() {
+    hostWdtResets++;
+    return ESP_OK;
+}
+
+/*
+ * esp_timer
+ *      A timer is never freed, its thread outlives a stop and waits for the
+ *      next start.
+ */
+struct HostTimer {
+    esp_timer_create_args_t     args;
+    std::atomic<uint64_t>       period;     // us, 0 when stopped
+    std::thread                 thread;
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+    HostTimer* t = new HostTimer();
+    t->args = *args;
+    t->period = 0;
+    t->thread = std::thread([t]() {
+        for (;;) {
+            uint64_t period = t->period;
+            std::this_thread::sleep_for(std::chrono::microseconds(period ? period : 1000));
+            if (period && t->period) t->args.callback(t->args.arg);
+        }
+    });
+    t->thread.detach();
+    *handle = t;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    if (!period || timer->period) return ESP_FAIL;
+    timer->period = period;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    if (!timer->period) return ESP_FAIL;
+    timer->period = 0;
+    return ESP_OK;
+}
+
+/*
+ * Allocation counting
+ *      malloc() and the others are wrapped around the glibc ones, and the
+ *      operator new of libstdc++ goes through malloc(), so every heap
+ *      allocation of the thread which turned counting on is seen.
+ */
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void __libc_free(void* p);
+
+static __thread bool            hostCounting __attribute__((tls_model("initial-exec"))) = false;
+static __thread unsigned long   hostAllocCount __attribute__((tls_model("initial-exec"))) = 0;
+static __thread unsigned long   hostAllocBytes __attribute__((tls_model("initial-exec"))) = 0;
+
+static inline void hostCount(size_t size) {
+    if (hostCounting) {
+        hostAllocCount++;
+        hostAllocBytes += size;
+    }
+}
+
+extern "C" void* malloc(size_t size) {
+    hostCount(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size) {
+    hostCount(n * size);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* p, size_t size) {
+    hostCount(size);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void* p) {
+    __libc_free(p);
+}
+
+namespace host {
+
+void advanceMillis(unsigned long ms) {
+    hostSkew += ms * 1000;
+}
+
+void countAllocs(bool on) {
+    hostCounting = on;
+}
+
+AllocStats allocs() {
+    AllocStats s = { hostAllocCount, hostAllocBytes };
+    return s;
+}
+
+void resetAllocs() {
+    hostAllocCount = 0;
+    hostAllocBytes = 0;
+}
+
+unsigned long heapInUse() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+void setSerial(bool on) {
+    hostSerial = on;
+}
+
+unsigned long wdtResets() {
+    return hostWdtResets;
+}
+
+int wdtTasks() {
+    return hostWdtTasks;
+}
+
+void exit(int code) {
+    fflush(stdout);
+    fflush(stderr);
+    _exit(code);
+}
+
+}
@@ -0,0 +1,103 @@
+/*
+ * Arduino.h : the ESP32 Arduino core for the host build
+ *      Time, random, Serial, ESP and the part of FreeRTOS the library uses,
+ *      with the tasks on std::thread. IOTHost.h has the controls of the
+ *      shims for the tests, the benchmarks and the simulator.
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <algorithm>
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+#include "Client.h"
+
+using std::min;
+using std::max;
+
+typedef uint8_t     byte;
+typedef bool        boolean;
+
+#define PROGMEM
+#define PGM_P               const char*
+#define F(s)                (s)
+#define PSTR(s)             (s)
+#define pgm_read_byte_near(p)   (*(const uint8_t*)(p))
+#define pgm_read_byte(p)        (*(const uint8_t*)(p))
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+
+#define INPUT               0x01
+#define INPUT_PULLUP        0x05
+#define OUTPUT              0x03
+#define LOW                 0
+#define HIGH                1
+#define FALLING             0x02
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+uint32_t esp_random();
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t val);
+void attachInterrupt(uint8_t pin, void (*fn)(), int mode);
+
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long /* baud */) {}
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buffer, size_t size);
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    void flush();
+    using Print::write;
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    void restart();
+    uint64_t getEfuseMac();
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap();
+    uint32_t getMaxAllocHeap();
+};
+extern EspClass ESP;
+
+// FreeRTOS, a task is a detached std::thread and a tick is a ms
+typedef void*       TaskHandle_t;
+typedef int         BaseType_t;
+typedef unsigned    UBaseType_t;
+typedef uint32_t    TickType_t;
+typedef int         esp_err_t;
+#define pdPASS              1
+#define pdFAIL              0
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(ms))
+#define portTICK_PERIOD_MS  1
+#define ESP_OK              0
+#define ESP_FAIL            (-1)
+#define ARDUINO_RUNNING_CORE 1
+
+BaseType_t xTaskCreate(void (*fn)(void*), const char* name, uint32_t stack, void* arg,
+                UBaseType_t prio, TaskHandle_t* handle);
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void*), const char* name, uint32_t stack, void* arg,
+                UBaseType_t prio, TaskHandle_t* handle, BaseType_t core);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
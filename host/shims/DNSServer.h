@@ -0,0 +1,12 @@
+/*
+ * DNSServer.h : for the host build, the captive portal DNS answers nothing
+ */
+#pragma once
+#include <Arduino.h>
+
+class DNSServer {
+public:
+    bool start(uint16_t /* port */, const String& /* domain */, const IPAddress& /* ip */) { return true; }
+    void processNextRequest() {}
+    void stop() {}
+};
@@ -0,0 +1,17 @@
+/*
+ * ESPmDNS.h : for the host build, a name.local query asks the resolver of
+ *      the host for name, so /etc/hosts can stand for the LAN. It takes the
+ *      time of host::setMdnsDelay().
+ */
+#pragma once
+#include <Arduino.h>
+
+esp_err_t mdns_init();
+
+class MDNSResponder {
+public:
+    bool begin(const char* /* hostName */) { return true; }
+    IPAddress queryHost(const char* host, uint32_t timeout = 2000);
+    IPAddress queryHost(const String& host, uint32_t timeout = 2000) { return queryHost(host.c_str(), timeout); }
+};
+extern MDNSResponder MDNS;
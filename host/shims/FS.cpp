@@ -0,0 +1,129 @@
+/*
+ * FS.cpp : SPIFFS in a directory of the host
+ *      The SPIFFS paths are flat, "/config.json" is host::fsRoot()/config.json.
+ */
+#include <SPIFFS.h>
+#include "IOTHost.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::string  hostFsRoot = "spiffs";
+
+SPIFFSFS            SPIFFS;
+
+namespace host {
+
+void setFsRoot(const char* dir) {
+    hostFsRoot = dir;
+    mkdir(dir, 0755);
+}
+
+const char* fsRoot() {
+    return hostFsRoot.c_str();
+}
+
+}
+
+namespace fs {
+
+File::File(FILE* f, const char* p) : handle(f, fclose), path(p) {}
+
+size_t File::write(const uint8_t* buf, size_t size) {
+    return handle ? fwrite(buf, 1, size, handle.get()) : 0;
+}
+
+int File::available() {
+    return handle ? (int)(size() - position()) : 0;
+}
+
+int File::read() {
+    return handle ? fgetc(handle.get()) : -1;
+}
+
+size_t File::read(uint8_t* buf, size_t size) {
+    return handle ? fread(buf, 1, size, handle.get()) : 0;
+}
+
+int File::peek() {
+    if (!handle) return -1;
+    int c = fgetc(handle.get());
+    if (c >= 0) ungetc(c, handle.get());
+    return c;
+}
+
+void File::flush() {
+    if (handle) fflush(handle.get());
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+    return handle && fseek(handle.get(), pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+}
+
+size_t File::position() const {
+    return handle ? ftell(handle.get()) : 0;
+}
+
+size_t File::size() const {
+    if (!handle) return 0;
+    fflush(handle.get());
+    struct stat st;
+    return fstat(fileno(handle.get()), &st) == 0 ? st.st_size : 0;
+}
+
+std::string FS::hostPath(const char* path) {
+    return hostFsRoot + (path[0] == '/' ? "" : "/") + path;
+}
+
+// the modes of the ESP32, "r+" fails on a missing file like "r"
+File FS::open(const char* path, const char* mode) {
+    std::string p = hostPath(path);
+    const char* m = !strcmp(mode, "r") ? "rb" : !strcmp(mode, "w") ? "wb" : !strcmp(mode, "a") ? "ab" :
+                !strcmp(mode, "r+") ? "r+b" : !strcmp(mode, "w+") ? "w+b" : mode;
+    FILE* f = fopen(p.c_str(), m);
+    return f ? File(f, path) : File();
+}
+
+bool FS::exists(const char* path) {
+    struct stat st;
+    return stat(hostPath(path).c_str(), &st) == 0;
+}
+
+bool FS::remove(const char* path) {
+    return unlink(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char* from, const char* to) {
+    if (exists(to)) return false;                   // as SPIFFS, which does not replace
+    return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+}
+
+bool SPIFFSFS::begin(bool /* formatOnFail */, const char* /* basePath */, uint8_t /* maxOpenFiles */) {
+    mkdir(hostFsRoot.c_str(), 0755);
+    struct stat st;
+    return stat(hostFsRoot.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool SPIFFSFS::format() {
+    DIR* d = opendir(hostFsRoot.c_str());
+    if (!d) return begin();
+    for (dirent* e; (e = readdir(d)) != NULL; ) {
+        if (e->d_name[0] != '.') unlink((hostFsRoot + "/" + e->d_name).c_str());
+    }
+    closedir(d);
+    return true;
+}
+
+size_t SPIFFSFS::usedBytes() {
+    size_t used = 0;
+    DIR* d = opendir(hostFsRoot.c_str());
+    if (!d) return 0;
+    struct stat st;
+    for (dirent* e; (e = readdir(d)) != NULL; ) {
+        if (e->d_name[0] != '.' && stat((hostFsRoot + "/" + e->d_name).c_str(), &st) == 0) used += st.st_size;
+    }
+    closedir(d);
+    return used;
+}
@@ -0,0 +1,65 @@
+/*
+ * FS.h : the Arduino file system for the host build, on stdio
+ */
+#pragma once
+#include <Arduino.h>
+#include <memory>
+
+namespace fs {
+
+enum SeekMode {
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+class File : public Stream {
+public:
+    File() {}
+    File(FILE* f, const char* path);
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size);
+    int available();
+    int read();
+    size_t read(uint8_t* buf, size_t size);
+    int peek();
+    void flush();
+    bool seek(uint32_t pos, SeekMode mode);
+    bool seek(uint32_t pos) { return seek(pos, SeekSet); }
+    size_t position() const;
+    size_t size() const;
+    void close() { handle.reset(); }
+    operator bool() const { return (bool)handle; }
+    const char* name() const { return path.c_str(); }
+    bool isDirectory() { return false; }
+    using Print::write;
+
+private:
+    std::shared_ptr<FILE> handle;          // copies share the file, closed by the last one
+    std::string     path;
+};
+
+class FS {
+public:
+    File open(const char* path, const char* mode = "r");
+    File open(const String& path, const char* mode = "r") { return open(path.c_str(), mode); }
+    bool exists(const char* path);
+    bool exists(const String& path) { return exists(path.c_str()); }
+    bool remove(const char* path);
+    bool remove(const String& path) { return remove(path.c_str()); }
+    bool rename(const char* from, const char* to);
+    bool rename(const String& from, const String& to) { return rename(from.c_str(), to.c_str()); }
+
+protected:
+    std::string hostPath(const char* path);
+};
+
+}
+
+using fs::File;
+using fs::FS;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
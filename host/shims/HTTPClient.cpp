@@ -0,0 +1,61 @@
+/*
+ * HTTPClient.cpp : the HTTP client of the host build
+ */
+#include <HTTPClient.h>
+
+bool HTTPClient::begin(WiFiClient& client, const String& host, uint16_t port, const String& uri, bool /* https */) {
+    end();
+    stream = &client;
+    this->host = host;
+    this->port = port;
+    this->uri = uri;
+    return true;
+}
+
+void HTTPClient::addHeader(const String& name, const String& value) {
+    headers += name + ": " + value + "\r\n";
+}
+
+// the status code, or an HTTPC_ERROR, with the body left in the stream
+int HTTPClient::GET() {
+    if (!stream || !stream->connect(host.c_str(), port)) return HTTPC_ERROR_CONNECTION_REFUSED;
+    String request = "GET " + uri + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n" +
+                     headers + "\r\n";
+    if (stream->write((const uint8_t*)request.c_str(), request.length()) != request.length()) {
+        return HTTPC_ERROR_SEND_HEADER_FAILED;
+    }
+    int code = 0;
+    char line[256];
+    size_t len = 0;
+    unsigned long t0 = millis();
+    for (;;) {
+        int c = stream->read();
+        if (c < 0) {
+            if (!stream->connected()) return HTTPC_ERROR_CONNECTION_LOST;
+            if (millis() - t0 > timeoutMs) return HTTPC_ERROR_READ_TIMEOUT;
+            delay(1);
+            continue;
+        }
+        if (c != '\n') {
+            if (c != '\r' && len < sizeof(line) - 1) line[len++] = c;
+            continue;
+        }
+        line[len] = '\0';
+        if (len == 0) break;                        // the end of the headers
+        if (code == 0) {
+            if (strncmp(line, "HTTP/1.", 7) || sscanf(line + 8, "%d", &code) != 1) {
+                return HTTPC_ERROR_CONNECTION_LOST;
+            }
+        } else if (!strncasecmp(line, "Content-Length:", 15)) {
+            size = atoi(line + 15);
+        }
+        len = 0;
+    }
+    return code;
+}
+
+void HTTPClient::end() {
+    if (stream) stream->stop();
+    headers = "";
+    size = -1;
+}
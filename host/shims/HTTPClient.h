@@ -0,0 +1,40 @@
+/*
+ * HTTPClient.h : an HTTP/1.1 client on WiFiClient for the host build
+ *      GET() sends the request with the headers added since begin() and
+ *      reads the status line and the headers, and the body is then read
+ *      from the stream of the client, as with the ESP32 core.
+ */
+#pragma once
+#include <WiFiClient.h>
+
+#define HTTP_CODE_OK                        200
+#define HTTP_CODE_PARTIAL_CONTENT           206
+#define HTTPC_ERROR_CONNECTION_REFUSED      (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED      (-2)
+#define HTTPC_ERROR_CONNECTION_LOST         (-5)
+#define HTTPC_ERROR_READ_TIMEOUT            (-11)
+
+class HTTPClient {
+public:
+    HTTPClient() : stream(NULL), port(0), size(-1), timeoutMs(5000) {}
+    ~HTTPClient() { end(); }
+
+    bool begin(WiFiClient& client, const String& host, uint16_t port, const String& uri = "/", bool https = false);
+    void addHeader(const String& name, const String& value);
+    int GET();
+    int getSize() { return size; }         // the Content-Length, -1 when not given
+    WiFiClient* getStreamPtr() { return stream; }
+    WiFiClient& getStream() { return *stream; }
+    void end();
+    bool connected() { return stream && stream->connected(); }
+    void setTimeout(uint16_t timeout) { timeoutMs = timeout; }
+
+private:
+    WiFiClient*     stream;
+    String          host;
+    uint16_t        port;
+    String          uri;
+    String          headers;
+    int             size;
+    uint16_t        timeoutMs;
+};
@@ -0,0 +1,69 @@
+/*
+ * IOTHost.h : controls of the host shims
+ *      For the tests, the benchmarks and the simulator, which drive the
+ *      time, the WiFi, the sockets and the flash of the device, and count
+ *      its heap allocations.
+ */
+#pragma once
+#include <stdint.h>
+#include <string>
+
+namespace host {
+
+// millis() and micros() jump forward, for the timeouts
+void advanceMillis(unsigned long ms);
+
+// the allocations made by the calling thread while counting is on
+struct AllocStats {
+    unsigned long   count;
+    unsigned long   bytes;
+};
+void countAllocs(bool on);
+AllocStats allocs();
+void resetAllocs();
+unsigned long heapInUse();                  // all the threads, bytes
+
+// a connection to port, of any host, goes to toHost:toPort instead
+void redirect(uint16_t port, const char* toHost, uint16_t toPort);
+
+// the TCP socket of WiFiClient and esp-tls, after the redirects, -1 on a failure
+int connectSocket(const char* host, uint16_t port);
+
+// MDNS.queryHost() answers after ms, nothing when ms is past its timeout
+void setMdnsDelay(unsigned long ms);
+unsigned long mdnsQueries();
+
+// WiFi.status() follows up, WiFi.begin() associates after associationMs
+struct WiFiStats {
+    unsigned long   begins;
+    unsigned long   disconnects;
+};
+void setWiFi(bool up);
+void setWiFiAssociation(unsigned long ms);
+WiFiStats wifiStats();
+
+// esp-tls is OpenSSL at TLS 1.2, as mbedTLS on the ESP32, and a handshake
+// waits ms more, up to the timeout of the connection
+void setTlsDelay(unsigned long ms);
+unsigned long tlsHandshakes();              // the resumed ones included
+unsigned long tlsResumed();
+unsigned long caParses();                   // esp_tls_set_global_ca_store()
+
+// the last image Update completed, of the right size and md5, empty before
+std::string otaImage();
+
+// SPIFFS is the directory dir, created when missing
+void setFsRoot(const char* dir);
+const char* fsRoot();
+
+// Serial goes to stdout, or nowhere
+void setSerial(bool on);
+
+// the task watchdog: the tasks added and the feeds
+int wdtTasks();
+unsigned long wdtResets();
+
+// ends the process without the static destructors, the tasks still run
+void exit(int code);
+
+}
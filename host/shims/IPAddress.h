@@ -0,0 +1,26 @@
+/*
+ * IPAddress.h : Arduino IPAddress for the host build
+ *      The bytes in the order of the address, as on the ESP32, so the
+ *      uint32_t of 192.168.0.9 has 192 in its low byte.
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "WString.h"
+
+class IPAddress {
+public:
+    IPAddress() { memset(bytes, 0, 4); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { bytes[0] = a; bytes[1] = b; bytes[2] = c; bytes[3] = d; }
+    IPAddress(uint32_t address) { memcpy(bytes, &address, 4); }
+    bool fromString(const char* s);
+    bool fromString(const String& s) { return fromString(s.c_str()); }
+    String toString() const;
+    operator uint32_t() const { uint32_t v; memcpy(&v, bytes, 4); return v; }
+    uint8_t operator[](int i) const { return bytes[i]; }
+    uint8_t& operator[](int i) { return bytes[i]; }
+    bool operator==(const IPAddress& o) const { return !memcmp(bytes, o.bytes, 4); }
+
+private:
+    uint8_t         bytes[4];
+};
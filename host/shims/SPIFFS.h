@@ -0,0 +1,15 @@
+/*
+ * SPIFFS.h : SPIFFS for the host build, in the directory host::fsRoot()
+ */
+#pragma once
+#include <FS.h>
+
+class SPIFFSFS : public fs::FS {
+public:
+    bool begin(bool formatOnFail = false, const char* basePath = "/spiffs", uint8_t maxOpenFiles = 10);
+    bool format();
+    size_t totalBytes() { return 1441792; }
+    size_t usedBytes();
+    void end() {}
+};
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,21 @@
+/*
+ * Stream.h : Arduino Stream for the host build
+ */
+#pragma once
+#include "Print.h"
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long ms) { timeout = ms; }
+    size_t readBytes(char* buffer, size_t length);
+    size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+    String readString();
+
+protected:
+    int timedRead();
+    unsigned long   timeout = 1000;
+};
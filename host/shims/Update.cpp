@@ -0,0 +1,86 @@
+/*
+ * Update.cpp : the OTA partition of the host build
+ */
+#include <Update.h>
+#include "IOTHost.h"
+#include <mutex>
+#include <openssl/evp.h>
+
+#define HOST_OTA_PARTITION  0x140000            // the app partition of the default scheme
+
+static std::mutex   hostOtaLock;
+static std::string  hostOtaImage;
+
+UpdateClass         Update;
+
+namespace host {
+
+std::string otaImage() {
+    std::lock_guard<std::mutex> lock(hostOtaLock);
+    return hostOtaImage;
+}
+
+}
+
+bool UpdateClass::begin(size_t size, int /* command */) {
+    if (running) {
+        error = "Already Running";
+        return false;
+    }
+    if (size == UPDATE_SIZE_UNKNOWN) size = HOST_OTA_PARTITION;
+    if (size == 0 || size > HOST_OTA_PARTITION) {
+        error = size ? "Not Enough Space" : "Bad Size Given";
+        return false;
+    }
+    image.clear();
+    md5.clear();
+    this->size = size;
+    error = NULL;
+    running = true;
+    return true;
+}
+
+bool UpdateClass::setMD5(const char* md5) {
+    if (strlen(md5) != 32) return false;
+    this->md5 = md5;
+    return true;
+}
+
+size_t UpdateClass::write(uint8_t* data, size_t len) {
+    if (!running) return 0;
+    if (image.size() + len > size) {
+        abort();
+        error = "Not Enough Space";
+        return 0;
+    }
+    image.append((const char*)data, len);
+    return len;
+}
+
+bool UpdateClass::end(bool evenIfRemaining) {
+    if (!running) return false;
+    running = false;
+    if (image.size() < size && !evenIfRemaining) {
+        error = "Premature End";
+        return false;
+    }
+    if (!md5.empty()) {
+        unsigned char digest[16];
+        unsigned int len = 0;
+        char hex[33];
+        EVP_Digest(image.data(), image.size(), digest, &len, EVP_md5(), NULL);
+        for (int i = 0; i < 16; i++) snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+        if (strcasecmp(hex, md5.c_str())) {
+            error = "MD5 Check Failed";
+            return false;
+        }
+    }
+    std::lock_guard<std::mutex> lock(hostOtaLock);
+    hostOtaImage = image;
+    return true;
+}
+
+void UpdateClass::abort() {
+    running = false;
+    error = "Aborted";
+}
@@ -0,0 +1,33 @@
+/*
+ * Update.h : the OTA partition for the host build
+ *      Keeps the image in memory, checks its size and its md5 at end(), and
+ *      hands it to host::otaImage() when it is complete. The errors are
+ *      those of the ESP32 core.
+ */
+#pragma once
+#include <Arduino.h>
+#include <string>
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+class UpdateClass {
+public:
+    UpdateClass() : size(0), running(false), error(NULL) {}
+
+    bool begin(size_t size = UPDATE_SIZE_UNKNOWN, int command = 0);
+    size_t write(uint8_t* data, size_t len);
+    bool end(bool evenIfRemaining = false);
+    void abort();
+    bool setMD5(const char* md5);
+    bool isRunning() { return running; }
+    bool hasError() { return error != NULL; }
+    const char* errorString() { return error ? error : "No Error"; }
+
+private:
+    std::string     image;
+    size_t          size;
+    std::string     md5;
+    bool            running;
+    const char*     error;
+};
+extern UpdateClass Update;
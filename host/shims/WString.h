@@ -0,0 +1,83 @@
+/*
+ * WString.h : Arduino String for the host build
+ *      A std::string underneath, with the part of the Arduino API used by
+ *      the library, ArduinoJson and the sketches.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdlib.h>
+#include <string>
+
+class String {
+public:
+    String() {}
+    String(const char* s) : str(s ? s : "") {}
+    String(const char* s, size_t n) : str(s, n) {}
+    String(const String& s) : str(s.str) {}
+    explicit String(char c) : str(1, c) {}
+    explicit String(int v) : str(std::to_string(v)) {}
+    explicit String(unsigned v) : str(std::to_string(v)) {}
+    explicit String(long v) : str(std::to_string(v)) {}
+    explicit String(unsigned long v) : str(std::to_string(v)) {}
+    explicit String(double v, unsigned digits = 2);
+
+    String& operator=(const String& s) { str = s.str; return *this; }
+    String& operator=(const char* s) { str = s ? s : ""; return *this; }
+
+    const char* c_str() const { return str.c_str(); }
+    unsigned length() const { return str.length(); }
+    bool reserve(unsigned n) { str.reserve(n); return true; }
+
+    bool concat(const String& s) { str += s.str; return true; }
+    bool concat(const char* s) { if (s) str += s; return s != NULL; }
+    bool concat(const char* s, unsigned n) { if (s) str.append(s, n); return s != NULL; }
+    bool concat(char c) { str += c; return true; }
+    bool concat(int v) { str += std::to_string(v); return true; }
+    bool concat(unsigned v) { str += std::to_string(v); return true; }
+    bool concat(long v) { str += std::to_string(v); return true; }
+    bool concat(unsigned long v) { str += std::to_string(v); return true; }
+
+    template <typename T> String& operator+=(const T& v) { concat(v); return *this; }
+
+    int indexOf(char c, unsigned from = 0) const { size_t i = str.find(c, from); return i == std::string::npos ? -1 : (int)i; }
+    int indexOf(const String& s, unsigned from = 0) const { size_t i = str.find(s.str, from); return i == std::string::npos ? -1 : (int)i; }
+    int lastIndexOf(char c) const { size_t i = str.rfind(c); return i == std::string::npos ? -1 : (int)i; }
+    String substring(unsigned from) const { return from < str.size() ? String(str.c_str() + from) : String(); }
+    String substring(unsigned from, unsigned to) const;
+    bool startsWith(const String& s) const { return str.compare(0, s.str.size(), s.str) == 0; }
+    bool endsWith(const String& s) const;
+    void replace(const String& from, const String& to);
+    void trim();
+    void toLowerCase();
+    long toInt() const { return ::atol(str.c_str()); }
+    float toFloat() const { return ::atof(str.c_str()); }
+    bool equals(const String& s) const { return str == s.str; }
+    bool equals(const char* s) const { return str == (s ? s : ""); }
+    char charAt(unsigned i) const { return i < str.size() ? str[i] : 0; }
+    char operator[](unsigned i) const { return charAt(i); }
+    bool operator==(const String& s) const { return str == s.str; }
+    bool operator==(const char* s) const { return equals(s); }
+    bool operator!=(const String& s) const { return str != s.str; }
+    bool operator!=(const char* s) const { return !equals(s); }
+    bool operator<(const String& s) const { return str < s.str; }
+
+private:
+    std::string     str;
+};
+
+// the type of a + b in the Arduino core, ArduinoJson knows it by name
+class StringSumHelper : public String {
+public:
+    StringSumHelper(const String& s) : String(s) {}
+    StringSumHelper(const char* s) : String(s) {}
+};
+
+template <typename T> StringSumHelper operator+(const StringSumHelper& a, const T& b) {
+    StringSumHelper r(a);
+    r.concat(b);
+    return r;
+}
+inline StringSumHelper operator+(const String& a, const String& b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String& a, const char* b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const char* a, const String& b) { StringSumHelper r(a); r.concat(b); return r; }
+inline StringSumHelper operator+(const String& a, char b) { StringSumHelper r(a); r.concat(b); return r; }
@@ -0,0 +1,37 @@
+/*
+ * WebServer.h : for the host build, a web server which serves nothing
+ *      The setup portal is not run on the host, the device is given its
+ *      /config.json instead.
+ */
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+
+#define CONTENT_LENGTH_UNKNOWN  ((size_t)-1)
+
+class WebServer {
+public:
+    typedef void (*THandlerFunction)();
+    WebServer(int /* port */ = 80) {}
+    void on(const char* /* uri */, THandlerFunction /* fn */) {}
+    void onNotFound(THandlerFunction /* fn */) {}
+    void begin() {}
+    void handleClient() {}
+    void collectHeaders(const char* /* headerKeys */[], size_t /* count */) {}
+    int args() { return 0; }
+    String argName(int /* i */) { return String(); }
+    String arg(int /* i */) { return String(); }
+    String arg(const String& /* name */) { return String(); }
+    bool hasHeader(const String& /* name */) { return false; }
+    String header(const String& /* name */) { return String(); }
+    String uri() { return String("/"); }
+    void send(int /* code */, const char* /* type */ = NULL, const String& /* content */ = String()) {}
+    void send(int /* code */, const String& /* type */, const String& /* content */) {}
+    void send_P(int /* code */, PGM_P /* type */, PGM_P /* content */) {}
+    void send_P(int /* code */, PGM_P /* type */, PGM_P /* content */, size_t /* len */) {}
+    void sendHeader(const String& /* name */, const String& /* value */, bool /* first */ = false) {}
+    void setContentLength(size_t /* len */) {}
+    void sendContent(const String& /* content */) {}
+    void sendContent(const char* /* content */, size_t /* len */) {}
+    template <typename T> size_t streamFile(T& file, const String& type) { return file.size(); }
+};
@@ -0,0 +1,239 @@
+/*
+ * WiFi.cpp : the WiFi, the sockets and mDNS for the host build
+ */
+#include <WiFi.h>
+#include <ESPmDNS.h>
+#include "IOTHost.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+struct HostRedirect {
+    std::string     host;
+    uint16_t        port;
+};
+
+static std::mutex                           hostNetLock;
+static std::map<uint16_t, HostRedirect>     hostRedirects;
+static std::atomic<bool>                    hostWiFiUp(true);
+static std::atomic<unsigned long>           hostAssociation(0);
+static std::atomic<unsigned long>           hostAssociatedAt(0);    // millis(), 0 when not associating
+static std::atomic<unsigned long>           hostBegins(0);
+static std::atomic<unsigned long>           hostDisconnects(0);
+static std::atomic<unsigned long>           hostMdnsDelay(0);
+static std::atomic<unsigned long>           hostMdnsQueries(0);
+
+WiFiClass           WiFi;
+MDNSResponder       MDNS;
+
+namespace host {
+
+void redirect(uint16_t port, const char* toHost, uint16_t toPort) {
+    std::lock_guard<std::mutex> lock(hostNetLock);
+    hostRedirects[port] = HostRedirect{ toHost, toPort };
+}
+
+void setWiFi(bool up) {
+    hostWiFiUp = up;
+}
+
+void setWiFiAssociation(unsigned long ms) {
+    hostAssociation = ms;
+}
+
+WiFiStats wifiStats() {
+    WiFiStats s = { hostBegins, hostDisconnects };
+    return s;
+}
+
+void setMdnsDelay(unsigned long ms) {
+    hostMdnsDelay = ms;
+}
+
+unsigned long mdnsQueries() {
+    return hostMdnsQueries;
+}
+
+int connectSocket(const char* to, uint16_t port) {
+    if (WiFi.status() != WL_CONNECTED) return -1;
+    std::string host = to;
+    {
+        std::lock_guard<std::mutex> lock(hostNetLock);
+        auto r = hostRedirects.find(port);
+        if (r != hostRedirects.end()) {
+            host = r->second.host;
+            port = r->second.port;
+        }
+    }
+    addrinfo hints = {}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host.c_str(), service, &hints, &res) != 0 || !res) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+}
+
+/*
+ * WiFi
+ *      WiFi.begin() restarts the association, which completes
+ *      host::setWiFiAssociation() ms later when the WiFi is up.
+ */
+wl_status_t WiFiClass::status() {
+    unsigned long at = hostAssociatedAt;
+    if (!hostWiFiUp || (at && (long)(millis() - at) < 0)) {
+        return WL_DISCONNECTED;
+    }
+    return WL_CONNECTED;
+}
+
+wl_status_t WiFiClass::begin() {
+    hostBegins++;
+    hostAssociatedAt = millis() + hostAssociation;
+    return status();
+}
+
+wl_status_t WiFiClass::begin(const char* /* ssid */, const char* /* passphrase */) {
+    return begin();
+}
+
+bool WiFiClass::disconnect(bool /* wifioff */) {
+    hostDisconnects++;
+    hostAssociatedAt = millis() + 0x7FFFFFFF;        // until the next begin()
+    return true;
+}
+
+int WiFiClass::hostByName(const char* host, IPAddress& result) {
+    addrinfo hints = {}, *res = NULL;
+    hints.ai_family = AF_INET;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res) return 0;
+    uint32_t a = ((sockaddr_in*)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+    result = IPAddress(a);
+    return 1;
+}
+
+esp_err_t mdns_init() {
+    return ESP_OK;
+}
+
+IPAddress MDNSResponder::queryHost(const char* host, uint32_t timeout) {
+    IPAddress ip;
+    hostMdnsQueries++;
+    if (hostMdnsDelay >= timeout) {
+        delay(timeout);
+        return IPAddress();
+    }
+    delay(hostMdnsDelay);
+    if (!WiFi.hostByName(host, ip)) return IPAddress();
+    return ip;
+}
+
+/*
+ * WiFiClient
+ *      A blocking connect and write, and reads which never wait: the bytes
+ *      the socket has are taken into rx by fill().
+ */
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+    return connect(ip.toString().c_str(), port);
+}
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+    stop();
+    fd = host::connectSocket(host, port);
+    return fd >= 0;
+}
+
+size_t WiFiClient::write(const uint8_t* buf, size_t size) {
+    if (fd < 0 || WiFi.status() != WL_CONNECTED) return 0;
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n = send(fd, buf + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            stop();
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+bool WiFiClient::fill() {
+    if (rxPos < rxLen) return true;
+    if (fd < 0) return false;
+    ssize_t n = recv(fd, rx, sizeof(rx), MSG_DONTWAIT);
+    if (n > 0) {
+        rxPos = 0;
+        rxLen = n;
+        return true;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        ::close(fd);                                // the peer closed, the data read is kept
+        fd = -1;
+    }
+    return false;
+}
+
+int WiFiClient::available() {
+    if (!fill()) return 0;
+    int more = 0;
+    if (fd >= 0) ioctl(fd, FIONREAD, &more);
+    return rxLen - rxPos + more;
+}
+
+int WiFiClient::read() {
+    return fill() ? rx[rxPos++] : -1;
+}
+
+int WiFiClient::read(uint8_t* buf, size_t size) {
+    size_t n = 0;
+    while (n < size && fill()) {
+        size_t k = std::min(size - n, rxLen - rxPos);
+        memcpy(buf + n, rx + rxPos, k);
+        rxPos += k;
+        n += k;
+    }
+    return n ? (int)n : -1;
+}
+
+int WiFiClient::peek() {
+    return fill() ? rx[rxPos] : -1;
+}
+
+void WiFiClient::stop() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    rxPos = rxLen = 0;
+}
+
+uint8_t WiFiClient::connected() {
+    if (WiFi.status() != WL_CONNECTED) {
+        stop();
+        return 0;
+    }
+    fill();
+    return fd >= 0 || rxPos < rxLen;
+}
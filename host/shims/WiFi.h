@@ -0,0 +1,41 @@
+/*
+ * WiFi.h : the ESP32 WiFi for the host build
+ *      The host network is always there; host::setWiFi() takes the WiFi
+ *      down and up, and WiFi.begin() associates after the delay set with
+ *      host::setWiFiAssociation().
+ */
+#pragma once
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+typedef enum {
+    WL_IDLE_STATUS      = 0,
+    WL_NO_SSID_AVAIL    = 1,
+    WL_SCAN_COMPLETED   = 2,
+    WL_CONNECTED        = 3,
+    WL_CONNECT_FAILED   = 4,
+    WL_CONNECTION_LOST  = 5,
+    WL_DISCONNECTED     = 6
+} wl_status_t;
+
+typedef enum {
+    WIFI_OFF = 0,
+    WIFI_STA = 1,
+    WIFI_AP = 2,
+    WIFI_AP_STA = 3
+} wifi_mode_t;
+
+class WiFiClass {
+public:
+    wl_status_t status();
+    wl_status_t begin();
+    wl_status_t begin(const char* ssid, const char* passphrase = NULL);
+    bool disconnect(bool wifioff = false);
+    bool reconnect() { begin(); return true; }
+    bool mode(wifi_mode_t /* m */) { return true; }
+    bool softAPConfig(IPAddress /* local */, IPAddress /* gateway */, IPAddress /* subnet */) { return true; }
+    bool softAP(const char* /* ssid */, const char* /* passphrase */ = NULL) { return true; }
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+    int hostByName(const char* host, IPAddress& result);
+};
+extern WiFiClass WiFi;
@@ -0,0 +1,39 @@
+/*
+ * WiFiClient.h : a TCP client on a POSIX socket for the host build
+ */
+#pragma once
+#include <Arduino.h>
+
+class WiFiClient : public Client {
+public:
+    WiFiClient() : fd(-1), rxPos(0), rxLen(0) {}
+    ~WiFiClient() { stop(); }
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char* host, uint16_t port);
+    int connect(const char* host, uint16_t port, int32_t /* timeout */) { return connect(host, port); }
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t* buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t* buf, size_t size);
+    int peek();
+    void flush() {}
+    void stop();
+    uint8_t connected();
+    operator bool() { return fd >= 0; }
+    int setTimeout(uint32_t /* seconds */) { return 0; }
+    using Print::write;
+
+protected:
+    bool fill();                            // reads what the socket has, without waiting
+
+    int             fd;
+    uint8_t         rx[1460];
+    size_t          rxPos;
+    size_t          rxLen;
+
+private:
+    WiFiClient(const WiFiClient&);
+    WiFiClient& operator=(const WiFiClient&);
+};
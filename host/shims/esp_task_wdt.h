@@ -0,0 +1,12 @@
+/*
+ * esp_task_wdt.h : the task watchdog for the host build
+ *      Counts the tasks added and the resets, host::wdtTasks() and
+ *      host::wdtResets(), and never fires.
+ */
+#pragma once
+#include <Arduino.h>
+
+esp_err_t esp_task_wdt_init(uint32_t timeout, bool panic);
+esp_err_t esp_task_wdt_add(TaskHandle_t task);
+esp_err_t esp_task_wdt_delete(TaskHandle_t task);
+esp_err_t esp_task_wdt_reset();
@@ -0,0 +1,26 @@
+/*
+ * esp_timer.h : the high resolution timers for the host build
+ *      A periodic timer is a detached thread which calls back at each
+ *      period of the host clock, as the esp_timer task does.
+ */
+#pragma once
+#include <Arduino.h>
+
+typedef struct HostTimer* esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void* arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t          callback;
+    void*                   arg;
+    esp_timer_dispatch_t    dispatch_method;
+    const char*             name;
+    bool                    skip_unhandled_events;
+} esp_timer_create_args_t;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period);     // us
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
@@ -0,0 +1,176 @@
+/*
+ * esp_tls.cpp : esp-tls for the host build, on OpenSSL
+ */
+#include <esp_tls.h>
+#include <WiFi.h>
+#include "IOTHost.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct esp_tls {
+    SSL*            ssl;
+    int             fd;
+};
+
+struct esp_tls_client_session {
+    SSL_SESSION*    session;
+};
+
+static std::mutex                   tlsLock;
+static SSL_CTX*                     tlsContext = NULL;
+static bool                         tlsHasCA = false;
+static std::atomic<unsigned long>   tlsDelay(0);
+static std::atomic<unsigned long>   tlsHandshakes(0);
+static std::atomic<unsigned long>   tlsResumed(0);
+static std::atomic<unsigned long>   tlsCAParses(0);
+
+namespace host {
+
+void setTlsDelay(unsigned long ms) {
+    tlsDelay = ms;
+}
+
+unsigned long tlsHandshakes() {
+    return ::tlsHandshakes;
+}
+
+unsigned long tlsResumed() {
+    return ::tlsResumed;
+}
+
+unsigned long caParses() {
+    return tlsCAParses;
+}
+
+}
+
+// under tlsLock
+static SSL_CTX* context() {
+    if (!tlsContext) {
+        tlsContext = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+        SSL_CTX_set_max_proto_version(tlsContext, TLS1_2_VERSION);
+        SSL_CTX_set_verify(tlsContext, SSL_VERIFY_PEER, NULL);
+    }
+    return tlsContext;
+}
+
+static void setTimeout(int fd, int ms) {
+    timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static ssize_t result(esp_tls_t* tls, int n) {
+    if (n > 0) return n;
+    switch (SSL_get_error(tls->ssl, n)) {
+    case SSL_ERROR_WANT_READ:   return ESP_TLS_ERR_SSL_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:  return ESP_TLS_ERR_SSL_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN: return 0;
+    default:                    return ESP_FAIL;
+    }
+}
+
+esp_err_t esp_tls_set_global_ca_store(const unsigned char* cacert_pem_buf, const unsigned int cacert_pem_bytes) {
+    BIO* bio = BIO_new_mem_buf(cacert_pem_buf, cacert_pem_bytes);
+    X509_STORE* store = X509_STORE_new();
+    int certs = 0;
+    for (X509* cert; (cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL; X509_free(cert)) {
+        certs += X509_STORE_add_cert(store, cert);
+    }
+    ERR_clear_error();
+    BIO_free(bio);
+    tlsCAParses++;
+    if (!certs) {
+        X509_STORE_free(store);
+        return ESP_FAIL;
+    }
+    std::lock_guard<std::mutex> lock(tlsLock);
+    SSL_CTX_set_cert_store(context(), store);
+    tlsHasCA = true;
+    return ESP_OK;
+}
+
+void esp_tls_free_global_ca_store() {
+    std::lock_guard<std::mutex> lock(tlsLock);
+    SSL_CTX_set_cert_store(context(), X509_STORE_new());
+    tlsHasCA = false;
+}
+
+esp_tls_t* esp_tls_init() {
+    return new esp_tls{ NULL, -1 };
+}
+
+int esp_tls_conn_new_sync(const char* hostname, int hostlen, int port, const esp_tls_cfg_t* cfg, esp_tls_t* tls) {
+    std::string host(hostname, hostlen);
+    {
+        std::lock_guard<std::mutex> lock(tlsLock);
+        if (!cfg->use_global_ca_store || !tlsHasCA) return -1;     // no server verification
+        tls->ssl = SSL_new(context());
+    }
+    tls->fd = host::connectSocket(host.c_str(), port);
+    if (tls->fd < 0) return -1;
+    tlsHandshakes++;
+    unsigned long ms = tlsDelay;
+    if (ms) {
+        delay(cfg->timeout_ms ? std::min(ms, (unsigned long)cfg->timeout_ms) : ms);
+        if (cfg->timeout_ms && ms >= (unsigned long)cfg->timeout_ms) return -1;
+    }
+    setTimeout(tls->fd, cfg->timeout_ms);
+    SSL_set_fd(tls->ssl, tls->fd);
+    SSL_set_tlsext_host_name(tls->ssl, host.c_str());
+    SSL_set1_host(tls->ssl, cfg->common_name ? cfg->common_name : host.c_str());
+    if (cfg->client_session) SSL_set_session(tls->ssl, cfg->client_session->session);
+    if (SSL_connect(tls->ssl) != 1) {
+        ERR_clear_error();
+        return -1;
+    }
+    if (SSL_session_reused(tls->ssl)) tlsResumed++;
+    setTimeout(tls->fd, 0);
+    return 1;
+}
+
+ssize_t esp_tls_conn_read(esp_tls_t* tls, void* data, size_t datalen) {
+    if (!tls->ssl || WiFi.status() != WL_CONNECTED) return ESP_FAIL;
+    return result(tls, SSL_read(tls->ssl, data, datalen));
+}
+
+ssize_t esp_tls_conn_write(esp_tls_t* tls, const void* data, size_t datalen) {
+    if (!tls->ssl || WiFi.status() != WL_CONNECTED) return ESP_FAIL;
+    return result(tls, SSL_write(tls->ssl, data, datalen));
+}
+
+ssize_t esp_tls_get_bytes_avail(esp_tls_t* tls) {
+    return tls->ssl ? SSL_pending(tls->ssl) : ESP_FAIL;
+}
+
+esp_err_t esp_tls_get_conn_sockfd(esp_tls_t* tls, int* sockfd) {
+    if (tls->fd < 0) return ESP_FAIL;
+    *sockfd = tls->fd;
+    return ESP_OK;
+}
+
+int esp_tls_conn_destroy(esp_tls_t* tls) {
+    if (tls->ssl) SSL_free(tls->ssl);
+    if (tls->fd >= 0) close(tls->fd);
+    delete tls;
+    return 0;
+}
+
+// a copy, as mbedtls_ssl_get_session(), which the end of the connection does not spoil
+esp_tls_client_session_t* esp_tls_get_client_session(esp_tls_t* tls) {
+    SSL_SESSION* session = tls->ssl ? SSL_get_session(tls->ssl) : NULL;
+    if (!session || !SSL_SESSION_is_resumable(session)) return NULL;
+    return new esp_tls_client_session{ SSL_SESSION_dup(session) };
+}
+
+void esp_tls_free_client_session(esp_tls_client_session_t* client_session) {
+    SSL_SESSION_free(client_session->session);
+    delete client_session;
+}
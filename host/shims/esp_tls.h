@@ -0,0 +1,39 @@
+/*
+ * esp_tls.h : esp-tls of ESP-IDF for the host build, on OpenSSL
+ *      The part IBMIOTF32.h uses: a blocking connection with the global CA
+ *      store and the client session tickets, and reads and writes which
+ *      follow the socket, non-blocking when it is made so. The handshake is
+ *      TLS 1.2, as mbedTLS of the ESP32 core, with the host name checked
+ *      against the certificate.
+ */
+#pragma once
+#include <Arduino.h>
+#include <sys/types.h>
+
+#define CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS 1
+#define ESP_TLS_ERR_SSL_WANT_READ           -0x6900
+#define ESP_TLS_ERR_SSL_WANT_WRITE          -0x6880
+
+typedef struct esp_tls esp_tls_t;
+typedef struct esp_tls_client_session esp_tls_client_session_t;
+
+typedef struct {
+    bool                        use_global_ca_store;
+    int                         timeout_ms;
+    const char*                 common_name;        // the host name when NULL
+    esp_tls_client_session_t*   client_session;
+} esp_tls_cfg_t;
+
+esp_err_t esp_tls_set_global_ca_store(const unsigned char* cacert_pem_buf, const unsigned int cacert_pem_bytes);
+void esp_tls_free_global_ca_store();
+
+esp_tls_t* esp_tls_init();
+int esp_tls_conn_new_sync(const char* hostname, int hostlen, int port, const esp_tls_cfg_t* cfg, esp_tls_t* tls);
+ssize_t esp_tls_conn_read(esp_tls_t* tls, void* data, size_t datalen);
+ssize_t esp_tls_conn_write(esp_tls_t* tls, const void* data, size_t datalen);
+ssize_t esp_tls_get_bytes_avail(esp_tls_t* tls);
+esp_err_t esp_tls_get_conn_sockfd(esp_tls_t* tls, int* sockfd);
+int esp_tls_conn_destroy(esp_tls_t* tls);
+
+esp_tls_client_session_t* esp_tls_get_client_session(esp_tls_t* tls);
+void esp_tls_free_client_session(esp_tls_client_session_t* client_session);
@@ -0,0 +1,499 @@
+/*
+ * fleet.cpp : a fleet of simulated devices against one broker
+ *      iotfleet runs the broker, MiniBroker or the mosquitto of IOT_MOSQUITTO,
+ *      a FaultProxy in front of it, and starts the devices, each a process of
+ *      its own running this program with --device, since the library keeps
+ *      a device in its globals. Each device has its own SPIFFS directory and
+ *      runs initDevice() and iotLoop() as a sketch does, publishes a status
+ *      event every --interval ms and answers the ping command. They are all
+ *      released at once, and the controller measures from what reaches the
+ *      broker:
+ *          the connect storm, from the release to each manage message
+ *          the publish throughput, and the status events lost
+ *          the round trip of a command and its reply, in percentiles
+ *          the memory of a device, heap and resident set
+ *      One process per device, not N devices in a process: the library keeps
+ *      its device, connection and queues in globals, as a sketch has one, and
+ *      a process is the only way to run it unchanged. Thousands stay
+ *      practical because a device process is small, the program text is
+ *      shared and the rest is a few hundred KB of its own, it sleeps --tick ms
+ *      between its loop() calls, and the broker, the proxy and the controller
+ *      wait in poll() on all the sockets and the pipes at once. The open files
+ *      are raised to the hard limit, and the processes count against
+ *      ulimit -u.
+ *      The faults are scripted with --fault, more than once:
+ *          restart         the broker is killed and restarted a third of the
+ *                          way, and the reconnection storm is measured
+ *          loss:PCT        the proxy loses PCT% of the PUBLISH packets
+ *          slowtls:MS      the devices connect over TLS, the direct mode,
+ *                          with a handshake of MS ms
+ *      In the direct mode a TlsProxy in front of the FaultProxy terminates
+ *      the TLS, with a CA the devices find in DIR/ca.pem, and counts the
+ *      handshakes which resumed a session.
+ *
+ *          iotfleet [--devices N] [--duration S] [--interval MS] [--tick MS] [--fault F]...
+ */
+#include "HostDevice.h"
+#include "FaultProxy.h"
+#include "TlsProxy.h"
+#include <algorithm>
+#include <map>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+struct FleetOptions {
+    int             devices = 20;
+    unsigned long   duration = 10;          // s of publishing
+    unsigned long   interval = 200;         // ms between the status events of a device
+    unsigned long   tick = 2;               // ms a device sleeps between its loop() calls
+    bool            restart = false;
+    int             loss = 0;
+    unsigned long   tlsDelay = 0;
+    bool            direct = false;
+    std::string     dir = "fleet.spiffs";
+};
+
+const char          FLEET_TYPE[] = "fleetType";
+const char          FLEET_SERVER[] = "fleet.messaging.internetofthings.ibmcloud.com";
+
+void fleetDevId(char* out, size_t size, int i) {
+    snprintf(out, size, "f%05d", i);
+}
+
+long residentKB() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Device
+ *      Says it is ready on stdout, waits for the byte of the release on stdin,
+ *      then connects and runs until the stop command, and writes its report
+ *      to stdout. Each line is a single write, shorter than PIPE_BUF, so the
+ *      lines of the devices do not mix in the shared pipe.
+ */
+bool                devStop = false;
+char                devId[16];
+char                pongTopic[IOT_DEVICE_TOPIC_LENGTH];
+
+void pingHandler(const char* cmdId, JsonDocument* root) {
+    char payload[96];
+    int n = snprintf(payload, sizeof(payload), "{\"d\":{\"dev\":\"%s\",\"seq\":%lu}}",
+                     devId, (*root)["d"]["seq"].as<unsigned long>());
+    iotPublish(pongTopic, payload, n);
+}
+
+void stopHandler(const char* cmdId, JsonDocument* root) {
+    devStop = true;
+}
+
+int runDevice(int index, uint16_t port, const FleetOptions& o) {
+    long rssBase = residentKB();
+    host::setSerial(false);
+    fleetDevId(devId, sizeof(devId), index);
+    char dir[256], meta[96];
+    snprintf(dir, sizeof(dir), "%s/%s", o.dir.c_str(), devId);
+    snprintf(meta, sizeof(meta), "{\"pubInterval\":%lu,\"dev\":\"%s\"}", o.interval, devId);
+    hostConfig(dir, o.direct ? "fleet" : "127.0.0.1", FLEET_TYPE, devId, meta);
+    if (o.direct) {
+        char pem[4096] = "";
+        FILE* f = fopen((o.dir + "/ca.pem").c_str(), "r");
+        if (!f) host::exit(2);
+        pem[fread(pem, 1, sizeof(pem) - 1, f)] = '\0';
+        fclose(f);
+        hostCA(pem);
+    }
+    host::redirect(o.direct ? 8883 : 1883, "127.0.0.1", port);
+    host::setTlsDelay(o.tlsDelay);
+    host::setWiFi(true);
+    initDevice();
+    iotOnCommand("ping", pingHandler);
+    iotOnCommand("stop", stopHandler);
+    if (!IOT_GATEWAY || !gatewayTopic(pongTopic, sizeof(pongTopic), "iot-2/evt/pong/fmt/json", FLEET_TYPE, devId)) {
+        strcpy(pongTopic, "iot-2/evt/pong/fmt/json");
+    }
+
+    char line[32], go;
+    int len = snprintf(line, sizeof(line), "ready %s\n", devId);
+    if (write(1, line, len) != len || read(0, &go, 1) != 1) host::exit(2);
+    set_iot_server();
+    iotRetryAt = millis();
+    unsigned long published = 0, lastAt = 0;
+    char payload[96];
+    while (!devStop) {
+        iotLoop();
+        if (iotState == IOT_CONNECTED && millis() - lastAt >= o.interval) {
+            lastAt = millis();
+            int n = snprintf(payload, sizeof(payload), "{\"d\":{\"dev\":\"%s\",\"n\":%lu,\"temp\":%d}}",
+                             devId, published, 20 + (int)(published % 10));
+            if (iotPublish(publishTopic, payload, n)) published++;
+        }
+        delay(o.tick);
+    }
+
+    char report[512];
+    int n = snprintf(report, sizeof(report),
+                     "report %s published %lu acked %lu resent %lu failed %lu queued %lu dropped %lu "
+                     "reconnects %lu handshakes %lu resumed %lu heap %lu rss %ld base %ld\n",
+                     devId, published, inflightStats.acked, inflightStats.resent, inflightStats.failed,
+                     pubqStats.queued, pubqStats.dropped, iotMetrics.reconnects, host::tlsHandshakes(),
+                     host::tlsResumed(),                     host::heapInUse(), residentKB(), rssBase);
+    if (write(1, report, n) != n) host::exit(2);
+    host::exit(0);
+    return 0;
+}
+
+/*
+ * Controller
+ */
+struct DeviceReport {
+    unsigned long   published, acked, resent, failed, queued, dropped, reconnects, handshakes, resumed, heap;
+    long            rss, base;
+};
+
+struct Percentiles {
+    size_t          n;
+    double          p50, p90, p99, max;
+};
+
+Percentiles percentiles(std::vector<double> v) {
+    Percentiles p = { v.size(), 0, 0, 0, 0 };
+    if (v.empty()) return p;
+    std::sort(v.begin(), v.end());
+    auto at = [&](double q) { return v[std::min(v.size() - 1, (size_t)(q * v.size()))]; };
+    p.p50 = at(0.50);
+    p.p90 = at(0.90);
+    p.p99 = at(0.99);
+    p.max = v.back();
+    return p;
+}
+
+void printPercentiles(const char* name, const Percentiles& p, const char* unit) {
+    printf("%-16s n %-6zu p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f %s\n",
+           name, p.n, p.p50, p.p90, p.p99, p.max, unit);
+}
+
+class Fleet {
+public:
+    Fleet(const FleetOptions& o) : o(o), scanned(0) {}
+
+    TestBroker*                         broker;
+    FaultProxy                          proxy;
+    uint16_t                            brokerPort;
+    std::vector<pid_t>                  pids;
+    int                                 release[2];
+    int                                 reports[2];
+
+    // the announcements from index on, by device, in micros()
+    std::map<std::string, unsigned long> announced;
+    std::map<std::string, unsigned long> statusCount;
+    std::map<std::string, std::vector<bool>> statusSeen;
+    std::map<std::pair<std::string, unsigned long>, unsigned long> pingSent;
+    std::vector<double>                 rtt;
+    unsigned long                       statusInWindow = 0;
+
+    bool spawn(const char* self) {
+        if (pipe(release) || pipe(reports)) return false;
+        char port[8], index[8], interval[16], tick[16], tls[16];
+        snprintf(port, sizeof(port), "%u", devicePort);
+        snprintf(interval, sizeof(interval), "%lu", o.interval);
+        snprintf(tick, sizeof(tick), "%lu", o.tick);
+        snprintf(tls, sizeof(tls), "%lu", o.tlsDelay);
+        for (int i = 0; i < o.devices; i++) {
+            snprintf(index, sizeof(index), "%d", i);
+            pid_t pid = fork();
+            if (pid == 0) {
+                dup2(release[0], 0);
+                dup2(reports[1], 1);
+                close(release[1]);
+                close(reports[0]);
+                execl(self, self, "--device", index, "--port", port, "--interval", interval,
+                      "--tick", tick, "--tls", tls, "--dir", o.dir.c_str(), o.direct ? "--direct" : "--gateway", (char*)NULL);
+                _exit(127);
+            }
+            if (pid < 0) return false;
+            pids.push_back(pid);
+        }
+        close(release[0]);
+        close(reports[1]);
+        return true;
+    }
+
+    // reads the new messages of the broker into the tables
+    void scan() {
+        std::vector<BrokerMessage> log = broker->messages(scanned);
+        scanned += log.size();
+        StaticJsonDocument<256> doc;
+        for (const BrokerMessage& m : log) {
+            bool manage = m.topic.find("/mgmt/manage") != std::string::npos;
+            bool status = m.topic.find("/evt/status/") != std::string::npos;
+            bool pong = m.topic.find("/evt/pong/") != std::string::npos;
+            if (!(manage || status || pong) || deserializeJson(doc, m.payload)) continue;
+            if (manage) {
+                const char* dev = doc["d"]["metadata"]["dev"];
+                if (dev && !announced.count(dev)) announced[dev] = m.at;
+            } else if (status) {
+                std::string dev = doc["d"]["dev"] | "";
+                unsigned long n = doc["d"]["n"];
+                std::vector<bool>& seen = statusSeen[dev];
+                if (seen.size() <= n) seen.resize(n + 1);
+                if (!seen[n]) statusCount[dev]++;
+                seen[n] = true;
+                if (m.at >= windowFrom && m.at < windowTo) statusInWindow++;
+            } else {
+                auto sent = pingSent.find(std::make_pair(std::string(doc["d"]["dev"] | ""),
+                                                         doc["d"]["seq"].as<unsigned long>()));
+                if (sent != pingSent.end()) {
+                    rtt.push_back((m.at - sent->second) / 1000.0);
+                    pingSent.erase(sent);
+                }
+            }
+        }
+    }
+
+    // a command to every device, one publish in the direct mode where they share the topics
+    void command(const char* cmdId, unsigned long seq) {
+        char topic[128], payload[64], dev[16];
+        snprintf(payload, sizeof(payload), "{\"d\":{\"seq\":%lu}}", seq);
+        if (o.direct) {
+            snprintf(topic, sizeof(topic), "iot-2/cmd/%s/fmt/json", cmdId);
+            unsigned long at = micros();
+            broker->publish(topic, payload);
+            for (int i = 0; i < o.devices && !strcmp(cmdId, "ping"); i++) {
+                fleetDevId(dev, sizeof(dev), i);
+                pingSent[std::make_pair(std::string(dev), seq)] = at;
+            }
+            return;
+        }
+        for (int i = 0; i < o.devices; i++) {
+            fleetDevId(dev, sizeof(dev), i);
+            snprintf(topic, sizeof(topic), "iot-2/type/%s/id/%s/cmd/%s/fmt/json", FLEET_TYPE, dev, cmdId);
+            if (!strcmp(cmdId, "ping")) pingSent[std::make_pair(std::string(dev), seq)] = micros();
+            broker->publish(topic, payload);
+        }
+    }
+
+    // waits for every device to announce itself after since, the micros() of each
+    std::vector<double> storm(unsigned long since, unsigned long timeoutMs) {
+        announced.clear();
+        unsigned long t0 = millis();
+        while ((int)announced.size() < o.devices && millis() - t0 < timeoutMs) {
+            scan();
+            delay(5);
+        }
+        std::vector<double> ms;
+        for (auto& a : announced) ms.push_back((a.second - since) / 1000.0);
+        return ms;
+    }
+
+    // the lines of the devices starting with prefix, until one from each or the timeout
+    std::vector<std::string> lines(const char* prefix, unsigned long timeoutMs) {
+        std::vector<std::string> out;
+        unsigned long t0 = millis();
+        char buf[4096];
+        while ((int)out.size() < o.devices && millis() - t0 < timeoutMs) {
+            for (size_t nl; (nl = pending.find('\n')) != std::string::npos; pending.erase(0, nl + 1)) {
+                if (!pending.compare(0, strlen(prefix), prefix)) out.push_back(pending.substr(0, nl));
+            }
+            if ((int)out.size() == o.devices) break;
+            pollfd pfd = { reports[0], POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) continue;
+            ssize_t n = read(reports[0], buf, sizeof(buf));
+            if (n <= 0) break;
+            pending.append(buf, n);
+        }
+        return out;
+    }
+
+    std::vector<DeviceReport> collect(unsigned long timeoutMs) {
+        std::vector<DeviceReport> out;
+        for (const std::string& line : lines("report ", timeoutMs)) {
+            DeviceReport r;
+            char dev[16];
+            if (sscanf(line.c_str(), "report %15s published %lu acked %lu resent %lu failed %lu "
+                       "queued %lu dropped %lu reconnects %lu handshakes %lu resumed %lu heap %lu rss %ld base %ld",
+                       dev, &r.published, &r.acked, &r.resent, &r.failed, &r.queued, &r.dropped,
+                       &r.reconnects, &r.handshakes, &r.resumed, &r.heap, &r.rss, &r.base) == 13) {
+                out.push_back(r);
+            }
+        }
+        return out;
+    }
+
+    void reap() {
+        for (pid_t pid : pids) kill(pid, SIGKILL);
+        for (pid_t pid : pids) waitpid(pid, NULL, 0);
+    }
+
+    const FleetOptions& o;
+    uint16_t            proxyPort;
+    uint16_t            devicePort;         // the proxy, or the TLS in front of it
+    TlsProxy            tls;
+    size_t              scanned;
+    std::string         pending;            // a part of a line from the devices
+    unsigned long       windowFrom = 0, windowTo = 0;
+};
+
+int runFleet(const char* self, const FleetOptions& o) {
+    signal(SIGPIPE, SIG_IGN);
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;    // two sockets a device in the proxy, one in the broker
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    mkdir(o.dir.c_str(), 0755);
+    Fleet fleet(o);
+    fleet.broker = makeTestBroker();
+    fleet.brokerPort = fleet.broker->start();
+    if (!fleet.brokerPort) {
+        printf("the broker did not start\n");
+        return 1;
+    }
+    fleet.proxyPort = fleet.proxy.start(fleet.brokerPort);
+    fleet.devicePort = fleet.proxyPort;
+    if (o.direct) {
+        fleet.devicePort = fleet.tls.start(fleet.proxyPort, FLEET_SERVER);
+        FILE* f = fopen((o.dir + "/ca.pem").c_str(), "w");
+        if (!fleet.devicePort || !f || fputs(fleet.tls.caPem().c_str(), f) < 0) {
+            printf("the TLS proxy did not start\n");
+            return 1;
+        }
+        fclose(f);
+    }
+    fleet.proxy.dropPercent = o.loss;
+    printf("fleet: %d devices, %s, %s, %lu s at one status per %lu ms",
+           o.devices, o.direct ? "direct over TLS" : "gateway", fleet.broker->name(), o.duration, o.interval);
+    if (o.restart) printf(", broker restart");
+    if (o.loss) printf(", %d%% loss", o.loss);
+    if (o.tlsDelay) printf(", %lu ms TLS handshake", o.tlsDelay);
+    printf("\n");
+    if (!fleet.spawn(self)) {
+        printf("the devices did not start\n");
+        fleet.reap();
+        return 1;
+    }
+    size_t ready = fleet.lines("ready ", 60000 + 20 * o.devices).size();
+    if ((int)ready != o.devices) {
+        printf("%zu of %d devices started\n", ready, o.devices);
+        fleet.reap();
+        return 1;
+    }
+    std::string go(o.devices, 'g');
+    unsigned long released = micros();
+    if (write(fleet.release[1], go.data(), go.size()) != (ssize_t)go.size()) return 1;
+
+    std::vector<double> storm = fleet.storm(released, 60000 + 50 * o.devices);
+    printPercentiles("connect storm", percentiles(storm), "ms");
+    bool ok = (int)storm.size() == o.devices;
+
+    // publishing and pinging, with the restart a third of the way
+    unsigned long t0 = millis();
+    fleet.windowFrom = micros();
+    fleet.windowTo = fleet.windowFrom + o.duration * 1000000UL;
+    unsigned long seq = 0, lastPing = 0;
+    bool restarted = !o.restart;
+    std::vector<double> reconnect;
+    while (millis() - t0 < o.duration * 1000) {
+        if (!restarted && millis() - t0 >= o.duration * 1000 / 3) {
+            restarted = true;
+            fleet.broker->stop();
+            delay(1000);
+            fleet.broker->start(fleet.brokerPort);
+            unsigned long back = micros();
+            reconnect = fleet.storm(back, 60000 + 50 * o.devices);
+            printPercentiles("restart storm", percentiles(reconnect), "ms");
+            ok = ok && (int)reconnect.size() == o.devices;
+        }
+        if (millis() - lastPing >= 500) {
+            lastPing = millis();
+            fleet.command("ping", ++seq);
+        }
+        fleet.scan();
+        delay(5);
+    }
+    double seconds = (micros() - fleet.windowFrom) / 1e6;
+    delay(2000);                            // the last replies and resends
+    fleet.scan();
+    printPercentiles("command rtt", percentiles(fleet.rtt), "ms");
+
+    fleet.command("stop", 0);
+    std::vector<DeviceReport> reports = fleet.collect(30000);
+    fleet.scan();
+    fleet.reap();
+    ok = ok && (int)reports.size() == o.devices;
+
+    unsigned long published = 0, delivered = 0, resent = 0, failed = 0, dropped = 0;
+    unsigned long heap = 0, handshakes = 0, resumed = 0, reconnects = 0;
+    long rss = 0, base = 0;
+    for (const DeviceReport& r : reports) {
+        published += r.published;
+        resent += r.resent;
+        failed += r.failed;
+        dropped += r.dropped;
+        heap += r.heap;
+        rss += r.rss;
+        base += r.base;
+        handshakes += r.handshakes;
+        resumed += r.resumed;
+        reconnects += r.reconnects;
+    }
+    for (auto& c : fleet.statusCount) delivered += c.second;
+    size_t n = max(reports.size(), (size_t)1);
+    printf("%-16s %lu status events in %.1f s, %.0f msg/s through the broker\n", "publish",
+           fleet.statusInWindow, seconds, fleet.statusInWindow / seconds);
+    printf("%-16s published %lu, delivered %lu, resent %lu, given up %lu, queue dropped %lu, reconnects %lu\n",
+           "delivery", published, delivered, resent, failed, dropped, reconnects);
+    if (o.loss) {
+        printf("%-16s %lu of %lu PUBLISH packets lost by the proxy\n", "loss",
+               fleet.proxy.dropped.load(), fleet.proxy.dropped.load() + fleet.proxy.forwarded.load());
+    }
+    if (o.direct) {
+        printf("%-16s %lu handshakes, %lu resumed a session, %lu failed at the broker\n", "tls",
+               handshakes, resumed, fleet.tls.failed.load());
+    }
+    printf("%-16s heap %.1f KB, resident %.1f KB of which %.1f KB after the setup\n", "per device",
+           heap / 1024.0 / n, (double)rss / n, (double)(rss - base) / n);
+    printf("%-16s %zu of %d devices reported\n", ok ? "OK" : "FAILED", reports.size(), o.devices);
+    fflush(stdout);
+    host::exit(ok ? 0 : 1);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    FleetOptions o;
+    int device = -1;
+    uint16_t port = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : "";
+        if (a == "--devices") o.devices = atoi(v), i++;
+        else if (a == "--duration") o.duration = atol(v), i++;
+        else if (a == "--interval") o.interval = atol(v), i++;
+        else if (a == "--tick") o.tick = atol(v), i++;
+        else if (a == "--dir") o.dir = v, i++;
+        else if (a == "--device") device = atoi(v), i++;
+        else if (a == "--port") port = atoi(v), i++;
+        else if (a == "--tls") o.tlsDelay = atol(v), i++;
+        else if (a == "--direct") o.direct = true;
+        else if (a == "--gateway") o.direct = false;
+        else if (a == "--fault" && !strcmp(v, "restart")) o.restart = true, i++;
+        else if (a == "--fault" && !strncmp(v, "loss:", 5)) o.loss = atoi(v + 5), i++;
+        else if (a == "--fault" && !strncmp(v, "slowtls:", 8)) o.tlsDelay = atol(v + 8), o.direct = true, i++;
+        else {
+            printf("usage: %s [--devices N] [--duration S] [--interval MS] [--tick MS] [--dir DIR]\n"
+                   "       [--fault restart] [--fault loss:PCT] [--fault slowtls:MS]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (device >= 0) return runDevice(device, port, o);
+    return runFleet("/proc/self/exe", o);
+}
@@ -0,0 +1,158 @@
+/*
+ * FaultProxy.cpp : an MQTT aware TCP proxy which loses packets
+ */
+#include "FaultProxy.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+FaultProxy::FaultProxy() : dropPercent(0), dropped(0), forwarded(0), listenFd(-1), upstream(0),
+            stopping(false), seed(7) {}
+
+FaultProxy::~FaultProxy() {
+    stop();
+}
+
+uint16_t FaultProxy::start(uint16_t upstreamPort) {
+    stop();
+    upstream = upstreamPort;
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 1024) != 0) {
+        ::close(listenFd);
+        listenFd = -1;
+        return 0;
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listenFd, (sockaddr*)&addr, &len);
+    stopping = false;
+    thread = std::thread(&FaultProxy::run, this);
+    return ntohs(addr.sin_port);
+}
+
+void FaultProxy::stop() {
+    if (thread.joinable()) {
+        stopping = true;
+        thread.join();
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    for (Pipe& p : pipes) {
+        ::close(p.down);
+        ::close(p.up);
+    }
+    pipes.clear();
+    if (listenFd >= 0) ::close(listenFd);
+    listenFd = -1;
+}
+
+size_t FaultProxy::connections() {
+    std::lock_guard<std::mutex> guard(lock);
+    return pipes.size();
+}
+
+void FaultProxy::run() {
+    std::vector<pollfd> fds;
+    while (!stopping) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            fds.assign(1, pollfd{ listenFd, POLLIN, 0 });
+            for (Pipe& p : pipes) {
+                fds.push_back(pollfd{ p.down, POLLIN, 0 });
+                fds.push_back(pollfd{ p.up, POLLIN, 0 });
+            }
+        }
+        if (poll(fds.data(), fds.size(), 20) <= 0) continue;
+        std::lock_guard<std::mutex> guard(lock);
+        if (fds[0].revents & POLLIN) {
+            int down = accept(listenFd, NULL, NULL);
+            if (down >= 0) {
+                int up = socket(AF_INET, SOCK_STREAM, 0);
+                sockaddr_in addr = {};
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                addr.sin_port = htons(upstream);
+                if (connect(up, (sockaddr*)&addr, sizeof(addr)) == 0) {
+                    int one = 1;
+                    setsockopt(down, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    setsockopt(up, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    pipes.push_back(Pipe{ down, up, "", false });
+                } else {
+                    ::close(up);                    // the broker is down, so is the device
+                    ::close(down);
+                }
+            }
+        }
+        // the pipes are in the order of their fds, those accepted above have none
+        for (size_t i = 1, k = 0; i + 1 < fds.size() && k < pipes.size(); i += 2, k++) {
+            Pipe& p = pipes[k];
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !fromDevice(p)) p.closing = true;
+            if ((fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && !relay(p.up, p.down)) p.closing = true;
+        }
+        for (size_t i = 0; i < pipes.size(); ) {
+            if (pipes[i].closing) {
+                ::close(pipes[i].down);
+                ::close(pipes[i].up);
+                pipes.erase(pipes.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+// forwards the whole frames from the device, less the PUBLISH packets it loses
+bool FaultProxy::fromDevice(Pipe& p) {
+    char buf[4096];
+    ssize_t n = recv(p.down, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return false;
+    if (n > 0) p.in.append(buf, n);
+    for (;;) {
+        size_t remaining = 0, pos = 1;
+        int shift = 0;
+        for (;;) {
+            if (pos >= p.in.size()) return true;    // the length is not all in
+            uint8_t b = p.in[pos++];
+            remaining |= (size_t)(b & 0x7F) << shift;
+            shift += 7;
+            if (!(b & 0x80)) break;
+        }
+        if (p.in.size() < pos + remaining) return true;
+        if (((uint8_t)p.in[0] & 0xF0) == 0x30) {
+            seed = seed * 1103515245 + 12345;
+            if (dropPercent && (int)((seed >> 16) % 100) < dropPercent) {
+                dropped++;
+                p.in.erase(0, pos + remaining);
+                continue;
+            }
+            forwarded++;
+        }
+        if (!sendAll(p.up, p.in.data(), pos + remaining)) return false;
+        p.in.erase(0, pos + remaining);
+    }
+}
+
+bool FaultProxy::relay(int from, int to) {
+    char buf[4096];
+    ssize_t n = recv(from, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return false;
+    return n < 0 || sendAll(to, buf, n);
+}
+
+bool FaultProxy::sendAll(int fd, const char* data, size_t len) {
+    while (len) {
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
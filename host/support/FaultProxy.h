@@ -0,0 +1,50 @@
+/*
+ * FaultProxy.h : an MQTT aware TCP proxy which loses packets
+ *      Between the devices and a broker, MiniBroker or mosquitto alike. It
+ *      follows the MQTT frames the devices send and drops dropPercent of
+ *      their PUBLISH packets whole, as a network losing them for longer than
+ *      TCP retries would, and forwards everything else as it comes. When the
+ *      broker goes away, the connections of the devices are closed with it.
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class FaultProxy {
+public:
+    FaultProxy();
+    ~FaultProxy();
+
+    uint16_t start(uint16_t upstreamPort);  // the port to connect to, 0 on a failure
+    void stop();
+    size_t connections();
+
+    std::atomic<int>            dropPercent;
+    std::atomic<unsigned long>  dropped;
+    std::atomic<unsigned long>  forwarded;  // the PUBLISH packets
+
+private:
+    struct Pipe {
+        int                         down;   // the device
+        int                         up;     // the broker
+        std::string                 in;     // from the device, up to a whole frame
+        bool                        closing;
+    };
+
+    void run();
+    bool fromDevice(Pipe& p);
+    static bool relay(int from, int to);
+    static bool sendAll(int fd, const char* data, size_t len);
+
+    int                         listenFd;
+    uint16_t                    upstream;
+    std::atomic<bool>           stopping;
+    std::thread                 thread;
+    std::mutex                  lock;
+    std::vector<Pipe>           pipes;
+    uint32_t                    seed;
+};
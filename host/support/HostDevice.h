@@ -0,0 +1,86 @@
+/*
+ * HostDevice.h : the device of a host test, benchmark or simulator
+ *      Included once by each program, after its -D options, as the sketch
+ *      includes IBMIOTF32.h. hostDevice() writes the configuration of a
+ *      gateway device into its SPIFFS directory, points port 1883 at the
+ *      broker of the test and runs the setup of the sketch, so the test then
+ *      drives iotLoop() with waitFor(). A device in the direct mode is set up
+ *      with hostConfig() and hostCA(), for a TlsProxy on port 8883. A failed
+ *      CHECK ends the test.
+ */
+#pragma once
+#include <IOTHost.h>
+#include <IBMIOTF32.h>
+#include "TestBroker.h"
+#include <chrono>
+
+String              user_html = "";
+char*               ssid_pfix = (char*)"IOTHost";
+
+// the clock of the host, for the timings of the benchmarks and the simulator
+unsigned long long hostNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            host::exit(1); \
+        } \
+    } while (0)
+
+// a fresh SPIFFS in dir with the configuration of the setup portal, meta as JSON
+void hostConfig(const char* dir, const char* org, const char* devType, const char* devId, const char* meta) {
+    host::setFsRoot(dir);
+    SPIFFS.format();
+    char config[512];
+    snprintf(config, sizeof(config),
+             "{\"config\":\"done\",\"ssid\":\"host\",\"w_pw\":\"secret\",\"org\":\"%s\","
+             "\"devType\":\"%s\",\"devId\":\"%s\",\"token\":\"secret\",\"meta\":%s}",
+             org, devType, devId, meta);
+    File f = SPIFFS.open("/config.json", "w");
+    f.write((const uint8_t*)config, strlen(config));
+    f.close();
+}
+
+// the CA of a device in the direct mode, /ca.txt, after hostConfig()
+void hostCA(const char* pem) {
+    File f = SPIFFS.open("/ca.txt", "w");
+    f.write((const uint8_t*)pem, strlen(pem));
+    f.close();
+}
+
+// a fresh gateway device in dir, connecting to 127.0.0.1:port
+void hostDevice(const char* dir, uint16_t port, const char* devId = "host1",
+                const char* meta = "{\"pubInterval\":1000}") {
+    hostConfig(dir, "127.0.0.1", "hostType", devId, meta);
+    host::redirect(1883, "127.0.0.1", port);
+    host::setWiFi(true);
+    initDevice();
+    set_iot_server();
+    iotRetryAt = millis();                  // the WiFi is up already
+}
+
+// runs iotLoop() until cond or ms, true on cond
+template <typename Cond>
+bool waitFor(Cond cond, unsigned long ms = 10000) {
+    unsigned long t0 = millis();
+    while (!cond()) {
+        if (millis() - t0 > ms) return false;
+        iotLoop();
+        delay(1);
+    }
+    return true;
+}
+
+bool waitConnected(unsigned long ms = 10000) {
+    return waitFor([]() { return iotState == IOT_CONNECTED; }, ms);
+}
+
+// the tasks of the library are still running, so no static destructors
+void finish(const char* name) {
+    printf("%s OK\n", name);
+    fflush(stdout);
+    host::exit(0);
+}
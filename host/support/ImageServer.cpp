@@ -0,0 +1,118 @@
+/*
+ * ImageServer.cpp : an HTTP server of one firmware image
+ */
+#include "ImageServer.h"
+#include <algorithm>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+ImageServer::ImageServer() : listenFd(-1), stopping(false), cut(0), chunk(0), interval(0) {}
+
+ImageServer::~ImageServer() {
+    stop();
+}
+
+uint16_t ImageServer::start(const std::string& image) {
+    stop();
+    this->image = image;
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0) {
+        ::close(listenFd);
+        listenFd = -1;
+        return 0;
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listenFd, (sockaddr*)&addr, &len);
+    stopping = false;
+    thread = std::thread(&ImageServer::run, this);
+    return ntohs(addr.sin_port);
+}
+
+void ImageServer::stop() {
+    if (thread.joinable()) {
+        stopping = true;
+        thread.join();
+    }
+    if (listenFd >= 0) ::close(listenFd);
+    listenFd = -1;
+}
+
+void ImageServer::cutAfter(size_t bytes) {
+    cut = bytes;
+}
+
+void ImageServer::pace(size_t chunk, unsigned ms) {
+    this->chunk = chunk;
+    interval = ms;
+}
+
+std::vector<std::string> ImageServer::ranges() {
+    std::lock_guard<std::mutex> guard(lock);
+    return requests;
+}
+
+// one request at a time, as the OTA task makes them
+void ImageServer::run() {
+    while (!stopping) {
+        pollfd p = { listenFd, POLLIN, 0 };
+        if (poll(&p, 1, 20) <= 0) continue;
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) continue;
+        timeval tv = { 5, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        serve(fd);
+        ::close(fd);
+    }
+}
+
+void ImageServer::serve(int fd) {
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) return;
+        request.append(buf, n);
+    }
+    std::string range;
+    size_t from = 0;
+    size_t at = request.find("\r\nRange: ");
+    if (at != std::string::npos) {
+        range = request.substr(at + 9, request.find("\r\n", at + 2) - at - 9);
+        if (sscanf(range.c_str(), "bytes=%zu-", &from) != 1 || from >= image.size()) from = 0;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        requests.push_back(range);
+    }
+    char head[256];
+    if (from) {
+        snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\n"
+                 "Content-Range: bytes %zu-%zu/%zu\r\nConnection: close\r\n\r\n",
+                 image.size() - from, from, image.size() - 1, image.size());
+    } else {
+        snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+                 "Content-Type: application/octet-stream\r\nConnection: close\r\n\r\n", image.size());
+    }
+    if (send(fd, head, strlen(head), MSG_NOSIGNAL) <= 0) return;
+    size_t end = image.size();
+    size_t limit = cut.exchange(0);
+    if (limit && from + limit < end) end = from + limit;
+    for (size_t pos = from; pos < end && !stopping; ) {
+        size_t n = chunk ? std::min((size_t)chunk, end - pos) : end - pos;
+        ssize_t sent = send(fd, image.data() + pos, n, MSG_NOSIGNAL);
+        if (sent <= 0) return;
+        pos += sent;
+        if (interval) usleep(interval * 1000);
+    }
+}
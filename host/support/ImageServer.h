@@ -0,0 +1,40 @@
+/*
+ * ImageServer.h : an HTTP server of one firmware image
+ *      Answers a GET with the image, or with its tail, 206, for a Range of
+ *      bytes=N-, paced in chunks so the progress of a download can be seen,
+ *      and can cut the body of a response after a number of bytes. Each
+ *      request is recorded with its Range.
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ImageServer {
+public:
+    ImageServer();
+    ~ImageServer();
+
+    uint16_t start(const std::string& image);   // the port, 0 on a failure
+    void stop();
+    void cutAfter(size_t bytes);                // the next response closes after bytes of the body
+    void pace(size_t chunk, unsigned ms);       // chunk bytes every ms, 0 for at once
+    std::vector<std::string> ranges();          // the Range of each request, "" without
+
+private:
+    void run();
+    void serve(int fd);
+
+    std::string                 image;
+    int                         listenFd;
+    std::atomic<bool>           stopping;
+    std::atomic<size_t>         cut;            // 0 for none
+    std::atomic<size_t>         chunk;
+    std::atomic<unsigned>       interval;
+    std::thread                 thread;
+    std::mutex                  lock;
+    std::vector<std::string>    requests;
+};
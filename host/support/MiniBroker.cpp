@@ -0,0 +1,306 @@
+/*
+ * MiniBroker.cpp : an MQTT 3.1.1 broker stand-in for the host tests
+ */
+#include "MiniBroker.h"
+#include <Arduino.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+MiniBroker::MiniBroker() : dropPercent(0), ackDelay(0), dropped(0), listenFd(-1), boundPort(0),
+            stopping(false), connectCount(0), seed(1) {}
+
+MiniBroker::~MiniBroker() {
+    stop();
+}
+
+uint16_t MiniBroker::start(uint16_t port) {
+    stop();
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 512) != 0) {
+        ::close(listenFd);
+        listenFd = -1;
+        return 0;
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listenFd, (sockaddr*)&addr, &len);
+    boundPort = ntohs(addr.sin_port);
+    stopping = false;
+    thread = std::thread(&MiniBroker::run, this);
+    return boundPort;
+}
+
+void MiniBroker::stop() {
+    if (thread.joinable()) {
+        stopping = true;
+        thread.join();
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    for (Session& s : sessions) ::close(s.fd);
+    sessions.clear();
+    if (listenFd >= 0) ::close(listenFd);
+    listenFd = -1;
+}
+
+void MiniBroker::run() {
+    std::vector<pollfd> fds;
+    bool waiting = false;
+    while (!stopping) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            fds.assign(1, pollfd{ listenFd, POLLIN, 0 });
+            for (Session& s : sessions) fds.push_back(pollfd{ s.fd, POLLIN, 0 });
+        }
+        int ready = poll(fds.data(), fds.size(), waiting ? 1 : 20);
+        std::lock_guard<std::mutex> guard(lock);
+        waiting = sendAcks();
+        if (ready <= 0) continue;
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd >= 0) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                sessions.push_back(Session{ fd, "", "", {}, false, {} });
+            }
+        }
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (!fds[i].revents) continue;
+            for (Session& s : sessions) {
+                if (s.fd == fds[i].fd) handle(s);
+            }
+        }
+        for (size_t i = 0; i < sessions.size(); ) {
+            if (sessions[i].closing) {
+                ::close(sessions[i].fd);
+                sessions.erase(sessions.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+void MiniBroker::handle(Session& s) {
+    char buf[4096];
+    ssize_t n = recv(s.fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        s.closing = true;
+        return;
+    }
+    if (n > 0) s.in.append(buf, n);
+    while (!s.closing) {
+        size_t remaining = 0, pos = 1;
+        int shift = 0;
+        for (;;) {
+            if (pos >= s.in.size()) return;         // the length is not all in
+            uint8_t b = s.in[pos++];
+            remaining |= (size_t)(b & 0x7F) << shift;
+            shift += 7;
+            if (!(b & 0x80)) break;
+        }
+        if (s.in.size() < pos + remaining) return;
+        uint8_t type = s.in[0];
+        std::string body = s.in.substr(pos, remaining);
+        s.in.erase(0, pos + remaining);
+        if (!packet(s, type, (const uint8_t*)body.data(), body.size())) s.closing = true;
+    }
+}
+
+bool MiniBroker::packet(Session& s, uint8_t type, const uint8_t* body, size_t len) {
+    switch (type & 0xF0) {
+        case 0x10: {                                // CONNECT
+            if (len < 12) return false;
+            size_t p = 2 + (body[0] << 8 | body[1]) + 4;
+            size_t idLen = body[p] << 8 | body[p + 1];
+            s.clientId.assign((const char*)body + p + 2, idLen);
+            connectCount++;
+            send(s, std::string("\x20\x02\x00\x00", 4));
+            return true;
+        }
+        case 0x30: {                                // PUBLISH
+            int qos = (type >> 1) & 3;
+            size_t topicLen = body[0] << 8 | body[1];
+            size_t p = 2 + topicLen;
+            uint16_t id = 0;
+            if (qos) {
+                id = body[p] << 8 | body[p + 1];
+                p += 2;
+            }
+            seed = seed * 1103515245 + 12345;
+            if (dropPercent && (int)((seed >> 16) % 100) < dropPercent) {
+                dropped++;                          // lost on the way, nor seen nor acked
+                return true;
+            }
+            BrokerMessage m = { s.clientId, std::string((const char*)body + 2, topicLen),
+                        std::string((const char*)body + p, len - p), qos, (type & 0x08) != 0, id, micros() };
+            log.push_back(m);
+            if (qos == 1) {
+                std::string ack("\x40\x02", 2);
+                ack += (char)(id >> 8);
+                ack += (char)(id & 0xFF);
+                if (ackDelay) {
+                    s.acks.push_back(std::make_pair(millis() + ackDelay, ack));
+                } else {
+                    send(s, ack);
+                }
+            }
+            std::string out = frame(0x30, str16(m.topic) + m.payload);
+            for (Session& o : sessions) {
+                for (const std::string& f : o.filters) {
+                    if (matches(f, m.topic)) {
+                        send(o, out);
+                        break;
+                    }
+                }
+            }
+            return true;
+        }
+        case 0x80: {                                // SUBSCRIBE
+            std::string ack(body, body + 2);
+            for (size_t p = 2; p + 2 < len; ) {
+                size_t n = body[p] << 8 | body[p + 1];
+                s.filters.push_back(std::string((const char*)body + p + 2, n));
+                p += 2 + n + 1;
+                ack += '\0';
+            }
+            send(s, frame(0x90, ack));
+            return true;
+        }
+        case 0xA0: {                                // UNSUBSCRIBE
+            for (size_t p = 2; p + 2 <= len; ) {
+                size_t n = body[p] << 8 | body[p + 1];
+                std::string f((const char*)body + p + 2, n);
+                for (size_t i = 0; i < s.filters.size(); i++) {
+                    if (s.filters[i] == f) s.filters.erase(s.filters.begin() + i--);
+                }
+                p += 2 + n;
+            }
+            send(s, frame(0xB0, std::string(body, body + 2)));
+            return true;
+        }
+        case 0x40:                                  // PUBACK of a QoS 1 delivery
+            return true;
+        case 0xC0:                                  // PINGREQ
+            send(s, std::string("\xD0\x00", 2));
+            return true;
+        default:                                    // DISCONNECT and the others
+            return false;
+    }
+}
+
+// the delayed PUBACKs which are due, true while some are still waiting
+bool MiniBroker::sendAcks() {
+    bool waiting = false;
+    for (Session& s : sessions) {
+        size_t n = 0;
+        while (n < s.acks.size() && (long)(millis() - s.acks[n].first) >= 0) {
+            send(s, s.acks[n++].second);
+        }
+        s.acks.erase(s.acks.begin(), s.acks.begin() + n);
+        waiting = waiting || !s.acks.empty();
+    }
+    return waiting;
+}
+
+void MiniBroker::send(Session& s, const std::string& bytes) {
+    if (s.closing) return;
+    if (::send(s.fd, bytes.data(), bytes.size(), MSG_NOSIGNAL) != (ssize_t)bytes.size()) {
+        s.closing = true;
+    }
+}
+
+void MiniBroker::publish(const std::string& topic, const std::string& payload) {
+    std::string out = frame(0x30, str16(topic) + payload);
+    std::lock_guard<std::mutex> guard(lock);
+    for (Session& s : sessions) {
+        for (const std::string& f : s.filters) {
+            if (matches(f, topic)) {
+                send(s, out);
+                break;
+            }
+        }
+    }
+}
+
+void MiniBroker::kick(const std::string& clientId) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (Session& s : sessions) {
+        if (s.clientId == clientId) {
+            shutdown(s.fd, SHUT_RDWR);
+            s.closing = true;
+        }
+    }
+}
+
+std::vector<BrokerMessage> MiniBroker::messages(size_t from) {
+    std::lock_guard<std::mutex> guard(lock);
+    return std::vector<BrokerMessage>(log.begin() + min(from, log.size()), log.end());
+}
+
+size_t MiniBroker::count(const std::string& topicPrefix) {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t n = 0;
+    for (const BrokerMessage& m : log) {
+        if (m.topic.compare(0, topicPrefix.size(), topicPrefix) == 0) n++;
+    }
+    return n;
+}
+
+void MiniBroker::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    log.clear();
+}
+
+size_t MiniBroker::connections() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t n = 0;
+    for (Session& s : sessions) {
+        if (!s.clientId.empty() && !s.closing) n++;
+    }
+    return n;
+}
+
+bool MiniBroker::matches(const std::string& filter, const std::string& topic) {
+    size_t f = 0, t = 0;
+    while (f < filter.size()) {
+        if (filter[f] == '#') return true;
+        if (filter[f] == '+') {
+            while (t < topic.size() && topic[t] != '/') t++;
+            f++;
+        } else {
+            if (t >= topic.size() || filter[f] != topic[t]) return false;
+            f++;
+            t++;
+        }
+    }
+    return t == topic.size();
+}
+
+std::string MiniBroker::frame(uint8_t type, const std::string& body) {
+    std::string out(1, (char)type);
+    size_t n = body.size();
+    do {
+        uint8_t b = n % 128;
+        n /= 128;
+        if (n) b |= 0x80;
+        out += (char)b;
+    } while (n);
+    return out + body;
+}
+
+std::string MiniBroker::str16(const std::string& s) {
+    std::string out;
+    out += (char)(s.size() >> 8);
+    out += (char)(s.size() & 0xFF);
+    return out + s;
+}
@@ -0,0 +1,82 @@
+/*
+ * MiniBroker.h : an MQTT 3.1.1 broker stand-in for the host tests
+ *      In process, on 127.0.0.1, one thread polling every connection. It
+ *      takes CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH at QoS 0 and 1, with
+ *      its PUBACK, PINGREQ and DISCONNECT, forwards the publishes to the
+ *      matching subscriptions at QoS 0 and records them. The faults of a
+ *      real network are injected with stop() and start() on the same port,
+ *      dropPercent, which loses that share of the inbound PUBLISH packets
+ *      before the broker sees them, and ackDelay, which holds each PUBACK
+ *      back for that many ms, as a longer round trip, without holding back
+ *      the packets behind it.
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BrokerMessage {
+    std::string     clientId;
+    std::string     topic;
+    std::string     payload;
+    int             qos;
+    bool            dup;
+    uint16_t        id;
+    unsigned long   at;                     // micros() of the arrival
+};
+
+class MiniBroker {
+public:
+    MiniBroker();
+    ~MiniBroker();
+
+    uint16_t start(uint16_t port = 0);      // the port, 0 when it could not listen
+    void stop();                            // closes the listener and every connection
+    bool running() const { return listenFd >= 0; }
+    uint16_t port() const { return boundPort; }
+
+    void publish(const std::string& topic, const std::string& payload);
+    void kick(const std::string& clientId); // drops the connection of a client
+
+    std::vector<BrokerMessage> messages(size_t from = 0);     // the log from its from-th message
+    size_t count(const std::string& topicPrefix = "");
+    void clear();
+    size_t connections();
+    unsigned long connects() const { return connectCount; }
+
+    std::atomic<int>            dropPercent;    // of the inbound PUBLISH packets
+    std::atomic<unsigned long>  ackDelay;       // ms before each PUBACK
+    std::atomic<unsigned long>  dropped;
+
+private:
+    struct Session {
+        int                         fd;
+        std::string                 clientId;
+        std::string                 in;
+        std::vector<std::string>    filters;
+        bool                        closing;
+        std::vector<std::pair<unsigned long, std::string>> acks;   // due millis(), the PUBACK
+    };
+
+    void run();
+    void handle(Session& s);
+    bool sendAcks();
+    bool packet(Session& s, uint8_t type, const uint8_t* body, size_t len);
+    void send(Session& s, const std::string& bytes);
+    static bool matches(const std::string& filter, const std::string& topic);
+    static std::string frame(uint8_t type, const std::string& body);
+    static std::string str16(const std::string& s);
+
+    int                         listenFd;
+    uint16_t                    boundPort;
+    std::atomic<bool>           stopping;
+    std::thread                 thread;
+    std::mutex                  lock;
+    std::vector<Session>        sessions;
+    std::vector<BrokerMessage>  log;
+    std::atomic<unsigned long>  connectCount;
+    uint32_t                    seed;
+};
@@ -0,0 +1,137 @@
+/*
+ * TestBroker.cpp : MiniBroker or mosquitto behind one interface
+ */
+#include "TestBroker.h"
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <PubSubClient.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+class MiniTestBroker : public TestBroker {
+public:
+    uint16_t start(uint16_t port) { return broker.start(port); }
+    void stop() { broker.stop(); }
+    std::vector<BrokerMessage> messages(size_t from) { return broker.messages(from); }
+    size_t count(const std::string& topicPrefix) { return broker.count(topicPrefix); }
+    void publish(const std::string& topic, const std::string& payload) { broker.publish(topic, payload); }
+    const char* name() { return "MiniBroker"; }
+
+private:
+    MiniBroker      broker;
+};
+
+static std::mutex                   recorderLock;
+static std::vector<BrokerMessage>   recorderLog;
+
+static void recorderCallback(char* topic, uint8_t* payload, unsigned int len) {
+    std::lock_guard<std::mutex> guard(recorderLock);
+    recorderLog.push_back(BrokerMessage{ "", topic, std::string((const char*)payload, len), 0, false, 0, micros() });
+}
+
+class MosquittoBroker : public TestBroker {
+public:
+    MosquittoBroker(const char* exe) : exe(exe), pid(-1), port(0), running(false) {}
+    ~MosquittoBroker() { stop(); }
+
+    uint16_t start(uint16_t p) {
+        stop();
+        port = p ? p : freePort();
+        pid = fork();
+        if (pid == 0) {
+            char portArg[8];
+            snprintf(portArg, sizeof(portArg), "%u", port);
+            execlp(exe.c_str(), exe.c_str(), "-p", portArg, (char*)NULL);
+            _exit(127);
+        }
+        for (int i = 0; i < 200 && !record(); i++) delay(10);
+        if (!recorder.connected()) {
+            stop();
+            return 0;
+        }
+        running = true;
+        thread = std::thread([this]() {
+            while (running) {
+                {
+                    std::lock_guard<std::mutex> guard(clientLock);
+                    recorder.loop();
+                }
+                delay(1);
+            }
+        });
+        return port;
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) thread.join();
+        recorder.disconnect();
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        pid = -1;
+    }
+
+    std::vector<BrokerMessage> messages(size_t from) {
+        std::lock_guard<std::mutex> guard(recorderLock);
+        return std::vector<BrokerMessage>(recorderLog.begin() + min(from, recorderLog.size()), recorderLog.end());
+    }
+
+    size_t count(const std::string& topicPrefix) {
+        std::lock_guard<std::mutex> guard(recorderLock);
+        size_t n = 0;
+        for (const BrokerMessage& m : recorderLog) {
+            if (m.topic.compare(0, topicPrefix.size(), topicPrefix) == 0) n++;
+        }
+        return n;
+    }
+
+    // through the recorder, which keeps its connection
+    void publish(const std::string& topic, const std::string& payload) {
+        std::lock_guard<std::mutex> guard(clientLock);
+        recorder.publish(topic.c_str(), (const uint8_t*)payload.data(), payload.size());
+    }
+
+    const char* name() { return "mosquitto"; }
+
+private:
+    bool record() {
+        recorder.setClient(client);
+        recorder.setServer("127.0.0.1", port);
+        recorder.setCallback(recorderCallback);
+        recorder.setBufferSize(8192);
+        return recorder.connect("host-test-recorder") && recorder.subscribe("#");
+    }
+
+    static uint16_t freePort() {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(fd, (sockaddr*)&addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (sockaddr*)&addr, &len);
+        close(fd);
+        return ntohs(addr.sin_port);
+    }
+
+    std::string         exe;
+    pid_t               pid;
+    uint16_t            port;
+    std::atomic<bool>   running;
+    std::thread         thread;
+    WiFiClient          client;
+    PubSubClient        recorder;
+    std::mutex          clientLock;
+};
+
+TestBroker* makeTestBroker() {
+    const char* exe = getenv("IOT_MOSQUITTO");
+    if (exe && *exe) return new MosquittoBroker(exe);
+    return new MiniTestBroker();
+}
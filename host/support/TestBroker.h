@@ -0,0 +1,23 @@
+/*
+ * TestBroker.h : the broker of a host test
+ *      MiniBroker in process, or a mosquitto started and killed by the test
+ *      when IOT_MOSQUITTO names its executable. The messages of mosquitto
+ *      are recorded by a PubSubClient subscribed to "#", which also
+ *      publishes for the test and so records those messages too.
+ */
+#pragma once
+#include "MiniBroker.h"
+
+class TestBroker {
+public:
+    virtual ~TestBroker() {}
+    virtual uint16_t start(uint16_t port = 0) = 0;  // the port, 0 on a failure
+    virtual void stop() = 0;                        // killed, the connections dropped
+    virtual std::vector<BrokerMessage> messages(size_t from = 0) = 0;
+    virtual size_t count(const std::string& topicPrefix = "") = 0;
+    virtual void publish(const std::string& topic, const std::string& payload) = 0;
+    virtual const char* name() = 0;
+};
+
+// mosquitto when the environment has IOT_MOSQUITTO, else MiniBroker
+TestBroker* makeTestBroker();
@@ -0,0 +1,217 @@
+/*
+ * TlsProxy.cpp : a TLS front for a broker
+ */
+#include "TlsProxy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+TlsProxy::TlsProxy() : handshakes(0), resumed(0), failed(0), ctx(NULL), listenFd(-1), upstream(0),
+            stopping(false), generation(0) {}
+
+TlsProxy::~TlsProxy() {
+    stop();
+    if (ctx) SSL_CTX_free(ctx);
+}
+
+static X509* certificate(EVP_PKEY* key, X509* issuer, EVP_PKEY* issuerKey, const char* cn, bool isCA) {
+    static long serial = 1;
+    X509* cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial++);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 7 * 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)cn, -1, -1, 0);
+    X509_set_issuer_name(cert, issuer ? X509_get_subject_name(issuer) : name);
+    X509V3_CTX v3;
+    X509V3_set_ctx(&v3, issuer ? issuer : cert, cert, NULL, NULL, 0);
+    std::string san = std::string("DNS:") + cn;
+    const char* exts[][2] = {
+        { "basicConstraints", isCA ? "critical,CA:TRUE" : "CA:FALSE" },
+        { "keyUsage", isCA ? "critical,keyCertSign,cRLSign" : "critical,digitalSignature" },
+        { "subjectAltName", isCA ? NULL : san.c_str() },
+    };
+    for (auto& e : exts) {
+        if (!e[1]) continue;
+        X509_EXTENSION* ext = X509V3_EXT_conf(NULL, &v3, e[0], e[1]);
+        X509_add_ext(cert, ext, -1);
+        X509_EXTENSION_free(ext);
+    }
+    X509_sign(cert, issuerKey ? issuerKey : key, EVP_sha256());
+    return cert;
+}
+
+// a CA and a server certificate for serverName, signed by it, into ctx
+bool TlsProxy::makeCertificates(const char* serverName) {
+    EVP_PKEY* caKey = EVP_EC_gen("P-256");
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* caCert = certificate(caKey, NULL, NULL, "TlsProxy test CA", true);
+    X509* cert = certificate(key, caCert, caKey, serverName, false);
+    BIO* bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(bio, caCert);
+    char* pem;
+    long len = BIO_get_mem_data(bio, &pem);
+    ca.assign(pem, len);
+    BIO_free(bio);
+    bool ok = SSL_CTX_use_certificate(ctx, cert) == 1 && SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    X509_free(cert);
+    X509_free(caCert);
+    EVP_PKEY_free(key);
+    EVP_PKEY_free(caKey);
+    return ok;
+}
+
+uint16_t TlsProxy::start(uint16_t upstreamPort, const char* serverName) {
+    stop();
+    upstream = upstreamPort;
+    if (!ctx) {
+        ctx = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);     // resumed by the tickets only
+        if (!makeCertificates(serverName)) return 0;
+    }
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 1024) != 0) {
+        ::close(listenFd);
+        listenFd = -1;
+        return 0;
+    }
+    socklen_t len = sizeof(addr);
+    getsockname(listenFd, (sockaddr*)&addr, &len);
+    stopping = false;
+    thread = std::thread(&TlsProxy::run, this);
+    return ntohs(addr.sin_port);
+}
+
+void TlsProxy::stop() {
+    if (thread.joinable()) {
+        stopping = true;
+        thread.join();
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    for (Conn& c : conns) c.thread.join();
+    conns.clear();
+    if (listenFd >= 0) ::close(listenFd);
+    listenFd = -1;
+}
+
+void TlsProxy::drop() {
+    generation++;
+}
+
+void TlsProxy::rotateTickets() {
+    unsigned char keys[80];
+    RAND_bytes(keys, sizeof(keys));
+    SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+}
+
+void TlsProxy::run() {
+    while (!stopping) {
+        pollfd pfd = { listenFd, POLLIN, 0 };
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto c = conns.begin(); c != conns.end(); ) {
+                if (c->done) {
+                    c->thread.join();
+                    c = conns.erase(c);
+                } else {
+                    ++c;
+                }
+            }
+        }
+        if (poll(&pfd, 1, 20) <= 0) continue;
+        int down = accept(listenFd, NULL, NULL);
+        if (down < 0) continue;
+        std::lock_guard<std::mutex> guard(lock);
+        conns.emplace_back();
+        Conn* conn = &conns.back();
+        conn->done = false;
+        conn->thread = std::thread(&TlsProxy::serve, this, down, conn);
+    }
+}
+
+// the handshake and then the bytes both ways, until a side closes, drop() or stop()
+void TlsProxy::serve(int down, Conn* conn) {
+    unsigned gen = generation;
+    timeval tv = { 10, 0 };
+    setsockopt(down, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    SSL* ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, down);
+    int up = -1;
+    if (SSL_accept(ssl) != 1) {
+        ERR_clear_error();
+        failed++;
+    } else {
+        handshakes++;
+        if (SSL_session_reused(ssl)) resumed++;
+        up = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(upstream);
+        if (::connect(up, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            ::close(up);
+            up = -1;
+        }
+    }
+    if (up >= 0) {
+        int one = 1;
+        setsockopt(up, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(down, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(down, F_SETFL, fcntl(down, F_GETFL, 0) | O_NONBLOCK);
+        char buf[4096];
+        bool open = true;
+        while (open && !stopping && generation == gen) {
+            pollfd fds[2] = { { down, POLLIN, 0 }, { up, POLLIN, 0 } };
+            if (!SSL_pending(ssl) && poll(fds, 2, 20) <= 0) continue;
+            for (;;) {                          // the device to the broker
+                int n = SSL_read(ssl, buf, sizeof(buf));
+                if (n > 0) {
+                    open = send(up, buf, n, MSG_NOSIGNAL) == n;
+                    continue;
+                }
+                int err = SSL_get_error(ssl, n);
+                open = open && (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE);
+                break;
+            }
+            if (open && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                ssize_t n = recv(up, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) open = false;
+                for (ssize_t sent = 0; open && sent < n; ) {
+                    int k = SSL_write(ssl, buf + sent, n - sent);
+                    if (k > 0) {
+                        sent += k;
+                    } else if (SSL_get_error(ssl, k) == SSL_ERROR_WANT_WRITE) {
+                        poll(fds, 0, 1);
+                    } else {
+                        open = false;
+                    }
+                }
+            }
+        }
+        ::close(up);
+    }
+    ERR_clear_error();
+    SSL_free(ssl);
+    ::close(down);
+    conn->done = true;
+}
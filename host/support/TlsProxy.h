@@ -0,0 +1,53 @@
+/*
+ * TlsProxy.h : a TLS front for a broker
+ *      Terminates TLS 1.2 for the devices in the direct mode and relays the
+ *      plain bytes to a broker, MiniBroker or mosquitto alike. It makes its
+ *      own CA and a server certificate for serverName at start(), caPem()
+ *      is the CA for /ca.txt of a device, and it issues session tickets and
+ *      counts the handshakes which resumed a session.
+ */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+class TlsProxy {
+public:
+    TlsProxy();
+    ~TlsProxy();
+
+    uint16_t start(uint16_t upstreamPort, const char* serverName);     // the port, 0 on a failure
+    void stop();
+    void drop();                            // closes the connections, still listening
+    void rotateTickets();                   // the tickets issued so far no longer resume
+    const std::string& caPem() { return ca; }
+
+    std::atomic<unsigned long>  handshakes;
+    std::atomic<unsigned long>  resumed;
+    std::atomic<unsigned long>  failed;     // the handshakes which did not complete
+
+private:
+    struct Conn {
+        std::thread                 thread;
+        std::atomic<bool>           done;
+    };
+
+    bool makeCertificates(const char* serverName);
+    void run();
+    void serve(int down, Conn* conn);
+
+    SSL_CTX*                    ctx;
+    std::string                 ca;
+    int                         listenFd;
+    uint16_t                    upstream;
+    std::atomic<bool>           stopping;
+    std::atomic<unsigned>       generation;     // drop() moves it on
+    std::thread                 thread;
+    std::mutex                  lock;
+    std::list<Conn>             conns;
+};
@@ -0,0 +1,100 @@
+/*
+ * child_devices.cpp : a gateway with hundreds of child devices
+ *      Built with IOT_MAX_DEVICES 500. 400 children are announced over the
+ *      one connection, each with a manage and an info message, publish
+ *      their events and get their commands through the one wildcard
+ *      subscription, while the commands of the gateway still reach it. The memory of a child is its IOTDevice slot, so
+ *      adding one allocates nothing, and the cost of a dispatch to the last
+ *      child is printed.
+ */
+#include "HostDevice.h"
+
+const int           CHILDREN = 400;
+int                 childValue[CHILDREN];
+int                 childCommands = 0;
+int                 gatewayCommands = 0;
+
+void childHandler(int dev, const char* cmdId, JsonDocument* root) {
+    childValue[dev] = (*root)["d"]["v"];
+    childCommands++;
+}
+
+void gatewayHandler(const char* cmdId, JsonDocument* root) {
+    gatewayCommands++;
+}
+
+int main() {
+    MiniBroker broker;
+    uint16_t port = broker.start();
+    CHECK(port);
+    hostDevice("child_devices.spiffs", port);
+
+    char devId[IOT_DEV_ID_LENGTH];
+    unsigned long heap = host::heapInUse();
+    host::resetAllocs();
+    host::countAllocs(true);
+    for (int i = 0; i < CHILDREN; i++) {
+        snprintf(devId, sizeof(devId), "s%03d", i);
+        CHECK(iotAddDevice("sensor", devId, childHandler, "{\"bus\":\"modbus\"}") == i);
+        childValue[i] = -1;
+    }
+    host::countAllocs(false);
+    CHECK(host::allocs().count == 0);
+    printf("%d children: %zu bytes each in iotDevices, heap %+ld bytes\n",
+           CHILDREN, sizeof(IOTDevice), (long)host::heapInUse() - (long)heap);
+    iotOnCommand("ping", gatewayHandler);
+
+    // announced a few per step after the connection
+    CHECK(waitConnected());
+    CHECK(waitFor([]() { return iotDeviceAnnounced == CHILDREN; }, 30000));
+    CHECK(waitFor([&]() {
+        return broker.count("iotdevice-1/type/sensor/id/") == CHILDREN && broker.count("iot-2/type/sensor/id/") == CHILDREN;
+    }));
+    char topic[IOT_DEVICE_TOPIC_LENGTH];
+    for (const BrokerMessage& m : broker.messages()) {
+        int i = -1;
+        if (sscanf(m.topic.c_str(), "iotdevice-1/type/sensor/id/s%d/", &i) == 1) {
+            snprintf(topic, sizeof(topic), "iotdevice-1/type/sensor/id/s%03d/mgmt/manage", i);
+            CHECK(m.topic == topic);
+            CHECK(m.payload == "{\"d\":{\"metadata\":{\"bus\":\"modbus\"},\"supports\":{\"deviceActions\":false}}}");
+        } else if (sscanf(m.topic.c_str(), "iot-2/type/sensor/id/s%d/", &i) == 1) {
+            snprintf(topic, sizeof(topic), "iot-2/type/sensor/id/s%03d/evt/info/fmt/json", i);
+            CHECK(m.topic == topic);
+            CHECK(m.payload == "{\"info\":{\"metadata\":{\"bus\":\"modbus\"},\"supports\":{\"deviceActions\":false}}}");
+        }
+    }
+
+    // the events of each child on its own topic
+    char payload[32];
+    for (int i = 0; i < CHILDREN; i++) {
+        snprintf(payload, sizeof(payload), "{\"d\":{\"v\":%d}}", i);
+        while (!iotDevicePublish(i, "iot-2/evt/status/fmt/json", payload, strlen(payload))) iotLoop();
+        iotLoop();
+    }
+    CHECK(waitFor([&]() { return broker.count("iot-2/type/sensor/id/") == 2 * CHILDREN; }));      // the info ones too
+    for (const BrokerMessage& m : broker.messages()) {
+        int v = -1;
+        if (sscanf(m.payload.c_str(), "{\"d\":{\"v\":%d}}", &v) != 1) continue;
+        snprintf(topic, sizeof(topic), "iot-2/type/sensor/id/s%03d/evt/status/fmt/json", v);
+        CHECK(m.topic == topic);
+    }
+
+    // the commands, routed by type and id, and one for the gateway
+    for (int i = 0; i < CHILDREN; i++) {
+        snprintf(topic, sizeof(topic), "iot-2/type/sensor/id/s%03d/cmd/set/fmt/json", i);
+        snprintf(payload, sizeof(payload), "{\"d\":{\"v\":%d}}", i);
+        broker.publish(topic, payload);
+    }
+    snprintf(topic, sizeof(topic), "%.*sping/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+    broker.publish(topic, "{\"d\":{}}");
+    CHECK(waitFor([]() { return childCommands == CHILDREN && gatewayCommands == 1; }));
+    for (int i = 0; i < CHILDREN; i++) CHECK(childValue[i] == i);
+
+    // a dispatch to the last child scans the registry
+    snprintf(topic, sizeof(topic), "iot-2/type/sensor/id/s%03d/cmd/set/fmt/json", CHILDREN - 1);
+    const int N = 100000;
+    unsigned long long t0 = hostNanos();
+    for (int i = 0; i < N; i++) iotDispatchDevice(topic, &rxDoc);
+    printf("dispatch to child %d: %.1f ns\n", CHILDREN - 1, (double)(hostNanos() - t0) / N);
+    finish("child_devices");
+}
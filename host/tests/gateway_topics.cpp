@@ -0,0 +1,31 @@
+/*
+ * gateway_topics.cpp : the gateway topics of a long devType and devId
+ *      iotTopicPool is sized from devType and devId, so the topics of long
+ *      ones are built whole, and publishTopic keeps the room to switch to
+ *      fmt/msgpack. The manage and info messages of the connection are
+ *      acknowledged, at QoS 1.
+ */
+#include "HostDevice.h"
+
+int main() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    std::string devId = "device-" + std::string(57, 'x');     // 64 characters
+    hostDevice("gateway_topics.spiffs", port, devId.c_str());
+    CHECK(waitConnected());
+
+    std::string prefix = "iot-2/type/hostType/id/" + devId;
+    CHECK(publishTopic == prefix + "/evt/status/fmt/json");
+    CHECK(commandTopic == prefix + "/cmd/+/fmt/+");
+    CHECK(manageTopic == "iotdevice-1/type/hostType/id/" + devId + "/mgmt/manage");
+    CHECK(waitFor([&]() { return broker->count(manageTopic) == 1 && broker->count(infoTopic) == 1; }));
+    CHECK(waitFor([]() { return inflightStats.acked == 2 && inflightPending() == 0; }));     // through the window
+
+    char update[] = "{\"d\":{\"fields\":[{\"field\":\"metadata\",\"value\":{\"fmt\":\"msgpack\"}}]}}";
+    char topic[256];
+    snprintf(topic, sizeof(topic), "%s", updateTopic);
+    iotCallback(topic, (byte*)update, sizeof(update) - 1);
+    CHECK(publishTopic == prefix + "/evt/status/fmt/msgpack");
+    finish("gateway_topics");
+}
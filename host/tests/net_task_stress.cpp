@@ -0,0 +1,164 @@
+/*
+ * net_task_stress.cpp : the network task against the application, on threads
+ *      Built with IOT_NET_TASK. First a producer and a consumer thread pass a
+ *      million messages of varying lengths through an IOTRing, each checked
+ *      for its order and its bytes. Then the network task runs on its own
+ *      thread while the application publishes, the broker streams commands
+ *      and metadata updates at it and drops its connection now and then, so
+ *      the connection announces the metadata while iotUpdateMeta() rewrites
+ *      it. Every message and every announced metadata has to arrive whole
+ *      and in order.
+ */
+#include "HostDevice.h"
+
+IOTRing             stressRing;
+
+void fillPayload(char* buff, uint32_t n, unsigned* len) {
+    *len = 8 + n % 97;
+    for (unsigned i = 0; i < *len; i++) buff[i] = 'a' + (n + i) % 26;
+    memcpy(buff, &n, sizeof(n));
+}
+
+void ringStress() {
+    const uint32_t COUNT = 1000000;
+    std::thread producer([&]() {
+        char topic[16], payload[128];
+        unsigned len;
+        for (uint32_t n = 0; n < COUNT; ) {
+            snprintf(topic, sizeof(topic), "t/%u", n % 1000);
+            fillPayload(payload, n, &len);
+            if (ringPush(&stressRing, topic, payload, len)) {
+                n++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    char expectTopic[16], expect[128];
+    unsigned expectLen;
+    char* payload;
+    unsigned len;
+    for (uint32_t n = 0; n < COUNT; ) {
+        char* topic = ringPeek(&stressRing, &payload, &len);
+        if (!topic) {
+            std::this_thread::yield();
+            continue;
+        }
+        snprintf(expectTopic, sizeof(expectTopic), "t/%u", n % 1000);
+        fillPayload(expect, n, &expectLen);
+        CHECK(!strcmp(topic, expectTopic));
+        CHECK(len == expectLen && !memcmp(payload, expect, len) && payload[len] == '\0');
+        ringPop(&stressRing);
+        n++;
+    }
+    producer.join();
+    printf("ring: %u messages\n", COUNT);
+}
+
+int                 lastCommand = -1;
+int                 commandsSeen = 0;
+
+void seqHandler(const char* cmdId, JsonDocument* root) {
+    int n = (*root)["d"]["n"];
+    char check[16];
+    snprintf(check, sizeof(check), "%08x", n * 2654435761u);
+    CHECK(n > lastCommand);
+    CHECK(!strcmp((const char*)(*root)["d"]["check"], check));
+    lastCommand = n;
+    commandsSeen++;
+}
+
+// the metadata of version k, long and short by turns to catch a torn copy
+std::string metaVersion(int k) {
+    return "{\"pubInterval\":1000,\"site\":\"v" + std::to_string(k) + "\",\"pad\":\"" +
+           std::string(k % 2 ? 150 : 10, 'a' + k % 26) + "\"}";
+}
+
+int main() {
+    ringStress();
+
+    MiniBroker broker;
+    uint16_t port = broker.start();
+    CHECK(port);
+    hostDevice("net_task_stress.spiffs", port, "host1", metaVersion(0).c_str());
+    startIOTNetTask();
+    CHECK(waitConnected());
+    iotOnCommand("seq", seqHandler);
+
+    const int COMMANDS = 500;
+    const int UPDATES = 200;
+    const int PUBLISHES = 3000;
+    char cmdTopic[IOT_DEVICE_TOPIC_LENGTH];
+    snprintf(cmdTopic, sizeof(cmdTopic), "%.*sseq/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+    std::string updTopic = updateTopic;
+    std::string clientId = connClientId;
+    std::thread commands([&]() {
+        char payload[64];
+        for (int n = 0; n < COMMANDS; n++) {
+            snprintf(payload, sizeof(payload), "{\"d\":{\"n\":%d,\"check\":\"%08x\"}}", n, n * 2654435761u);
+            broker.publish(cmdTopic, payload);
+            delay(2);
+        }
+    });
+    std::thread updates([&]() {
+        for (int k = 1; k <= UPDATES; k++) {
+            broker.publish(updTopic, "{\"d\":{\"fields\":[{\"field\":\"metadata\",\"value\":" +
+                                     metaVersion(k) + "}]}}");
+            delay(5);
+            if (k % 20 == 0) broker.kick(clientId);
+        }
+    });
+
+    char payload[32];
+    for (int n = 0; n < PUBLISHES; n++) {
+        snprintf(payload, sizeof(payload), "{\"d\":{\"n\":%d}}", n);
+        while (!iotPublish(publishTopic, payload)) {
+            iotLoop();
+            delay(1);
+        }
+        iotLoop();
+        if (n % 4 == 0) delay(1);
+    }
+    commands.join();
+    updates.join();
+    CHECK(waitConnected(30000));
+
+    // the publishes, in order, each whole, the ones the queue gave up counted
+    std::vector<bool> seen(PUBLISHES);
+    auto delivered = [&]() {
+        int distinct = 0, last = -1;
+        std::fill(seen.begin(), seen.end(), false);
+        for (const BrokerMessage& m : broker.messages()) {
+            if (m.topic != publishTopic) continue;
+            int n = -1;
+            CHECK(sscanf(m.payload.c_str(), "{\"d\":{\"n\":%d}}", &n) == 1 && n >= 0 && n < PUBLISHES);
+            CHECK(n > last || seen[n]);             // a resend repeats an older one
+            if (!seen[n]) distinct++;
+            seen[n] = true;
+            last = max(last, n);
+        }
+        return distinct;
+    };
+    CHECK(waitFor([&]() {
+        return delivered() + pubqStats.dropped + inflightStats.failed == (unsigned long)PUBLISHES;
+    }, 60000));
+
+    // every announced metadata is one of the versions, never a mix of two
+    int announced = 0;
+    for (const BrokerMessage& m : broker.messages()) {
+        if (m.topic != manageTopic) continue;
+        DynamicJsonDocument doc(1024);
+        CHECK(!deserializeJson(doc, m.payload));
+        JsonObject meta = doc["d"]["metadata"];
+        int k = atoi((const char*)meta["site"] + 1);
+        std::string text;
+        serializeJson(meta, text);
+        CHECK(text == metaVersion(k));
+        announced++;
+    }
+    CHECK(announced > UPDATES / 20);
+    CHECK(commandsSeen > 0);
+    printf("published %d, dropped %lu, commands %d of %d, announced %d, reconnects %lu\n",
+           delivered(), pubqStats.dropped, commandsSeen, COMMANDS, announced, iotMetrics.reconnects);
+    finish("net_task_stress");
+}
@@ -0,0 +1,104 @@
+/*
+ * ota_resume.cpp : an OTA download cut in the middle resumes where it stopped
+ *      d.upgrade downloads the image from an ImageServer. A wrong md5 fails
+ *      the update and is reported. With the right md5 the first response is
+ *      cut at about 45% of the image, the OTA task asks for the rest with a
+ *      Range from the byte it stopped at, gets it with 206 and completes the
+ *      image, and the progress on infoTopic goes up to 100% without going
+ *      back to the start.
+ */
+#include "HostDevice.h"
+#include "ImageServer.h"
+#include <openssl/evp.h>
+
+const size_t        IMAGE_SIZE = 200 * 1024;
+
+std::string md5Of(const std::string& data) {
+    unsigned char digest[16];
+    unsigned int len = 0;
+    char hex[33];
+    EVP_Digest(data.data(), data.size(), digest, &len, EVP_md5(), NULL);
+    for (int i = 0; i < 16; i++) snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    return hex;
+}
+
+// the OTA messages on infoTopic, in their order
+std::vector<std::string> otaMessages(TestBroker* broker) {
+    std::vector<std::string> out;
+    for (const BrokerMessage& m : broker->messages()) {
+        if (m.topic == infoTopic && !m.dup && m.payload.find("\"OTA\"") != std::string::npos) {
+            out.push_back(m.payload);
+        }
+    }
+    return out;
+}
+
+bool published(TestBroker* broker, const char* text) {
+    for (const std::string& m : otaMessages(broker)) {
+        if (m.find(text) != std::string::npos) return true;
+    }
+    return false;
+}
+
+void upgrade(TestBroker* broker, uint16_t port, const std::string& md5) {
+    char topic[IOT_DEVICE_TOPIC_LENGTH];
+    char payload[256];
+    snprintf(topic, sizeof(topic), "%.*sfirmware/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+    snprintf(payload, sizeof(payload),
+             "{\"d\":{\"upgrade\":{\"server\":\"127.0.0.1\",\"port\":\"%u\",\"uri\":\"/fw.bin\",\"md5\":\"%s\"}}}",
+             port, md5.c_str());
+    broker->publish(topic, payload);
+}
+
+int main() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    hostDevice("ota_resume.spiffs", port);
+    CHECK(waitConnected());
+
+    std::string image(IMAGE_SIZE, '\0');
+    for (size_t i = 0; i < image.size(); i++) image[i] = (char)(i * 2654435761u >> 13);
+    ImageServer server;
+    uint16_t http = server.start(image);
+    CHECK(http);
+
+    // the whole image with a wrong md5
+    upgrade(broker, http, std::string(32, '0'));
+    CHECK(waitFor([&]() { return published(broker, "[update] Update failed. MD5 Check Failed"); }));
+    CHECK(host::otaImage().empty());
+    CHECK(server.ranges().size() == 1 && server.ranges()[0] == "");
+
+    // cut at 45%, resumed from there
+    size_t cut = IMAGE_SIZE * 45 / 100;
+    size_t before = otaMessages(broker).size();
+    server.pace(2048, 2);
+    server.cutAfter(cut);
+    upgrade(broker, http, md5Of(image));
+    CHECK(waitFor([&]() { return published(broker, "[update] Update ok."); }, 20000));
+    CHECK(host::otaImage() == image);
+
+    std::vector<std::string> ranges = server.ranges();
+    CHECK(ranges.size() == 3);
+    CHECK(ranges[1] == "");
+    CHECK(ranges[2] == "bytes=" + std::to_string(cut) + "-");
+
+    std::vector<std::string> messages = otaMessages(broker);
+    std::vector<int> progress;
+    for (size_t i = before; i < messages.size(); i++) {
+        size_t at = messages[i].find("\"progress\":");
+        if (at != std::string::npos) progress.push_back(atoi(messages[i].c_str() + at + 11));
+    }
+    CHECK(progress.size() >= 3);
+    CHECK(progress.front() < 45 && progress.back() == 100);
+    bool afterCut = false;
+    for (size_t i = 1; i < progress.size(); i++) {
+        CHECK(progress[i] >= progress[i - 1]);
+        afterCut |= progress[i] > 45 && progress[i] < 100;
+    }
+    CHECK(afterCut);
+    printf("ota_resume: cut at %zu of %zu bytes, resumed with %s, progress", cut, IMAGE_SIZE, ranges[2].c_str());
+    for (int p : progress) printf(" %d", p);
+    printf("\n");
+    finish("ota_resume");
+}
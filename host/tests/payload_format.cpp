@@ -0,0 +1,86 @@
+/*
+ * payload_format.cpp : meta.fmt switches the status events to MessagePack
+ *      After a metadata update with fmt msgpack the status events go to
+ *      .../fmt/msgpack in MessagePack, and a command is decoded in the
+ *      format of its topic. The sizes and the encode and decode times of the
+ *      two formats are printed for a typical status event.
+ */
+#include "HostDevice.h"
+
+int                 received = 0;
+
+void setHandler(const char* cmdId, JsonDocument* root) {
+    received = (*root)["d"]["level"].as<int>();
+}
+
+const char          statusJson[] =
+    "{\"d\":{\"temperature\":23.5,\"humidity\":41,\"pm25\":12,\"fan\":\"on\",\"mode\":\"auto\","
+    "\"uptime\":123456,\"rssi\":-61,\"filter\":[98,97,95]}}";
+
+// ns per encode and per decode of doc in the format of topic
+void measure(const char* name, const char* topic, JsonDocument& doc) {
+    const int N = 20000;
+    char buff[512], copy[512];
+    size_t len = 0;
+    unsigned long long t0 = hostNanos();
+    for (int i = 0; i < N; i++) len = iotSerialize(topic, doc, buff, sizeof(buff));
+    unsigned long long t1 = hostNanos();
+    for (int i = 0; i < N; i++) {
+        memcpy(copy, buff, len);
+        if (isMsgPackTopic(topic)) {
+            deserializeMsgPack(rxDoc, copy, len);
+        } else {
+            deserializeJson(rxDoc, copy, len);
+        }
+    }
+    unsigned long long t2 = hostNanos();
+    printf("%-8s %4u bytes, encode %7.1f ns, decode %7.1f ns\n", name, (unsigned)len,
+           (double)(t1 - t0) / N, (double)(t2 - t1) / N);
+}
+
+int main() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    hostDevice("payload_format.spiffs", port);
+    CHECK(waitConnected());
+    iotOnCommand("set", setHandler);
+    CHECK(strstr(publishTopic, "/fmt/json"));
+
+    char update[] = "{\"d\":{\"fields\":[{\"field\":\"metadata\",\"value\":"
+                    "{\"pubInterval\":1000,\"fmt\":\"msgpack\"}}]}}";
+    char topic[IOT_DEVICE_TOPIC_LENGTH];
+    snprintf(topic, sizeof(topic), "%s", updateTopic);
+    iotCallback(topic, (byte*)update, sizeof(update) - 1);
+    CHECK(strstr(publishTopic, "/fmt/msgpack"));
+
+    StaticJsonDocument<512> status;
+    CHECK(!deserializeJson(status, statusJson));
+    CHECK(iotPublishDoc(publishTopic, status));
+    CHECK(waitFor([&]() { return broker->count(publishTopic) == 1; }));
+    BrokerMessage m;
+    for (const BrokerMessage& e : broker->messages()) {
+        if (e.topic == publishTopic) m = e;
+    }
+    StaticJsonDocument<512> decoded;
+    CHECK(!deserializeMsgPack(decoded, m.payload.data(), m.payload.size()));
+    CHECK(decoded["d"]["humidity"] == 41);
+    CHECK(!strcmp((const char*)decoded["d"]["fan"], "on"));
+    CHECK(decoded["d"]["filter"][2] == 95);
+
+    // a command in MessagePack
+    StaticJsonDocument<128> command;
+    command["d"]["level"] = 7;
+    std::string packed(64, '\0');
+    packed.resize(serializeMsgPack(command, &packed[0], packed.size()));
+    snprintf(topic, sizeof(topic), "%.*sset/fmt/msgpack", (int)iotCmdPrefixLen, commandTopic);
+    broker->publish(topic, packed);
+    CHECK(waitFor([]() { return received == 7; }));
+
+    measure("json", "iot-2/evt/status/fmt/json", status);
+    measure("msgpack", "iot-2/evt/status/fmt/msgpack", status);
+    char a[512], b[512];
+    CHECK(iotSerialize("iot-2/evt/status/fmt/msgpack", status, a, sizeof(a)) <
+          iotSerialize("iot-2/evt/status/fmt/json", status, b, sizeof(b)));
+    finish("payload_format");
+}
@@ -0,0 +1,86 @@
+/*
+ * publish_burst.cpp : publishing into a full window, without pacing
+ *      With each PUBACK 20 ms late, a burst without iotLoop() fills the
+ *      window and then inflightBuffer, which holds the frames past the
+ *      window in RAM, and iotPublish() returns false when it is full rather
+ *      than queueing on flash. A producer which publishes again after
+ *      iotLoop() when refused gets its messages through at the pace of the
+ *      PUBACKs, far above a drain of the flash queue. The flash queue is
+ *      used while the connection is lost, behind the frames held in RAM,
+ *      and everything arrives in order.
+ */
+#include "HostDevice.h"
+
+MiniBroker          broker;
+const unsigned long RTT = 20;
+
+int messageNumber(const BrokerMessage& m) {
+    int n = -1;
+    sscanf(m.payload.c_str(), "{\"d\":{\"n\":%d}}", &n);
+    return n;
+}
+
+bool publishNumber(int n) {
+    char payload[32];
+    snprintf(payload, sizeof(payload), "{\"d\":{\"n\":%d}}", n);
+    return iotPublish(publishTopic, payload);
+}
+
+// every message of [0, to) arrived in order, a resend may repeat an older one
+void checkInOrder(int to) {
+    CHECK(waitFor([]() { return inflightPending() == 0 && pubqPending() == 0; }, 60000));
+    int next = 0;
+    for (const BrokerMessage& m : broker.messages()) {
+        if (m.topic != publishTopic) continue;
+        int n = messageNumber(m);
+        CHECK(n <= next);
+        if (n == next) next++;
+    }
+    CHECK(next == to);
+}
+
+int main() {
+    uint16_t port = broker.start();
+    CHECK(port);
+    hostDevice("publish_burst.spiffs", port);
+    CHECK(waitConnected());
+    CHECK(waitFor([]() { return inflightPending() == 0; }));
+    broker.ackDelay = RTT;
+
+    // a burst without iotLoop(), held in RAM past the window, then refused
+    int n = 0;
+    while (publishNumber(n)) n++;
+    printf("burst: %d taken, %d written, %d held\n", n, inflightOut, inflightHeld);
+    CHECK(n > 2 * IOT_INFLIGHT_WINDOW);
+    CHECK(inflightOut == IOT_INFLIGHT_WINDOW && inflightHeld == n - IOT_INFLIGHT_WINDOW);
+    CHECK(inflightStats.full == 1);
+    CHECK(pubqStats.queued == 0);
+
+    // no pacing, again after iotLoop() when refused
+    const int N = 1000;
+    unsigned long t0 = millis();
+    for (int end = n + N; n < end; n++) {
+        while (!publishNumber(n)) iotLoop();
+    }
+    checkInOrder(n);
+    unsigned long elapsed = millis() - t0;
+    unsigned long flashRate = IOT_PUBQ_BATCH * 1000 / IOT_PUBQ_DRAIN_INTERVAL;
+    printf("unpaced: %d messages in %lu ms, %lu refused, the flash queue drains %lu/s\n",
+           N, elapsed, inflightStats.full, flashRate);
+    CHECK(pubqStats.queued == 0 && pubqStats.dropped == 0);
+    CHECK(elapsed < N * 1000 / (5 * flashRate));
+    CHECK(inflightStats.failed == 0);
+
+    // held in RAM when the connection drops, the next ones on flash behind them
+    broker.ackDelay = 5000;
+    for (int end = n + 20; n < end; n++) CHECK(publishNumber(n));
+    broker.kick(connClientId);
+    broker.ackDelay = 0;
+    CHECK(waitFor([]() { return iotState != IOT_CONNECTED; }));
+    for (int end = n + 5; n < end; n++) CHECK(publishNumber(n));
+    CHECK(pubqStats.queued == 5);
+    CHECK(waitConnected());
+    checkInOrder(n);
+    CHECK(pubqStats.dropped == 0 && inflightStats.failed == 0);
+    finish("publish_burst");
+}
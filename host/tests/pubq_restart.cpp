@@ -0,0 +1,67 @@
+/*
+ * pubq_restart.cpp : the publish queue across a broker kill and restart
+ *      The messages published while the broker is down are queued in
+ *      SPIFFS and replayed in order after the reconnection, also when the
+ *      broker is killed again in the middle of the replay. A message may
+ *      arrive twice at QoS 1, none may be lost or reordered.
+ */
+#include "HostDevice.h"
+
+const int           COUNT = 20;
+
+int messageNumber(const BrokerMessage& m) {
+    int n = -1;
+    sscanf(m.payload.c_str(), "{\"d\":{\"n\":%d}}", &n);
+    return n;
+}
+
+void publishNumbered(int from, int to) {
+    char payload[32];
+    for (int i = from; i < to; i++) {
+        snprintf(payload, sizeof(payload), "{\"d\":{\"n\":%d}}", i);
+        CHECK(iotPublish(publishTopic, payload));
+    }
+}
+
+bool disconnected() {
+    return waitFor([]() { return iotState != IOT_CONNECTED; });
+}
+
+int main() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    printf("broker %s on %u\n", broker->name(), port);
+    hostDevice("pubq_restart.spiffs", port);
+    CHECK(waitConnected());
+
+    broker->stop();
+    CHECK(disconnected());
+    publishNumbered(0, COUNT);
+    CHECK(pubqPending() == COUNT);
+    CHECK(pubqStats.queued == COUNT);
+
+    // killed again after a part of the replay
+    CHECK(broker->start(port) == port);
+    CHECK(waitFor([]() { return pubqStats.replayed >= 4; }, 30000));
+    broker->stop();
+    CHECK(disconnected());
+    publishNumbered(COUNT, COUNT + 5);          // behind the rest of the queue
+
+    CHECK(broker->start(port) == port);
+    CHECK(waitConnected(30000));
+    CHECK(waitFor([]() { return pubqPending() == 0 && inflightPending() == 0; }, 30000));
+    CHECK(pubqStats.dropped == 0);
+    CHECK(inflightStats.failed == 0);
+
+    int next = 0;
+    for (const BrokerMessage& m : broker->messages()) {
+        if (m.topic != publishTopic) continue;
+        int n = messageNumber(m);
+        CHECK(n <= next);                       // in order, a resend may repeat an older one
+        if (n == next) next++;
+    }
+    printf("delivered %d, replayed %lu, resent %lu\n", next, pubqStats.replayed, inflightStats.resent);
+    CHECK(next == COUNT + 5);
+    finish("pubq_restart");
+}
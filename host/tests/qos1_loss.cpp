@@ -0,0 +1,94 @@
+/*
+ * qos1_loss.cpp : QoS 1 publishing against a lossy and a slow broker
+ *      Built with a short IOT_INFLIGHT_TIMEOUT. With a quarter of the
+ *      PUBLISH packets lost, every message still arrives, the lost ones
+ *      written again with DUP. With each PUBACK 50 ms late, the window keeps
+ *      several messages on the way, so the throughput is not one message
+ *      per round trip. The frames without a PUBACK when the connection
+ *      drops are written again after the reconnection.
+ */
+#include "HostDevice.h"
+
+MiniBroker          broker;
+
+// as fast as iotPublish() takes them, again after iotLoop() when it refuses
+void publishAll(int from, int to) {
+    char payload[32];
+    for (int n = from; n < to; n++) {
+        snprintf(payload, sizeof(payload), "{\"d\":{\"n\":%d}}", n);
+        while (!iotPublish(publishTopic, payload)) iotLoop();
+        iotLoop();
+    }
+}
+
+bool settled() {
+    return waitFor([]() { return inflightPending() == 0 && pubqPending() == 0; }, 60000);
+}
+
+// every message of [from, to) arrived, returns how many came with DUP
+int checkDelivered(int from, int to) {
+    std::vector<bool> seen(to - from);
+    int dup = 0;
+    for (const BrokerMessage& m : broker.messages()) {
+        int n = -1;
+        if (m.topic != publishTopic || sscanf(m.payload.c_str(), "{\"d\":{\"n\":%d}}", &n) != 1) continue;
+        if (n < from || n >= to) continue;
+        CHECK(m.qos == 1);
+        seen[n - from] = true;
+        if (m.dup) dup++;
+    }
+    for (int i = 0; i < to - from; i++) {
+        if (!seen[i]) printf("message %d lost\n", from + i);
+        CHECK(seen[i]);
+    }
+    return dup;
+}
+
+int main() {
+    uint16_t port = broker.start();
+    CHECK(port);
+    hostDevice("qos1_loss.spiffs", port);
+    CHECK(waitConnected());
+
+    // a quarter of the PUBLISH packets lost
+    broker.dropPercent = 25;
+    publishAll(0, 300);
+    CHECK(settled());
+    broker.dropPercent = 0;
+    int dup = checkDelivered(0, 300);
+    printf("loss: %lu dropped, %lu resent, %d with DUP, %lu failed\n",
+           broker.dropped.load(), inflightStats.resent, dup, inflightStats.failed);
+    CHECK(broker.dropped > 0);
+    CHECK(inflightStats.resent >= broker.dropped);
+    CHECK(dup > 0);
+    CHECK(inflightStats.failed == 0);
+
+    // pipelined, not one message per round trip
+    const int N = 200;
+    const unsigned long RTT = 50;
+    broker.ackDelay = RTT;
+    unsigned long t0 = millis();
+    publishAll(300, 300 + N);
+    CHECK(settled());
+    unsigned long elapsed = millis() - t0;
+    broker.ackDelay = 0;
+    checkDelivered(300, 300 + N);
+    printf("pipelining: %d messages with a %lu ms round trip in %lu ms, stop and wait %lu ms\n",
+           N, RTT, elapsed, N * RTT);
+    CHECK(elapsed < N * RTT / 3);
+
+    // the frames of a lost connection are written again after the reconnection
+    unsigned long resent = inflightStats.resent;
+    broker.ackDelay = 5000;
+    publishAll(500, 505);
+    CHECK(inflightPending() == 5);
+    broker.kick(connClientId);
+    broker.ackDelay = 0;
+    CHECK(waitFor([]() { return iotState != IOT_CONNECTED; }));
+    CHECK(waitConnected());
+    CHECK(settled());
+    CHECK(inflightStats.resent >= resent + 5);
+    CHECK(checkDelivered(500, 505) >= 5);
+    CHECK(inflightStats.failed == 0);
+    finish("qos1_loss");
+}
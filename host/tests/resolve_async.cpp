@@ -0,0 +1,68 @@
+/*
+ * resolve_async.cpp : a gateway resolves its broker without blocking the loop
+ *      The broker is localhost.local and mDNS answers after 1.5 s. The
+ *      device waits for the answer in IOT_SOCKET while iotLoop() keeps
+ *      returning, and connects when it comes. After the broker restarts,
+ *      the connection fails and the address is marked stale, and the device
+ *      reconnects to the cached address while it is refreshed in the
+ *      background, with no iotLoop() waiting for mDNS either.
+ */
+#include "HostDevice.h"
+
+const unsigned long MDNS_DELAY = 1500;
+const unsigned long LOOP_LIMIT = 200;       // ms, far below MDNS_DELAY
+
+unsigned long       slowest = 0;            // ms, the longest iotLoop()
+
+bool loopUntil(bool (*cond)(), unsigned long ms) {
+    unsigned long t0 = millis();
+    while (!cond()) {
+        if (millis() - t0 > ms) return false;
+        unsigned long t = millis();
+        iotLoop();
+        slowest = max(slowest, millis() - t);
+        delay(1);
+    }
+    return true;
+}
+
+bool connected() {
+    return iotState == IOT_CONNECTED;
+}
+
+int main() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    hostConfig("resolve_async.spiffs", "localhost.local", "hostType", "host1", "{\"pubInterval\":1000}");
+    host::redirect(1883, "127.0.0.1", port);
+    host::setWiFi(true);
+    host::setMdnsDelay(MDNS_DELAY);
+    initDevice();
+    set_iot_server();
+    iotRetryAt = millis();
+
+    // the first connection waits for mDNS in IOT_SOCKET
+    unsigned long t0 = millis();
+    CHECK(loopUntil([]() { return iotState == IOT_SOCKET && host::mdnsQueries() == 1; }, 1000));
+    CHECK(!loopUntil(connected, MDNS_DELAY / 2));
+    CHECK(iotState == IOT_SOCKET && iot_server[0] == '\0');
+    CHECK(loopUntil(connected, 10000));
+    unsigned long firstConnect = millis() - t0;
+    CHECK(firstConnect >= MDNS_DELAY);
+    CHECK(!strcmp(iot_server, "127.0.0.1"));
+    CHECK(slowest < LOOP_LIMIT);
+
+    // the broker restarts, the cached address is used and refreshed
+    broker->stop();
+    CHECK(loopUntil([]() { return iotState == IOT_SOCKET && iot_server[0] == '\0'; }, 5000));
+    CHECK(broker->start(port) == port);
+    t0 = millis();
+    CHECK(loopUntil(connected, 20000));
+    CHECK(resolveJob.busy);                 // connected before the refresh answered
+    CHECK(loopUntil([]() { return host::mdnsQueries() == 2 && !resolveJob.busy; }, 5000));
+    CHECK(slowest < LOOP_LIMIT);
+    printf("resolve_async: first connection %lu ms, reconnection %lu ms, slowest iotLoop() %lu ms\n",
+           firstConnect, millis() - t0, slowest);
+    finish("resolve_async");
+}
@@ -0,0 +1,121 @@
+/*
+ * rx_path.cpp : the receive path copies a message once and allocates nothing
+ *      iotCallback() copies the topic and the payload into rxBuffer and
+ *      parses them there, so the strings of the document are not copied
+ *      again and a handler may publish with msgBuffer, or with the client
+ *      buffer the message came in, while it reads the document. The copies
+ *      and the allocations of the sketch callback of the earlier README,
+ *      byte2buff() into msgBuffer, a String and a copying parse, are
+ *      printed next to those of iotCallback(). The bytes copied are
+ *      measured: a buffer is filled with a byte the message does not hold
+ *      and the bytes written over it counted, the String by its allocation,
+ *      and the parse by the memory of the document against a parse in place.
+ */
+#include "HostDevice.h"
+
+int                 handled = 0;
+char                seenName[32];
+long                counted = 0;
+const unsigned char FILL = 0xa5;
+
+// the bytes written into buff since it was filled with FILL
+size_t written(const char* buff, size_t size) {
+    size_t n = 0;
+    for (size_t i = 0; i < size; i++) n += (unsigned char)buff[i] != FILL;
+    return n;
+}
+
+// the bytes of the keys and the strings a parse copied into its document
+size_t copiedByParse(const JsonDocument& doc, const char* payload) {
+    char inPlace[512];
+    StaticJsonDocument<512> reference;
+    strcpy(inPlace, payload);
+    deserializeJson(reference, inPlace);
+    return doc.memoryUsage() - reference.memoryUsage();
+}
+
+// publishes over msgBuffer and the client buffer before it reads the document
+void echoHandler(const char* cmdId, JsonDocument* root) {
+    IOTWriter w(msgBuffer, sizeof(msgBuffer));
+    w.add("{\"d\":{\"name\":\"overwritten\",\"value\":0}}");
+    iotPublish(infoTopic, w.buff, w.len);
+    snprintf(seenName, sizeof(seenName), "%s", (const char*)(*root)["d"]["name"]);
+    handled += (*root)["d"]["value"].as<int>();
+}
+
+void countHandler(const char* cmdId, JsonDocument* root) {
+    counted += (*root)["d"]["value"].as<int>();
+}
+
+int main() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    hostDevice("rx_path.spiffs", port);
+    CHECK(waitConnected());
+    iotOnCommand("echo", echoHandler);
+    iotOnCommand("count", countHandler);
+
+    char topic[IOT_DEVICE_TOPIC_LENGTH];
+    snprintf(topic, sizeof(topic), "%.*secho/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+    const char payload[] = "{\"d\":{\"name\":\"sensor-7\",\"value\":42}}";
+    unsigned len = sizeof(payload) - 1;
+
+    // through the broker, the handler gets the message whole
+    broker->publish(topic, payload);
+    CHECK(waitFor([]() { return handled == 42; }));
+    CHECK(!strcmp(seenName, "sensor-7"));
+
+    // in place: the strings of rxDoc point into rxBuffer
+    snprintf(topic, sizeof(topic), "%.*scount/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+    iotCallback(topic, (byte*)payload, len);
+    const char* name = rxDoc["d"]["name"];
+    CHECK(name >= rxBuffer && name < rxBuffer + sizeof(rxBuffer));
+
+    const int N = 1000;
+    host::resetAllocs();
+    host::countAllocs(true);
+    for (int i = 0; i < N; i++) iotCallback(topic, (byte*)payload, len);
+    host::countAllocs(false);
+    host::AllocStats after = host::allocs();
+
+    host::resetAllocs();
+    host::countAllocs(true);
+    for (int i = 0; i < N; i++) {
+        byte2buff(msgBuffer, (byte*)payload, len);
+        StaticJsonDocument<512> root;
+        deserializeJson(root, String(msgBuffer));
+        handleIOTCommand(topic, &root);
+    }
+    host::countAllocs(false);
+    host::AllocStats before = host::allocs();
+
+    CHECK(counted == 42 * (2 * N + 1));
+
+    // the bytes copied by one message on each path
+    memset(msgBuffer, FILL, sizeof(msgBuffer));
+    byte2buff(msgBuffer, (byte*)payload, len);
+    size_t copiedBefore = written(msgBuffer, sizeof(msgBuffer));
+    host::resetAllocs();
+    host::countAllocs(true);
+    String copy(msgBuffer);
+    host::countAllocs(false);
+    copiedBefore += host::allocs().bytes;
+    StaticJsonDocument<512> copying;
+    deserializeJson(copying, copy);
+    copiedBefore += copiedByParse(copying, payload);
+
+    memset(rxBuffer, FILL, sizeof(rxBuffer));
+    iotCallback(topic, (byte*)payload, len);
+    size_t copiedAfter = written(rxBuffer, sizeof(rxBuffer));
+    CHECK(copiedAfter == strlen(topic) + 1 + len + 1);
+    CHECK(copiedByParse(rxDoc, payload) == 0);
+    CHECK(counted == 42 * (2 * N + 2));
+    printf("before: %zu bytes copied, %.2f allocs %.1f B per message\n",
+           copiedBefore, (double)before.count / N, (double)before.bytes / N);
+    printf("after:  %zu bytes copied, %.2f allocs %.1f B per message\n",
+           copiedAfter, (double)after.count / N, (double)after.bytes / N);
+    CHECK(before.count >= N);                   // the String of each message
+    CHECK(after.count == 0);
+    finish("rx_path");
+}
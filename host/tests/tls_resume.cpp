@@ -0,0 +1,72 @@
+/*
+ * tls_resume.cpp : the direct mode over TLS against a local TLS broker
+ *      A TlsProxy with its own CA, in /ca.txt, stands in front of the broker.
+ *      The CA is parsed once for all the connections, the first connection
+ *      is a full handshake and each reconnection after the broker dropped
+ *      the connection resumes the session with its ticket. A ticket the
+ *      broker no longer takes gives a full handshake, and the next one
+ *      resumes again. A broker whose certificate the CA did not sign is
+ *      refused, and the ticket kept through the refusals resumes when the
+ *      broker is back.
+ */
+#include "HostDevice.h"
+#include "TlsProxy.h"
+
+const char          SERVER[] = "host.messaging.internetofthings.ibmcloud.com";
+const int           RECONNECTS = 5;
+
+TlsProxy            tls;
+
+// drops the connection and waits for the handshake number n
+bool reconnect(unsigned long n) {
+    tls.drop();
+    return waitFor([&]() { return tls.handshakes == n && iotState == IOT_CONNECTED; }, 30000);
+}
+
+int main() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t brokerPort = broker->start();
+    CHECK(brokerPort);
+    uint16_t port = tls.start(brokerPort, SERVER);
+    CHECK(port);
+    hostConfig("tls_resume.spiffs", "host", "hostType", "host1", "{\"pubInterval\":1000}");
+    hostCA(tls.caPem().c_str());
+    host::redirect(8883, "127.0.0.1", port);
+    host::setWiFi(true);
+    initDevice();
+    CHECK(!IOT_GATEWAY && !strcmp(iot_server, SERVER));
+    set_iot_server();
+    iotRetryAt = millis();
+    CHECK(waitConnected());
+    CHECK(tls.handshakes == 1 && tls.resumed == 0);
+    CHECK(iotTlsClient.resumable());
+
+    for (int i = 1; i <= RECONNECTS; i++) {
+        CHECK(reconnect(1 + i));
+    }
+    CHECK(tls.resumed == RECONNECTS);
+    CHECK(host::caParses() == 1);
+    CHECK(iotPublish(publishTopic, "{\"d\":{\"n\":1}}"));
+    CHECK(waitFor([&]() { return broker->count(publishTopic) == 1 && inflightPending() == 0; }));
+
+    // the tickets of the broker rotated, a full handshake and then resumed again
+    tls.rotateTickets();
+    CHECK(reconnect(2 + RECONNECTS));
+    CHECK(tls.resumed == RECONNECTS);
+    CHECK(reconnect(3 + RECONNECTS));
+    CHECK(tls.resumed == RECONNECTS + 1);
+
+    // a broker of another CA
+    TlsProxy other;
+    host::redirect(8883, "127.0.0.1", other.start(brokerPort, SERVER));
+    tls.drop();
+    CHECK(waitFor([&]() { return other.failed >= 2; }, 30000));
+    CHECK(iotState != IOT_CONNECTED && other.handshakes == 0);
+    host::redirect(8883, "127.0.0.1", port);
+    CHECK(waitFor([&]() { return tls.handshakes == 4 + RECONNECTS && iotState == IOT_CONNECTED; }, 60000));
+    CHECK(tls.resumed == RECONNECTS + 2);
+    CHECK(host::caParses() == 1);
+    printf("handshakes %lu, resumed %lu, refused %lu\n", tls.handshakes.load(), tls.resumed.load(),
+           other.failed.load());
+    finish("tls_resume");
+}
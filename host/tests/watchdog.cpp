@@ -0,0 +1,65 @@
+/*
+ * watchdog.cpp : the watch dog of the older sketches and of iotLoop()
+ *      A sketch in the older form, iot_connect() and client.loop() without
+ *      iotLoop(), runs in a child process. startIOTWatchDog() adds no task
+ *      to the task watch dog, so the sketch runs on while it makes
+ *      progress, and it reboots, exit code 3 on the host, once its progress
+ *      stamp is older than the limit. A sketch which calls iotLoop() opts
+ *      in with startIOTLoopWatchDog() and has its loop task fed.
+ */
+#include "HostDevice.h"
+#include <sys/wait.h>
+
+const unsigned      LIMIT = 1500;           // ms
+const unsigned long PROGRESS = 2 * LIMIT;   // ms the older sketch makes progress
+unsigned long       lastPublishMillis = 0;
+
+void olderSketch() {
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    hostDevice("watchdog_older.spiffs", port);
+    lastPublishMillis = millis();
+    startIOTWatchDog((void*)&lastPublishMillis, LIMIT);
+    CHECK(host::wdtTasks() == 0);
+    unsigned long t0 = millis();
+    for (;;) {
+        if (!client.connected()) {
+            iot_connect();
+        } else {
+            client.loop();
+        }
+        if (millis() - t0 < PROGRESS) lastPublishMillis = millis();
+        if (millis() - t0 > PROGRESS + 10 * LIMIT) host::exit(0);      // never rebooted
+        delay(10);
+    }
+}
+
+int main() {
+    unsigned long t0 = millis();
+    pid_t older = fork();
+    CHECK(older >= 0);
+    if (older == 0) olderSketch();
+
+    TestBroker* broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    hostDevice("watchdog.spiffs", port);
+    lastPublishMillis = millis();
+    startIOTWatchDog((void*)&lastPublishMillis, 0);
+    CHECK(host::wdtTasks() == 0);
+    startIOTLoopWatchDog();
+    CHECK(host::wdtTasks() == 1);
+    CHECK(waitConnected());
+    CHECK(!waitFor([]() { return false; }, 2500));
+    CHECK(host::wdtResets() >= 2);
+
+    int status = 0;
+    CHECK(waitpid(older, &status, 0) == older);
+    unsigned long rebootAt = millis() - t0;
+    printf("watchdog: the older sketch ended with %d after %lu ms, the loop task fed %lu times\n",
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1, rebootAt, host::wdtResets());
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 3);
+    CHECK(rebootAt >= PROGRESS + LIMIT);
+    finish("watchdog");
+}
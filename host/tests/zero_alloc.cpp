@@ -0,0 +1,71 @@
+/*
+ * zero_alloc.cpp : no heap allocation per publish and command cycle
+ *      After a warm-up, a cycle publishes a status event, a document, a
+ *      report by exception, a batch and an error, and handles the config and
+ *      log commands with their replies, all through the broker and up to the
+ *      PUBACKs. The allocations of the application thread are counted over
+ *      the cycles, except while the test itself hands the broker the
+ *      commands, and have to be none.
+ */
+#include "HostDevice.h"
+
+int                 handled = 0;
+
+void anyHandler(const char* cmdId, JsonDocument* root) {
+    handled++;
+}
+
+char                configTopic[IOT_DEVICE_TOPIC_LENGTH];
+char                logTopic[IOT_DEVICE_TOPIC_LENGTH];
+TestBroker*         broker;
+
+void cycle(int i, JsonDocument& doc) {
+    host::countAllocs(false);
+    broker->publish(configTopic, "{\"d\":{\"config\":true}}");
+    broker->publish(logTopic, "{\"d\":{\"log\":true}}");
+    host::countAllocs(true);
+
+    char payload[64];
+    int n = snprintf(payload, sizeof(payload), "{\"d\":{\"n\":%d,\"temp\":%d.5}}", i, 20 + i % 5);
+    iotPublish(publishTopic, payload, n);
+    doc["d"]["n"] = i;
+    doc["d"]["temp"] = 20 + i % 7;
+    iotPublishDoc(publishTopic, doc);
+    iotPublishChanged(publishTopic, doc);
+    for (int s = 0; s < 3; s++) {
+        JsonObject sample = iotBatchSample();
+        sample["v"] = i * 3 + s;
+    }
+    iotBatchFlush();
+    char error[] = "zero_alloc error";
+    publishError(error);
+
+    int target = handled + 2;
+    CHECK(waitFor([&]() { return handled == target && inflightPending() == 0 && pubqPending() == 0; }));
+}
+
+int main() {
+    broker = makeTestBroker();
+    uint16_t port = broker->start();
+    CHECK(port);
+    hostDevice("zero_alloc.spiffs", port);
+    CHECK(waitConnected());
+    iotOnCommand("+", anyHandler);
+    snprintf(configTopic, sizeof(configTopic), "%.*sconfig/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+    snprintf(logTopic, sizeof(logTopic), "%.*slog/fmt/json", (int)iotCmdPrefixLen, commandTopic);
+
+    StaticJsonDocument<256> doc;
+    for (int i = 0; i < 20; i++) cycle(i, doc);
+
+    const int CYCLES = 200;
+    host::resetAllocs();
+    host::countAllocs(true);
+    for (int i = 20; i < 20 + CYCLES; i++) cycle(i, doc);
+    host::countAllocs(false);
+    host::AllocStats a = host::allocs();
+    printf("%d cycles: %lu allocations, %lu bytes, %lu messages acknowledged\n",
+           CYCLES, a.count, a.bytes, inflightStats.acked);
+    CHECK(a.count == 0);
+    CHECK(iotState == IOT_CONNECTED);
+    finish("zero_alloc");
+}
@@ -9,6 +9,20 @@
  *      webServer.on("/uri", html);    to add the additional custom page
  *      reboot();
  *      reset_config();
+ *      iotPublish(topic, payload);     queued on SPIFFS while offline
+ *      pubqDrain();                    replays the queue, call it in loop
+ *      iotLoop();                      connects step by step, runs client.loop and pubqDrain
+ *      iotPublishDoc(topic, root);     serialized in the fmt of the topic, json or msgpack
+ *      iotPublishChanged(topic, root); only when a field of d moved past its deadband
+ *      iotPublishStream(topic, root);  a large document written straight to the socket
+ *      iotBatchSample();               a sample object to fill, published in batches
+ *      startIOTNetTask();              with IOT_NET_TASK, runs the MQTT client on its own task
+ *      iotOn("update", fn);            handler for a device management topic
+ *      iotOnCommand("cmdId", fn);      handler for a command, "+" for any
+ *      iotEvery(ms, fn);               runs fn every ms from iotLoop, iotAfter(ms, fn) once
+ *      IOT_LOGW(fmt, ...);             logged without waiting for Serial, also E, I and D
+ *      iotAddDevice(type, id, fn);     a child device of the gateway
+ *      iotDevicePublish(dev, topic, payload, len);
  *
  *  Usage Scenario:
  *      After include, customize these variables to set the Access Point prefix 
@@ -22,22 +36,59 @@
 #include <WiFi.h>
 #include <WebServer.h>
 #include <DNSServer.h>
-#include <WiFiClientSecure.h>
+#include <esp_tls.h>
+#include <fcntl.h>
 #include <ArduinoJson.h>
 #include <SPIFFS.h>
 #include <PubSubClient.h>
-#include <HTTPUpdate.h>
+#include <HTTPClient.h>
+#include <Update.h>
 #include<ESPmDNS.h>
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
 
 const char          compile_date[] = __DATE__ " " __TIME__;
-char                publishTopic[200]   = "iot-2/evt/status/fmt/json";
-char                infoTopic[200]      = "iot-2/evt/info/fmt/json";
-char                commandTopic[200]   = "iot-2/cmd/+/fmt/+";
-char                responseTopic[200]  = "iotdm-1/response";
-char                manageTopic[200]    = "iotdevice-1/mgmt/manage";
-char                updateTopic[200]    = "iotdm-1/device/update";
-char                rebootTopic[200]    = "iotdm-1/mgmt/initiate/device/reboot";
-char                resetTopic[200]     = "iotdm-1/mgmt/initiate/device/factory_reset";
+
+/*
+ * Connection Mode
+ *      -D IOT_MODE_DIRECT for the IBM cloud over TLS, or -D IOT_MODE_GATEWAY
+ *      for an edge gateway, fixes the mode at compile time. The topics are
+ *      then the literals below, or built once into iotTopicPool, and the
+ *      other mode is compiled out. Without either, the mode follows the org
+ *      of the setup page: an address with a '.' is a gateway.
+ */
+#if defined(IOT_MODE_DIRECT)
+#define             IOT_GATEWAY false
+#elif defined(IOT_MODE_GATEWAY)
+#define             IOT_GATEWAY true
+#else
+bool                iotGateway = false;
+#define             IOT_GATEWAY iotGateway
+#endif
+
+#define             IOT_TOPICS 8
+const char* const   iotTopicTemplates[IOT_TOPICS] = {
+    "iot-2/evt/status/fmt/json",
+    "iot-2/evt/info/fmt/json",
+    "iot-2/cmd/+/fmt/+",
+    "iotdm-1/response",
+    "iotdevice-1/mgmt/manage",
+    "iotdm-1/device/update",
+    "iotdm-1/mgmt/initiate/device/reboot",
+    "iotdm-1/mgmt/initiate/device/factory_reset"
+};
+const char*         publishTopic        = iotTopicTemplates[0];
+const char*         infoTopic           = iotTopicTemplates[1];
+const char*         commandTopic        = iotTopicTemplates[2];
+const char*         responseTopic       = iotTopicTemplates[3];
+const char*         manageTopic         = iotTopicTemplates[4];
+const char*         updateTopic         = iotTopicTemplates[5];
+const char*         rebootTopic         = iotTopicTemplates[6];
+const char*         resetTopic          = iotTopicTemplates[7];
+#ifndef IOT_MODE_DIRECT
+char*               iotTopicPool = NULL;        // allocated once for the lengths of devType and devId
+size_t              iotPublishTopicSize = 0;    // publishTopic room in the pool, for the fmt
+#endif
 
 #define             JSON_BUFFER_LENGTH 2048
 StaticJsonDocument<JSON_BUFFER_LENGTH> cfg;
@@ -47,6 +98,7 @@ WebServer           webServer(80);
 const int           RESET_PIN = 0;
 
 char                cfgFile[] = "/config.json";
+char                cfgTmpFile[] = "/config.tmp";
 
 void                (*userConfigLoop)() = NULL; 
             // you can run something even during the iotDevceConfig routine
@@ -55,7 +107,7 @@ extern              String user_html;
 extern char         *ssid_pfix;
 
 char                caFile[] = "/ca.txt";
-String              ca = ""
+const char          caDefault[] = ""
     "-----BEGIN CERTIFICATE-----\n"
     "MIIDrzCCApegAwIBAgIQCDvgVpBCRrGhdWrJWZHHSjANBgkqhkiG9w0BAQUFADBh\n"
     "MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
@@ -78,6 +130,7 @@ String              ca = ""
     "YSEY1QSteDwsOoBrp+uvFRTp2InBuThs4pFsiv9kuXclVzDAGySj4dzp30d8tbQk\n"
     "CAUw7C29C79Fv1C5qfPrmAESrciIxpg0X40KPMbp1ZWVbd4=\n"
     "-----END CERTIFICATE-----\n";
+const char*         ca = caDefault;             // in flash unless caFile replaces it
 
 int                 mqttPort = 0;
 
@@ -111,7 +164,6 @@ String postSave_html = ""
 
 
 WiFiClient          wifiClient;
-WiFiClientSecure    wifiClientSecure;
 PubSubClient        client;
 char                iot_server[200];
 char                msgBuffer[JSON_BUFFER_LENGTH];
@@ -125,47 +177,457 @@ void byte2buff(char* msg, byte* payload, unsigned int len) {
     msg[j] = '\0';
 }
 
+/*
+ * Bounded Writer
+ *      IOTWriter appends to a buffer owned by the caller and stops at its end,
+ *      remembering the overflow, so the payloads are built without String
+ *      and without heap allocation.
+ */
+struct IOTWriter {
+    char*           buff;
+    size_t          size;
+    size_t          len;
+    bool            overflow;
+
+    IOTWriter(char* b, size_t s) : buff(b), size(s), len(0), overflow(false) {
+        buff[0] = '\0';
+    }
+
+    IOTWriter& add(const char* s, size_t n) {
+        if (len + n >= size) {
+            n = size - 1 - len;
+            overflow = true;
+        }
+        memcpy(buff + len, s, n);
+        len += n;
+        buff[len] = '\0';
+        return *this;
+    }
+
+    IOTWriter& add(const char* s) {
+        return add(s, strlen(s));
+    }
+
+    IOTWriter& addf(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buff + len, size - len, fmt, args);
+        va_end(args);
+        if (n < 0 || len + n >= size) {
+            len = size - 1;
+            overflow = true;
+        } else {
+            len += n;
+        }
+        return *this;
+    }
+
+    // a JSON string with the quotes and the escapes
+    IOTWriter& addString(const char* s) {
+        add("\"", 1);
+        for (const char* p = s; *p; p++) {
+            if (*p == '"' || *p == '\\') {
+                add("\\", 1);
+            } else if ((unsigned char)*p < 0x20) {
+                addf("\\u%04x", *p);
+                continue;
+            }
+            add(p, 1);
+        }
+        return add("\"", 1);
+    }
+
+    IOTWriter& addJson(JsonVariantConst v) {
+        size_t n = serializeJson(v, buff + len, size - len);
+        if (len + n >= size - 1) overflow = true;
+        len += n;
+        return *this;
+    }
+};
+
 ICACHE_RAM_ATTR void reboot() {
     WiFi.disconnect();
     ESP.restart();
 }
 
-unsigned    iotWatchDogLimit = 300000;
-void iotWatchDog(void * elapsed) {
-    unsigned df;
-    while(true) {
-        df = millis() - *((unsigned*)elapsed);
-        // Serial.printf("\nWatchDog Ticker : %u %u\n", df, iotWatchDogLimit);
-        if(df > iotWatchDogLimit) {
-            reboot();
+/*
+ * Logger
+ *      IOT_LOGE/W/I/D(fmt, ...) format a line into a slot of logRing and
+ *      return, and iotLogTask, at the lowest priority, writes the lines to
+ *      Serial. The levels above IOT_LOG_LEVEL are compiled out. A writer
+ *      claims its slot with an atomic increment of logHead and publishes it
+ *      by storing the sequence last, so any task can log without a lock.
+ *      The ring keeps the last IOT_LOG_SLOTS lines for a d.log command, and
+ *      with IOT_LOG_FORWARD the warnings and errors are also published on
+ *      infoTopic, one per IOT_LOG_FORWARD_INTERVAL ms at most.
+ */
+#define             IOT_LOG_NONE            0
+#define             IOT_LOG_ERROR           1
+#define             IOT_LOG_WARN            2
+#define             IOT_LOG_INFO            3
+#define             IOT_LOG_DEBUG           4
+#ifndef IOT_LOG_LEVEL
+#define             IOT_LOG_LEVEL           IOT_LOG_INFO
+#endif
+#ifndef IOT_LOG_SLOTS
+#define             IOT_LOG_SLOTS           32
+#endif
+#ifndef IOT_LOG_LINE
+#define             IOT_LOG_LINE            96
+#endif
+#ifndef IOT_LOG_FORWARD_INTERVAL
+#define             IOT_LOG_FORWARD_INTERVAL 10000  // ms
+#endif
+
+#if IOT_LOG_LEVEL >= IOT_LOG_ERROR
+#define             IOT_LOGE(...)           iotLog(IOT_LOG_ERROR, __VA_ARGS__)
+#else
+#define             IOT_LOGE(...)           do {} while (0)
+#endif
+#if IOT_LOG_LEVEL >= IOT_LOG_WARN
+#define             IOT_LOGW(...)           iotLog(IOT_LOG_WARN, __VA_ARGS__)
+#else
+#define             IOT_LOGW(...)           do {} while (0)
+#endif
+#if IOT_LOG_LEVEL >= IOT_LOG_INFO
+#define             IOT_LOGI(...)           iotLog(IOT_LOG_INFO, __VA_ARGS__)
+#else
+#define             IOT_LOGI(...)           do {} while (0)
+#endif
+#if IOT_LOG_LEVEL >= IOT_LOG_DEBUG
+#define             IOT_LOGD(...)           iotLog(IOT_LOG_DEBUG, __VA_ARGS__)
+#else
+#define             IOT_LOGD(...)           do {} while (0)
+#endif
+
+struct LogLine {
+    volatile uint32_t seq;                  // sequence + 1 once written, 0 while writing
+    unsigned long   ms;
+    uint8_t         level;
+    char            text[IOT_LOG_LINE];
+};
+
+struct LogStats {
+    unsigned long   lost;                   // overwritten before they were printed
+    unsigned long   forwarded;
+};
+
+LogLine             logRing[IOT_LOG_SLOTS];
+uint32_t            logHead = 0;            // next sequence, claimed by the writers
+uint32_t            logTail = 0;            // next sequence to print
+uint32_t            logWarnSeq = 0;         // sequence + 1 of the last warning or error
+LogStats            logStats = {0, 0};
+TaskHandle_t        iotLogTaskHandle = NULL;
+const char          logLevels[] = "-EWID";
+
+void iotLog(uint8_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void iotLog(uint8_t level, const char* fmt, ...) {
+    uint32_t seq = __atomic_fetch_add(&logHead, 1, __ATOMIC_RELAXED);
+    LogLine* l = &logRing[seq % IOT_LOG_SLOTS];
+    __atomic_store_n(&l->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);        // the 0 is seen before any of the new line
+    l->ms = millis();
+    l->level = level;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(l->text, sizeof(l->text), fmt, args);
+    va_end(args);
+    __atomic_store_n(&l->seq, seq + 1, __ATOMIC_RELEASE);
+    if (level <= IOT_LOG_WARN) __atomic_store_n(&logWarnSeq, seq + 1, __ATOMIC_RELAXED);
+}
+
+// copies the line of sequence seq, false when it is being written or was overwritten
+bool logRead(uint32_t seq, LogLine* out) {
+    LogLine* l = &logRing[seq % IOT_LOG_SLOTS];
+    if (__atomic_load_n(&l->seq, __ATOMIC_ACQUIRE) != seq + 1) return false;
+    memcpy(out, l, sizeof(LogLine));
+    out->text[IOT_LOG_LINE - 1] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);        // the copy is done before seq is read again
+    return __atomic_load_n(&l->seq, __ATOMIC_RELAXED) == seq + 1;
+}
+
+void iotLogTask(void* arg) {
+    LogLine line;
+    while (true) {
+        uint32_t head = __atomic_load_n(&logHead, __ATOMIC_ACQUIRE);
+        if (head - logTail > IOT_LOG_SLOTS) {
+            logStats.lost += head - logTail - IOT_LOG_SLOTS;
+            logTail = head - IOT_LOG_SLOTS;
+        }
+        while (logTail != head) {
+            if (!logRead(logTail, &line)) {
+                uint32_t seq = logRing[logTail % IOT_LOG_SLOTS].seq;
+                if (seq == 0 || seq == logTail + 1 - IOT_LOG_SLOTS) break;  // still being written
+                logStats.lost++;
+            } else {
+                Serial.println(line.text);
+            }
+            logTail++;
+        }
+        vTaskDelay(20 / portTICK_PERIOD_MS);
+    }
+}
+
+void startIOTLogTask() {
+    if (iotLogTaskHandle == NULL) {
+        xTaskCreate(iotLogTask, "iotLogTask", 2048, NULL, 0, &iotLogTaskHandle);
+    }
+}
+
+/*
+ * Runtime Metrics
+ *      Counters and fixed size histograms of the hot paths, in static memory,
+ *      so they can stay on in the field. A histogram bucket i counts the
+ *      durations below 64 << (2 * i) us, 64us, 256us, 1ms ... 16s, and the
+ *      last one the longer ones. iotMetricsPublish() reports them on infoTopic.
+ */
+#define             IOT_HIST_BUCKETS        10
+#define             IOT_METRIC_PHASES       5       // IOT_WIFI .. IOT_ANNOUNCE
+#define             IOT_METRIC_KINDS        6       // IOT_TOPIC_NONE .. IOT_TOPIC_COMMAND
+#ifndef IOT_METRICS_INTERVAL
+#define             IOT_METRICS_INTERVAL    300000  // ms, 0 to report on d.metrics only
+#endif
+
+struct IOTHist {
+    unsigned long   count;
+    unsigned long   max;                    // us
+    uint64_t        sum;                    // us
+    unsigned long   bucket[IOT_HIST_BUCKETS];
+};
+
+struct IOTMetrics {
+    unsigned long   pubAttempted;
+    unsigned long   pubFailed;
+    unsigned long   bytesOut;
+    unsigned long   bytesIn;
+    unsigned long   reconnects;
+    IOTHist         phase[IOT_METRIC_PHASES];   // time spent in each connection step
+    IOTHist         tls;                    // TLS connection and handshake
+    IOTHist         command[IOT_METRIC_KINDS];  // handling time per topic kind
+    unsigned long   heapLow;
+    unsigned long   loopStackLow;           // stack bytes never used
+    unsigned long   netStackLow;
+};
+
+IOTMetrics          iotMetrics;
+
+void iotHistRecord(IOTHist* h, unsigned long us) {
+    int i = 0;
+    for (unsigned long limit = 64; i < IOT_HIST_BUCKETS - 1 && us >= limit; i++) {
+        limit <<= 2;
+    }
+    h->bucket[i]++;
+    h->count++;
+    h->sum += us;
+    if (us > h->max) h->max = us;
+}
+
+/*
+ * Scheduler
+ *      iotEvery() and iotAfter() put a periodic or a one shot job in the
+ *      fixed iotJobs table, and iotLoop() runs the due ones. The next
+ *      deadline of a periodic job is the previous deadline plus the period,
+ *      not the time it ran, so it does not drift. A job found later than a
+ *      whole period has overrun: the missed runs are skipped and counted.
+ *      How late each run started goes to the late histogram of the job.
+ */
+#ifndef IOT_MAX_JOBS
+#define             IOT_MAX_JOBS            8
+#endif
+
+typedef void (*IOTJob)();
+
+struct IOTJobEntry {
+    IOTJob          fn;                     // NULL for a free entry
+    unsigned long   period;                 // ms, 0 pauses a periodic job
+    unsigned long   due;                    // millis() of the next run
+    bool            once;
+    unsigned long   overruns;               // runs skipped
+    IOTHist         late;
+};
+
+IOTJobEntry         iotJobs[IOT_MAX_JOBS];
+
+int iotSchedule(unsigned long ms, IOTJob fn, bool once) {
+    for (int i = 0; i < IOT_MAX_JOBS; i++) {
+        if (iotJobs[i].fn == NULL) {
+            memset(&iotJobs[i], 0, sizeof(IOTJobEntry));
+            iotJobs[i].period = ms;
+            iotJobs[i].due = millis() + ms;
+            iotJobs[i].once = once;
+            iotJobs[i].fn = fn;
+            return i;
+        }
+    }
+    IOT_LOGW("no free scheduler job");
+    return -1;
+}
+
+// returns the job number or -1 when the table is full
+int iotEvery(unsigned long ms, IOTJob fn) {
+    return iotSchedule(ms, fn, false);
+}
+
+int iotAfter(unsigned long ms, IOTJob fn) {
+    return iotSchedule(ms, fn, true);
+}
+
+void iotCancel(int job) {
+    if (job >= 0 && job < IOT_MAX_JOBS) iotJobs[job].fn = NULL;
+}
+
+// the next run in ms from now, and every ms after it, 0 pauses the job
+void iotReschedule(int job, unsigned long ms) {
+    if (job < 0 || job >= IOT_MAX_JOBS || !iotJobs[job].fn) return;
+    iotJobs[job].period = ms;
+    iotJobs[job].due = millis() + ms;
+}
+
+void iotRunJobs() {
+    unsigned long now = millis();
+    for (int i = 0; i < IOT_MAX_JOBS; i++) {
+        IOTJobEntry* j = &iotJobs[i];
+        if (!j->fn || (!j->period && !j->once) || (long)(now - j->due) < 0) continue;
+        iotHistRecord(&j->late, min(now - j->due, 4000000UL) * 1000);
+        IOTJob fn = j->fn;
+        if (j->once) {
+            j->fn = NULL;                   // free before the run, which may schedule again
+        } else {
+            j->due += j->period;
+            if ((long)(now - j->due) >= 0) {
+                unsigned long missed = (now - j->due) / j->period + 1;
+                j->overruns += missed;
+                j->due += missed * j->period;
+            }
         }
-        vTaskDelay(10000);
+        fn();
+    }
+}
+
+/*
+ * Watch Dog
+ *      startIOTWatchDog() reboots the device when the millis() in wdTime,
+ *      which the application updates as it makes progress, gets older than
+ *      wdlimit ms. An esp_timer checks it every IOT_WATCHDOG_CHECK ms, off
+ *      the loop task, so it holds whether the sketch runs iotLoop() or
+ *      iot_connect() and client.loop(), and also when loop() hangs.
+ *      startIOTLoopWatchDog() puts the loop task under the task watch dog,
+ *      fed by a job of iotLoop(), so a loop() stuck for IOT_WATCHDOG_TIMEOUT
+ *      seconds resets the device: for the sketches which call iotLoop()
+ *      only, the task watch dog of the others would never be fed.
+ */
+#ifndef IOT_WATCHDOG_CHECK
+#define             IOT_WATCHDOG_CHECK      1000    // ms
+#endif
+#ifndef IOT_WATCHDOG_TIMEOUT
+#define             IOT_WATCHDOG_TIMEOUT    60      // seconds
+#endif
+
+volatile unsigned    iotWatchDogLimit = 300000;
+volatile unsigned long* iotWatchDogTime = NULL;
+esp_timer_handle_t  iotWatchDogTimer = NULL;
+
+void iotWatchDog(void* arg) {
+    if (iotWatchDogLimit && millis() - *iotWatchDogTime > iotWatchDogLimit) {
+        reboot();
     }
 }
 
-void startIOTWatchDog(void* wdTime, unsigned wdlimit = iotWatchDogLimit){
+void startIOTWatchDog(void* wdTime, unsigned wdlimit = iotWatchDogLimit) {
+    iotWatchDogTime = (unsigned long*)wdTime;
     iotWatchDogLimit = wdlimit;
-    xTaskCreate( iotWatchDog, "iotWatchDog", 10000, wdTime, 1, NULL);
-} 
+    if (iotWatchDogTimer) {
+        return;                                     // running, with the new limit
+    }
+    esp_timer_create_args_t args = {};
+    args.callback = iotWatchDog;
+    args.name = "iotWatchDog";
+    if (esp_timer_create(&args, &iotWatchDogTimer) != ESP_OK ||
+                esp_timer_start_periodic(iotWatchDogTimer, IOT_WATCHDOG_CHECK * 1000ULL) != ESP_OK) {
+        IOT_LOGE("no timer for the watch dog");
+    }
+}
+
+void iotFeedLoopWatchDog() {
+    esp_task_wdt_reset();
+}
+
+// call from setup(), when loop() calls iotLoop()
+void startIOTLoopWatchDog() {
+    esp_task_wdt_init(IOT_WATCHDOG_TIMEOUT, true);
+    esp_task_wdt_add(NULL);
+    iotEvery(IOT_WATCHDOG_CHECK, iotFeedLoopWatchDog);
+}
+
+/*
+ * Config Store
+ *      save_config_json() writes cfgTmpFile first and renames it over cfgFile,
+ *      so a power cut leaves either the old or the new configuration. The
+ *      metadata updates only mark cfg dirty with iotConfigChanged() and a
+ *      burst of them is written once by iotConfigFlush(), IOT_CFG_FLUSH_DELAY
+ *      ms after the last change.
+ */
+#ifndef IOT_CFG_FLUSH_DELAY
+#define             IOT_CFG_FLUSH_DELAY     3000
+#endif
+
+bool                cfgDirty = false;
+unsigned long       cfgDirtyAt = 0;
+unsigned long       cfgLoadMicros = 0;      // boot time config load
 
 void save_config_json(){
-    serializeJson(cfg, cfgBuffer);
-    File f = SPIFFS.open(cfgFile, "w");
-    f.print(cfgBuffer);
-    f.close();
+    size_t len = serializeJson(cfg, cfgBuffer);
+    File f = SPIFFS.open(cfgTmpFile, "w");
+    size_t written = f ? f.write((uint8_t*)cfgBuffer, len) : 0;
+    if (f) f.close();
+    if (written != len) {
+        IOT_LOGE("config save failed");
+        SPIFFS.remove(cfgTmpFile);
+        return;
+    }
+    SPIFFS.remove(cfgFile);
+    SPIFFS.rename(cfgTmpFile, cfgFile);
+    cfgDirty = false;
 }
 
+void iotConfigChanged() {
+    cfgDirty = true;
+    cfgDirtyAt = millis();
+}
+
+void iotConfigFlush() {
+    if (cfgDirty && millis() - cfgDirtyAt >= IOT_CFG_FLUSH_DELAY) {
+        save_config_json();
+    }
+}
+
+// writes the pending change right away, before a reboot
+void iotConfigSync() {
+    if (cfgDirty) {
+        save_config_json();
+    }
+}
+
+// writes topic with "/type/<devType>/id/<devId>" after its first segment,
+// returns the length or 0 when it does not fit in size
+size_t gatewayTopic(char* out, size_t size, const char* topic, const char* devType, const char* devId) {
+    const char* slash = strchr(topic, '/');
+    if (!slash) return 0;
+    int n = snprintf(out, size, "%.*s/type/%s/id/%s%s", (int)(slash - topic), topic, devType, devId, slash);
+    return n > 0 && (size_t)n < size ? n : 0;
+}
+
+// in place, for a topic buffer of 200 bytes
 void toGatewayTopic(char* topic, const char* devType, const char* devId) {
     char buffer[200];
-    char devInfo[100];
-    sprintf(devInfo, "/type/%s/id/%s", devType, devId);
+    if (gatewayTopic(buffer, sizeof(buffer), topic, devType, devId)) {
+        strcpy(topic, buffer);
+    }
+}
 
-    char* slash = strchr(topic, '/');
-    int len = slash - topic;
-    strncpy(buffer, topic, len);
-    strcpy(buffer + len, devInfo);
-    strcpy(buffer + strlen(buffer), slash);
-    strcpy(topic, buffer);
+bool isMsgPackTopic(const char* topic) {
+    const char* p = strrchr(topic, '/');
+    return p && p - topic >= 4 && !strncmp(p - 4, "/fmt/msgpack", 12) && p[8] == '\0';
 }
 
 void reset_config() {
@@ -173,327 +635,2615 @@ void reset_config() {
     save_config_json();
 }
 
+// writes cfg with the secrets masked, while serializing and without a copy of cfg
+void maskConfigTo(IOTWriter& w, const char* compileDate = NULL) {
+    JsonObject obj = cfg.as<JsonObject>();
+    w.add("{", 1);
+    bool first = true;
+    for (JsonObject::iterator it=obj.begin(); it!=obj.end(); ++it) {
+        if (!first) w.add(",", 1);
+        first = false;
+        w.addString(it->key().c_str()).add(":", 1);
+        if (!strcmp(it->key().c_str(), "w_pw") || !strcmp(it->key().c_str(), "token")) {
+            w.add("\"********\"");
+        } else {
+            w.addJson(it->value());
+        }
+    }
+    if (compileDate) {
+        if (!first) w.add(",", 1);
+        w.add("\"compile_date\":").addString(compileDate);
+    }
+    w.add("}", 1);
+}
+
 void maskConfig(char* buff) {
-    DynamicJsonDocument temp_cfg = cfg;
-    temp_cfg["w_pw"] = "********";
-    temp_cfg["token"] = "********";
-    serializeJson(temp_cfg, buff, JSON_BUFFER_LENGTH);
+    IOTWriter w(buff, JSON_BUFFER_LENGTH);
+    maskConfigTo(w);
 }
 
-void init_cfg() {
-    if (SPIFFS.exists(cfgFile)) {
-        File f = SPIFFS.open(cfgFile, "r");
-        char buff[512];
-        int i = 0;
-        while(f.available()) {
-            buff[i++] = f.read();
-        }
-        f.close();
+// reads the whole file into cfgBuffer with one read and parses it from there
+bool load_config_json(const char* file) {
+    File f = SPIFFS.open(file, "r");
+    if (!f) return false;
+    size_t len = f.size() < sizeof(cfgBuffer) ? f.read((uint8_t*)cfgBuffer, f.size()) : 0;
+    f.close();
+    return len && !deserializeJson(cfg, (const char*)cfgBuffer, len);
+}
 
-        DeserializationError error = deserializeJson(cfg, String(buff));
-	    if (error) {
-	        deserializeJson(cfg, "{meta:{}}");
-	    } else {
-	        Serial.println("CONFIG JSON Successfully loaded");
-	        char maskBuffer[JSON_BUFFER_LENGTH];
-	        maskConfig(maskBuffer);
-	        Serial.println(String(maskBuffer));
-	    }
-    } else {
-	    deserializeJson(cfg, "{meta:{}}");
+void init_cfg() {
+    unsigned long t0 = micros();
+    if (SPIFFS.exists(cfgTmpFile) && load_config_json(cfgTmpFile)) {
+        // the power went off between the write and the rename
+        SPIFFS.remove(cfgFile);
+        SPIFFS.rename(cfgTmpFile, cfgFile);
+    } else if (!SPIFFS.exists(cfgFile) || !load_config_json(cfgFile)) {
+        deserializeJson(cfg, "{meta:{}}");
+        cfgLoadMicros = micros() - t0;
+        return;
     }
+    cfgLoadMicros = micros() - t0;
+    IOT_LOGI("CONFIG JSON Successfully loaded in %lu us", cfgLoadMicros);
+#if IOT_LOG_LEVEL >= IOT_LOG_DEBUG
+    IOTWriter w(msgBuffer, sizeof(msgBuffer));         // longer than a log line
+    maskConfigTo(w);
+    Serial.println(msgBuffer);
+#endif
 }
 
-void iotInitDevice() {
-    // check Factory Reset Request and reset if requested
-    // and initialize
+/*
+ * Store and Forward Publish Queue
+ *      iotPublish() sends right away while the broker is reachable, otherwise
+ *      the message is kept in a ring of fixed size slots in pubqFile and
+ *      replayed by pubqDrain() after the reconnection, a few per interval.
+ *      Each slot carries its sequence number, so head and tail are recovered
+ *      by a scan at boot and no index record has to be rewritten per message.
+ */
+#ifndef IOT_PUBQ_SLOTS
+#define             IOT_PUBQ_SLOTS          32
+#endif
+#ifndef IOT_PUBQ_SLOT_SIZE
+#define             IOT_PUBQ_SLOT_SIZE      512
+#endif
+#ifndef IOT_PUBQ_BATCH
+#define             IOT_PUBQ_BATCH          4       // messages per drain
+#endif
+#ifndef IOT_PUBQ_DRAIN_INTERVAL
+#define             IOT_PUBQ_DRAIN_INTERVAL 200     // ms between drains
+#endif
 
-    if(!SPIFFS.begin()) {
-        SPIFFS.format();
-    }
-    pinMode(RESET_PIN, INPUT_PULLUP);
-    if( digitalRead(RESET_PIN) == 0 ) {
-        unsigned long t1 = millis();
-        while(digitalRead(RESET_PIN) == 0) {
-            delay(500);
-            Serial.print(".");
-        }
-        if (millis() - t1 > 5000) {
-            reset_config();             // Factory Reset
-        }
-    }
-    attachInterrupt(RESET_PIN, reboot, FALLING);
-    init_cfg();
+struct PubqSlot {
+    uint32_t        seq;                            // 0 for the empty slot
+    uint16_t        topicLen;
+    uint16_t        payloadLen;
+};
+
+struct PubqStats {
+    unsigned long   queued;
+    unsigned long   dropped;
+    unsigned long   replayed;
+    unsigned long   rejected;                       // larger than the client buffer
+};
+
+char                pubqFile[] = "/pubq.dat";
+uint32_t            pubqHead = 1;                   // next sequence to store
+uint32_t            pubqTail = 1;                   // oldest sequence not sent
+unsigned long       pubqLastDrain = 0;
+PubqStats           pubqStats = {0, 0, 0, 0};
+char                pubqBuffer[IOT_PUBQ_SLOT_SIZE];
+
+// PubSubClient refuses a message larger than its buffer whatever the connection
+bool iotClientFits(const char* topic, unsigned int len) {
+    return MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + len <= client.getBufferSize();
 }
 
-void saveEnv() {
-    int args = webServer.args();
-    for (int i = 0; i < args ; i++){
-        if (webServer.argName(i).indexOf(String("meta.")) == 0 ) {
-            cfg["meta"][webServer.argName(i).substring(5)] = webServer.arg(i);
-        } else {
-            cfg[webServer.argName(i)] = webServer.arg(i);
-        }
+bool iotClientPublish(const char* topic, const char* payload, unsigned int len) {
+    iotMetrics.pubAttempted++;
+    if (client.publish(topic, (const uint8_t*)payload, len)) {
+        iotMetrics.bytesOut += len;
+        return true;
     }
-    cfg["config"] = "done";
-    save_config_json();
-    webServer.send(200, "text/html", postSave_html);
+    iotMetrics.pubFailed++;
+    return false;
 }
 
-void iotConfigDevice() {
-    DNSServer   dnsServer;
-    const byte  DNS_PORT = 53;
-    IPAddress   apIP(192, 168, 1, 1);
-    WiFi.mode(WIFI_AP);
-    WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
-    char ap_name[100];
-    sprintf(ap_name, "%s_%08X", ssid_pfix, (unsigned int)ESP.getEfuseMac());
-    WiFi.softAP(ap_name);
-    delay(3000);
-    dnsServer.start(DNS_PORT, "*", apIP);
+/*
+ * In-flight Window
+ *      iotPublish() sends at QoS 1. PubSubClient only publishes at QoS 0 and
+ *      drops the PUBACK, so the library writes the PUBLISH frame itself,
+ *      with its packet id, through client.write(), and the client is given
+ *      iotAckClient, which wraps the socket and sees every byte PubSubClient
+ *      reads to pick the PUBACKs out. Up to IOT_INFLIGHT_WINDOW frames wait
+ *      for their PUBACK in inflightBuffer without holding the publishing
+ *      back, and the frames past the window are held there, in order, and
+ *      written as the PUBACKs come. A frame is written again with the DUP
+ *      flag after IOT_INFLIGHT_TIMEOUT ms without its PUBACK, and given up
+ *      after IOT_INFLIGHT_RETRIES times; the frames of a lost connection are
+ *      all written again, in order and before the queue, after the
+ *      reconnection. When inflightBuffer is full, iotPublish() returns false
+ *      and the caller publishes again later: the queue on flash is only for
+ *      while the broker is not connected.
+ */
+#ifndef IOT_INFLIGHT_BYTES
+#define             IOT_INFLIGHT_BYTES      4096
+#endif
+#ifndef IOT_INFLIGHT_WINDOW
+#define             IOT_INFLIGHT_WINDOW     8
+#endif
+#ifndef IOT_INFLIGHT_TIMEOUT
+#define             IOT_INFLIGHT_TIMEOUT    10000   // ms
+#endif
+#ifndef IOT_INFLIGHT_RETRIES
+#define             IOT_INFLIGHT_RETRIES    3
+#endif
 
-    webServer.on("/save", saveEnv);
-    webServer.on("/reboot", reboot);
+struct InflightEntry {
+    unsigned long   sentAt;                         // millis() of the last write
+    uint32_t        conn;                           // inflightConn of the last write
+    uint16_t        id;
+    uint16_t        frameLen;
+    uint8_t         retries;
+    bool            acked;
+    bool            held;                           // past the window, not written yet
+};
 
-    webServer.onNotFound([]() {
-        webServer.send(200, "text/html", html_begin + user_html + html_end);
-    });
-    webServer.begin();
-    Serial.println("starting the config");
-    while(1) {
-        yield();
-        dnsServer.processNextRequest();
-        webServer.handleClient();
-        if(userConfigLoop != NULL) {
-            (*userConfigLoop)();
-        }
+struct InflightStats {
+    unsigned long   acked;
+    unsigned long   resent;
+    unsigned long   failed;                         // given up after the retries
+    unsigned long   qos0;                           // too large for the window
+    unsigned long   full;                           // refused, inflightBuffer was full
+};
+
+char                inflightBuffer[IOT_INFLIGHT_BYTES];
+uint32_t            inflightHead = 0;               // byte offsets, taken modulo the size
+uint32_t            inflightTail = 0;
+int                 inflightCount = 0;              // the frames in inflightBuffer
+int                 inflightHeld = 0;               // the last ones of them, not written yet
+int                 inflightOut = 0;                // written and waiting for their PUBACK
+uint32_t            inflightConn = 0;               // counts the MQTT connections
+uint16_t            inflightNextId = 0;
+InflightStats       inflightStats = {0, 0, 0, 0, 0};
+
+void inflightWrite(uint32_t pos, const void* src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        inflightBuffer[(pos + i) % IOT_INFLIGHT_BYTES] = ((const char*)src)[i];
     }
 }
 
-bool subscribeTopic(const char* topic) {
-    if (client.subscribe(topic)) {
-        Serial.printf("Subscription to %s OK\n", topic);
-        return true;
-    } else {
-        Serial.printf("Subscription to %s Failed\n", topic);
-        return false;
+void inflightRead(uint32_t pos, void* dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ((char*)dst)[i] = inflightBuffer[(pos + i) % IOT_INFLIGHT_BYTES];
     }
 }
 
-void initDevice() {
-    iotInitDevice();
-    if(!cfg.containsKey("config") || strcmp((const char*)cfg["config"], "done") || !cfg.containsKey("org")) {
-        reset_config();
-        iotConfigDevice();
+// removes the acknowledged frames at the tail
+void inflightTrim() {
+    InflightEntry e;
+    while (inflightCount) {
+        inflightRead(inflightTail, &e, sizeof(e));
+        if (!e.acked) break;
+        inflightTail += sizeof(e) + e.frameLen;
+        inflightCount--;
     }
+}
 
-    String org = cfg["org"];
-    if (org.indexOf(".") == -1) {
-        if (SPIFFS.exists(caFile)) {
-            File f = SPIFFS.open(caFile, "r");
-            ca = f.readString();
-            ca.trim();
-            f.close();
+// a PUBACK, from the bytes read by PubSubClient
+void inflightAck(uint16_t id) {
+    InflightEntry e;
+    uint32_t pos = inflightTail;
+    for (int i = 0; i < inflightCount; i++) {
+        inflightRead(pos, &e, sizeof(e));
+        if (e.id == id && !e.acked && !e.held) {
+            e.acked = true;
+            inflightWrite(pos, &e, sizeof(e));
+            inflightOut--;
+            inflightStats.acked++;
+            inflightTrim();
+            return;
         }
-        sprintf(iot_server, "%s.messaging.internetofthings.ibmcloud.com", (const char*)cfg["org"]);
-        wifiClientSecure.setCACert(ca.c_str());
-        client.setClient(wifiClientSecure);
-        mqttPort = 8883;
-    } else {
-        const char* devType = (const char*)cfg["devType"];
-        const char* devId = (const char*)cfg["devId"];
-        toGatewayTopic(publishTopic, devType, devId);
-        toGatewayTopic(infoTopic, devType, devId);
-        toGatewayTopic(commandTopic, devType, devId);
-        toGatewayTopic(responseTopic, devType, devId);
-        toGatewayTopic(manageTopic, devType, devId);
-        toGatewayTopic(updateTopic, devType, devId);
-        toGatewayTopic(rebootTopic, devType, devId);
-        toGatewayTopic(resetTopic, devType, devId);
-        client.setClient(wifiClient);
-        mqttPort = 1883;
+        pos += sizeof(e) + e.frameLen;
     }
 }
 
-void iot_connect() {
-    while (!client.connected()) {
-        int mqConnected;
-        if (mqttPort == 8883) {
-            sprintf(msgBuffer,"d:%s:%s:%s", (const char*)cfg["org"], (const char*)cfg["devType"], (const char*)cfg["devId"]);
-            mqConnected = client.connect(msgBuffer,"use-token-auth",cfg["token"]);
-        } else {
-            sprintf(msgBuffer,"d:%s:%s", (const char*)cfg["devType"], (const char*)cfg["devId"]);
-            mqConnected = client.connect(msgBuffer);
-        }
-        if (mqConnected) {
-            Serial.println("MQ connected");
-        } else {
-            if(WiFi.status() == WL_CONNECTED) {
-                if(client.state() == -2) {
-                    if (mqttPort == 8883) {
-                        wifiClientSecure.connect(iot_server, mqttPort);
-                    } else {
-                        wifiClient.connect(iot_server, mqttPort);
-                    }
-                    Serial.println("socket reconnection");
-                } else {
-                    Serial.printf("MQ Connection fail RC = %d, try again in 5 seconds\n", client.state());
-                }
-                delay(5000);
-            } else {
-                Serial.println("Reconnecting to WiFi");
-                WiFi.disconnect();
-                WiFi.begin();
-                while (WiFi.status() != WL_CONNECTED) {
-                    Serial.print("*");
-                    delay(5000);
-                }
-            }
-        }
+// writes the frame of the entry at pos, which may wrap around the buffer
+bool inflightSend(uint32_t pos, InflightEntry* e, bool dup) {
+    uint32_t frame = (pos + sizeof(*e)) % IOT_INFLIGHT_BYTES;
+    if (dup) inflightBuffer[frame] |= 0x08;
+    if (e->held) {
+        e->held = false;
+        inflightHeld--;
+        inflightOut++;
     }
-    if (!subscribeTopic(responseTopic)) return;
-    if (!subscribeTopic(rebootTopic)) return;
-    if (!subscribeTopic(resetTopic)) return;
-    if (!subscribeTopic(updateTopic)) return;
-    if (!subscribeTopic(commandTopic)) return;
-    JsonObject meta = cfg["meta"];
-    StaticJsonDocument<512> root;
-    JsonObject d = root.createNestedObject("d");
-    JsonObject metadata = d.createNestedObject("metadata");
-    for (JsonObject::iterator it=meta.begin(); it!=meta.end(); ++it) {
-        metadata[it->key().c_str()] = it->value();
-    }
-    JsonObject supports = d.createNestedObject("supports");
-    supports["deviceActions"] = true;
-    serializeJson(root, msgBuffer);
-    Serial.printf("publishing device metadata: %s\n", msgBuffer);
-    if (client.publish(manageTopic, msgBuffer)) {
-        serializeJson(d, msgBuffer);
-        String info = String("{\"info\":") + String(msgBuffer) + String("}");
-        client.publish(infoTopic, info.c_str());
+    size_t first = min((size_t)e->frameLen, (size_t)(IOT_INFLIGHT_BYTES - frame));
+    bool sent = client.write((uint8_t*)inflightBuffer + frame, first) == first &&
+                client.write((uint8_t*)inflightBuffer, e->frameLen - first) == e->frameLen - first;
+    e->sentAt = millis();
+    e->conn = inflightConn;
+    inflightWrite(pos, e, sizeof(*e));
+    iotMetrics.pubAttempted++;
+    if (sent) {
+        iotMetrics.bytesOut += e->frameLen;
+    } else {
+        iotMetrics.pubFailed++;
     }
+    return sent;
 }
 
-void publishError(char *msg) {
-    String payload = "{\"info\":{\"error\":";
-    payload += "\"" + String(msg) + "\"}}";
-    client.publish(infoTopic, (char*) payload.c_str());
-    Serial.println(payload);
-}
+bool inflightResending();
 
-String ip_resolve(String name){
-    IPAddress ipaddr = IPAddress();
-    if(!ipaddr.fromString(name)) {
-        mdns_init ();
-        name.replace(".local\0", "");
-        ipaddr = MDNS.queryHost(name, 5000);      // 5000 ms
+// publishes at QoS 1, or holds the frame past the window, false when
+// inflightBuffer has no room for it
+bool inflightPublish(const char* topic, const char* payload, unsigned int len) {
+    size_t topicLen = strlen(topic);
+    uint32_t remaining = 2 + topicLen + 2 + len;
+    uint8_t header[9];
+    size_t hlen = 1;
+    header[0] = 0x32;                               // PUBLISH at QoS 1
+    do {
+        header[hlen] = remaining % 128;
+        remaining /= 128;
+        if (remaining) header[hlen] |= 0x80;
+        hlen++;
+    } while (remaining);
+    InflightEntry e = { 0, 0, 0, (uint16_t)(hlen + 2 + topicLen + 2 + len), 0, false, true };
+    size_t n = sizeof(e) + e.frameLen;
+    if (n > IOT_INFLIGHT_BYTES / 2) {               // never fits, sent untracked
+        inflightStats.qos0++;
+        return iotClientPublish(topic, payload, len);
     }
-    return ipaddr.toString();
+    if (inflightHead - inflightTail + n > IOT_INFLIGHT_BYTES) {
+        return false;
+    }
+    // the ids of PubSubClient for its SUBSCRIBEs count from 1, these from 0x8000
+    e.id = 0x8000 | inflightNextId++;
+    header[hlen++] = topicLen >> 8;
+    header[hlen++] = topicLen & 0xFF;
+    uint8_t id[2] = { (uint8_t)(e.id >> 8), (uint8_t)(e.id & 0xFF) };
+    uint32_t pos = inflightHead;
+    uint32_t p = pos + sizeof(e);
+    inflightWrite(p, header, hlen);
+    inflightWrite(p += hlen, topic, topicLen);
+    inflightWrite(p += topicLen, id, 2);
+    inflightWrite(p + 2, payload, len);
+    inflightWrite(pos, &e, sizeof(e));
+    inflightHead += n;
+    inflightCount++;
+    inflightHeld++;
+    if (inflightHeld == 1 && inflightOut < IOT_INFLIGHT_WINDOW && !inflightResending()) {
+        inflightSend(pos, &e, false);               // a failed write is retried from the window
+    }
+    return true;
 }
 
-void handleIOTCommand(char* topic, JsonDocument* root) {
-    JsonObject d = (*root)["d"];
-
-    if (strstr(topic, "/response")) {
-        return;                                 // just print of response for now
-    } else if (strstr(topic, "/device/reboot")) {   // rebooting
-        reboot();
-    } else if (strstr(topic, "/device/factory_reset")) {    // clear the configuration and reboot
-        reset_config();
-        ESP.restart();
-    } else if (strstr(topic, "/device/update")) {
-        JsonArray fields = d["fields"];
-        for(JsonArray::iterator it=fields.begin(); it!=fields.end(); ++it) {
-            DynamicJsonDocument field = *it;
-            const char* fieldName = field["field"];
-            if (strstr(fieldName, "metadata")) {
-                JsonObject fieldValue = field["value"];
-                cfg.remove("meta");
-                JsonObject meta = cfg.createNestedObject("meta");
-                for (JsonObject::iterator fv=fieldValue.begin(); fv!=fieldValue.end(); ++fv) {
-                    meta[(char*)fv->key().c_str()] = fv->value();
-                }
-                save_config_json();
-            }
-        }
-        pubInterval = cfg["meta"]["pubInterval"];
-    } else if (strstr(topic, "/cmd/")) {
-        if (d.containsKey("upgrade")) {
-            JsonObject upgrade = d["upgrade"];
-            String response = "{\"OTA\":{\"status\":";
-            if(upgrade.containsKey("server") && 
-                        upgrade.containsKey("port") && 
-                        upgrade.containsKey("uri")) {
-                WiFiClient cli;
-                HTTPUpdate httpUpdate;
-		        Serial.println("firmware upgrading");
+// the frames of an earlier connection are written again before anything else
+bool inflightResending() {
+    InflightEntry e;
+    uint32_t pos = inflightTail;
+    for (int i = 0; i < inflightCount; i++) {
+        inflightRead(pos, &e, sizeof(e));
+        if (e.held) break;
+        if (!e.acked && e.conn != inflightConn) return true;
+        pos += sizeof(e) + e.frameLen;
+    }
+    return false;
+}
 
-	            String ota_server = upgrade["server"];
-	            char fw_server[20];
-	            sprintf(fw_server, ip_resolve(ota_server).c_str());
-	            int fw_server_port = atoi(upgrade["port"]);
-	            const char *fw_uri = upgrade["uri"];
-                client.publish(infoTopic,"{\"info\":{\"upgrade\":\"Device will be upgraded.\"}}" );
-                t_httpUpdate_return ret = httpUpdate.update(cli, fw_server, fw_server_port, fw_uri);
-	            switch(ret) {
-		            case HTTP_UPDATE_FAILED:
-                        response += "\"[update] Update failed. http://" + String(fw_server);
-                        response += ":"+ String(fw_server_port) + String(fw_uri) +"\"}}";
-                        client.publish(infoTopic, (char*) response.c_str());
-                        Serial.println(response);
-		                break;
-		            case HTTP_UPDATE_NO_UPDATES:
-                        response += "\"[update] Update no Update.\"}}";
-                        client.publish(infoTopic, (char*) response.c_str());
-                        Serial.println(response);
-		                break;
-		            case HTTP_UPDATE_OK:
-		                Serial.println("[update] Update ok."); // may not called we reboot the ESP
-		                break;
-	            }
+// writes again the frames of a lost connection and those without a PUBACK in
+// time, then the held frames the window has room for
+void inflightPoll() {
+    InflightEntry e;
+    uint32_t pos = inflightTail;
+    for (int i = 0; i < inflightCount; i++) {
+        inflightRead(pos, &e, sizeof(e));
+        if (e.held) {
+            if (inflightOut >= IOT_INFLIGHT_WINDOW) break;
+            inflightSend(pos, &e, false);
+        } else if (!e.acked && e.conn != inflightConn) {
+            inflightSend(pos, &e, true);
+            inflightStats.resent++;
+        } else if (!e.acked && millis() - e.sentAt >= IOT_INFLIGHT_TIMEOUT) {
+            if (e.retries >= IOT_INFLIGHT_RETRIES) {
+                e.acked = true;                     // given up, trimmed like an acknowledged one
+                inflightWrite(pos, &e, sizeof(e));
+                inflightOut--;
+                inflightStats.failed++;
             } else {
-                response += "\"OTA Information Error\"}}";
-                client.publish(infoTopic, (char*) response.c_str());
-                Serial.println(response);
+                e.retries++;
+                inflightSend(pos, &e, true);
+                inflightStats.resent++;
             }
-        } else if (d.containsKey("config")) {
-            char maskBuffer[JSON_BUFFER_LENGTH];
-            cfg["compile_date"] = compile_date;
-            maskConfig(maskBuffer);
-            cfg.remove("compile_date");
-            String info = String("{\"config\":") + String(maskBuffer) + String("}");
-            client.publish(infoTopic, info.c_str());
         }
+        pos += sizeof(e) + e.frameLen;
     }
+    inflightTrim();
 }
 
-void set_iot_server() {
+// the frames not acknowledged yet, the held ones included
+unsigned inflightPending() {
+    return inflightCount;
+}
 
-    if(mqttPort == 8883) {
-        if (!wifiClientSecure.connect(iot_server, mqttPort)) {
-            Serial.println("ssl connection failed");
-            return;
-        }
-    } else {
-        String broker = (const char*)cfg["org"];
-        String ip = ip_resolve(broker);
-        sprintf(iot_server, "%s", ip.c_str());
+/*
+ * PUBACK Reader
+ *      Stands between PubSubClient and the socket, and follows the MQTT
+ *      frames in the bytes PubSubClient reads, to hand the packet id of
+ *      each PUBACK to inflightAck(). PubSubClient still reads and handles
+ *      every packet itself.
+ */
+class IOTAckClient : public Client {
+public:
+    Client*         inner;
 
-        if (!wifiClient.connect(iot_server, mqttPort)) {
-            Serial.println("connection failed");
-            return;
-        }
+    IOTAckClient() : inner(NULL) { reset(); }
+
+    // before a new MQTT connection on the socket
+    void reset() {
+        phase = 0;
+        remaining = 0;
+        shift = 0;
+        bodyPos = 0;
+    }
+
+    int connect(IPAddress ip, uint16_t port) { reset(); return inner->connect(ip, port); }
+    int connect(const char* host, uint16_t port) { reset(); return inner->connect(host, port); }
+    size_t write(uint8_t b) { return inner->write(b); }
+    size_t write(const uint8_t* buf, size_t size) { return inner->write(buf, size); }
+    int available() { return inner->available(); }
+    int peek() { return inner->peek(); }
+    void flush() { inner->flush(); }
+    void stop() { reset(); inner->stop(); }
+    uint8_t connected() { return inner->connected(); }
+    operator bool() { return inner && (bool)*inner; }
+
+    int read() {
+        int b = inner->read();
+        if (b >= 0) feed(b);
+        return b;
     }
 
+    int read(uint8_t* buf, size_t size) {
+        int n = inner->read(buf, size);
+        for (int i = 0; i < n; i++) feed(buf[i]);
+        return n;
+    }
+
+private:
+    uint8_t         phase;                          // 0 fixed header, 1 length, 2 body
+    uint8_t         type;
+    uint32_t        remaining;
+    uint8_t         shift;
+    uint32_t        bodyPos;
+    uint8_t         body[2];
+
+    void feed(uint8_t b) {
+        if (phase == 0) {
+            type = b & 0xF0;
+            remaining = 0;
+            shift = 0;
+            phase = 1;
+        } else if (phase == 1) {
+            remaining |= (uint32_t)(b & 0x7F) << shift;
+            shift += 7;
+            if (!(b & 0x80)) {
+                bodyPos = 0;
+                phase = remaining ? 2 : 0;
+            }
+        } else {
+            if (bodyPos < 2) body[bodyPos] = b;
+            if (++bodyPos == remaining) {
+                if (type == 0x40 && remaining == 2) {
+                    inflightAck(body[0] << 8 | body[1]);
+                }
+                phase = 0;
+            }
+        }
+    }
+};
+
+IOTAckClient        iotAckClient;
+
+void pubqInit() {
+    File f = SPIFFS.open(pubqFile, "r");
+    if (!f || f.size() != IOT_PUBQ_SLOTS * IOT_PUBQ_SLOT_SIZE) {
+        if (f) f.close();
+        f = SPIFFS.open(pubqFile, "w");
+        memset(pubqBuffer, 0, sizeof(pubqBuffer));
+        for (int i = 0; i < IOT_PUBQ_SLOTS; i++) {
+            f.write((uint8_t*)pubqBuffer, IOT_PUBQ_SLOT_SIZE);
+        }
+        f.close();
+        pubqHead = pubqTail = 1;
+        return;
+    }
+    uint32_t lo = 0, hi = 0;
+    PubqSlot slot;
+    for (int i = 0; i < IOT_PUBQ_SLOTS; i++) {
+        f.seek(i * IOT_PUBQ_SLOT_SIZE);
+        if (f.read((uint8_t*)&slot, sizeof(slot)) != sizeof(slot) || slot.seq == 0) continue;
+        if (lo == 0 || slot.seq < lo) lo = slot.seq;
+        if (slot.seq > hi) hi = slot.seq;
+    }
+    f.close();
+    pubqTail = lo ? lo : 1;
+    pubqHead = lo ? hi + 1 : 1;
+}
+
+bool pubqEnqueue(const char* topic, const char* payload, unsigned int len) {
+    PubqSlot slot;
+    slot.topicLen = strlen(topic);
+    slot.payloadLen = len;
+    if (sizeof(slot) + slot.topicLen + len > IOT_PUBQ_SLOT_SIZE) {
+        pubqStats.dropped++;
+        return false;
+    }
+    if (pubqHead - pubqTail >= IOT_PUBQ_SLOTS) {
+        pubqTail++;                                 // overwrite the oldest
+        pubqStats.dropped++;
+    }
+    File f = SPIFFS.open(pubqFile, "r+");
+    if (!f) {
+        pubqStats.dropped++;
+        return false;
+    }
+    slot.seq = pubqHead;
+    f.seek((slot.seq % IOT_PUBQ_SLOTS) * IOT_PUBQ_SLOT_SIZE);
+    f.write((uint8_t*)&slot, sizeof(slot));
+    f.write((uint8_t*)topic, slot.topicLen);
+    f.write((uint8_t*)payload, len);
+    f.close();
+    pubqHead++;
+    pubqStats.queued++;
+    return true;
+}
+
+unsigned pubqPending() {
+    return pubqHead - pubqTail;
+}
+
+// moves up to max stored messages into the in-flight window, behind the
+// frames of the earlier connection, which are written again first
+void pubqMove(int max) {
+    File f = SPIFFS.open(pubqFile, "r+");
+    if (!f) return;
+    PubqSlot slot;
+    for (int n = 0; n < max && pubqTail != pubqHead; n++) {
+        uint32_t pos = (pubqTail % IOT_PUBQ_SLOTS) * IOT_PUBQ_SLOT_SIZE;
+        f.seek(pos);
+        if (f.read((uint8_t*)&slot, sizeof(slot)) != sizeof(slot) || slot.seq != pubqTail) {
+            pubqTail++;                             // lost or overwritten slot
+            continue;
+        }
+        f.read((uint8_t*)pubqBuffer, slot.topicLen + slot.payloadLen);
+        char* topic = pubqBuffer;
+        char* payload = pubqBuffer + slot.topicLen + 1;
+        memmove(payload, pubqBuffer + slot.topicLen, slot.payloadLen);
+        topic[slot.topicLen] = '\0';
+        if (!inflightPublish(topic, payload, slot.payloadLen)) {
+            if (inflightCount) break;               // inflightBuffer is full, wait for the PUBACKs
+            if (!client.connected()) break;         // try again on next drain
+            pubqStats.dropped++;                    // would block the queue forever
+        } else {
+            pubqStats.replayed++;
+        }
+        slot.seq = 0;
+        f.seek(pos);
+        f.write((uint8_t*)&slot, sizeof(slot));
+        pubqTail++;
+    }
+    f.close();
+}
+
+void pubqDrain() {
+    if (!client.connected()) return;
+    inflightPoll();
+    if (pubqHead == pubqTail || millis() - pubqLastDrain < IOT_PUBQ_DRAIN_INTERVAL) {
+        return;
+    }
+    pubqLastDrain = millis();
+    pubqMove(IOT_PUBQ_BATCH);
+}
+
+// publishes from the task which owns the client, false when the message is
+// refused: too large, the queue failed, or inflightBuffer is full while the
+// broker is connected, when it is to be published again later
+bool iotPublishNow(const char* topic, const char* payload, unsigned int len) {
+    if (!iotClientFits(topic, len)) {
+        pubqStats.rejected++;
+        return false;
+    }
+    if (!client.connected()) {
+        return pubqEnqueue(topic, payload, len);    // stored only while offline
+    }
+    if (pubqHead != pubqTail) {
+        pubqMove(IOT_PUBQ_SLOTS);                   // the stored messages go first
+    }
+    if (pubqHead == pubqTail && inflightPublish(topic, payload, len)) {
+        return true;
+    }
+    inflightStats.full++;
+    return false;
+}
+
+#ifdef IOT_NET_TASK
+/*
+ * Network Task
+ *      With IOT_NET_TASK defined, startIOTNetTask() moves the connection,
+ *      client.loop() and the publishing onto a task pinned to IOT_NET_CORE.
+ *      The application hands the messages over through txRing and gets the
+ *      commands back through rxRing in iotLoop(). Each ring has one producer
+ *      and one consumer which only write their own index, so neither side
+ *      ever waits for the other.
+ */
+#ifndef IOT_RING_SLOTS
+#define             IOT_RING_SLOTS          8
+#endif
+#ifndef IOT_RING_SLOT_SIZE
+#ifdef IOT_MQTT_BUFFER_SIZE
+#define             IOT_RING_SLOT_SIZE      (IOT_MQTT_BUFFER_SIZE + 2)   // a whole message each way
+#else
+#define             IOT_RING_SLOT_SIZE      IOT_PUBQ_SLOT_SIZE
+#endif
+#endif
+#ifndef IOT_NET_CORE
+#define             IOT_NET_CORE            0
+#endif
+#ifndef IOT_NET_STACK
+#define             IOT_NET_STACK           8192
+#endif
+
+struct IOTRing {
+    volatile uint32_t head;                 // written by the producer only
+    volatile uint32_t tail;                 // written by the consumer only
+    uint16_t        topicLen[IOT_RING_SLOTS];
+    uint16_t        payloadLen[IOT_RING_SLOTS];
+    char            data[IOT_RING_SLOTS][IOT_RING_SLOT_SIZE];   // topic\0payload\0
+};
+
+struct NetStats {
+    unsigned long   txDropped;
+    unsigned long   rxDropped;
+};
+
+IOTRing             txRing;
+IOTRing             rxRing;
+NetStats            netStats = {0, 0};
+TaskHandle_t        iotNetTaskHandle = NULL;
+
+bool ringPush(IOTRing* r, const char* topic, const char* payload, unsigned int len) {
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t topicLen = strlen(topic);
+    if (head - tail == IOT_RING_SLOTS || topicLen + len + 2 > IOT_RING_SLOT_SIZE) {
+        return false;
+    }
+    uint32_t i = head % IOT_RING_SLOTS;
+    memcpy(r->data[i], topic, topicLen + 1);
+    memcpy(r->data[i] + topicLen + 1, payload, len);
+    r->data[i][topicLen + 1 + len] = '\0';
+    r->topicLen[i] = topicLen;
+    r->payloadLen[i] = len;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// returns the topic of the oldest message, which stays valid until ringPop()
+char* ringPeek(IOTRing* r, char** payload, unsigned int* len) {
+    uint32_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    uint32_t i = tail % IOT_RING_SLOTS;
+    *payload = r->data[i] + r->topicLen[i] + 1;
+    *len = r->payloadLen[i];
+    return r->data[i];
+}
+
+void ringPop(IOTRing* r) {
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+bool iotPublish(const char* topic, const char* payload, unsigned int len) {
+#ifdef IOT_NET_TASK
+    if (iotNetTaskHandle) {
+        if (ringPush(&txRing, topic, payload, len)) return true;
+        netStats.txDropped++;
+        return false;
+    }
+#endif
+    return iotPublishNow(topic, payload, len);
+}
+
+bool iotPublish(const char* topic, const char* payload) {
+    return iotPublish(topic, payload, strlen(payload));
+}
+
+// serializes root in the format of the topic, json or msgpack
+size_t iotSerialize(const char* topic, JsonVariantConst root, char* buff, size_t size) {
+    if (isMsgPackTopic(topic)) {
+        return serializeMsgPack(root, buff, size);
+    }
+    return serializeJson(root, buff, size);
+}
+
+bool iotPublishDoc(const char* topic, JsonVariantConst root) {
+    size_t len = iotSerialize(topic, root, msgBuffer, sizeof(msgBuffer));
+    return iotPublish(topic, msgBuffer, len);
+}
+
+/*
+ * Streaming Publish
+ *      iotPublishStream(topic, root) is for the documents too large for
+ *      msgBuffer or the PubSubClient buffer, an IR code sequence or a config
+ *      dump. It measures the document, then serializes it straight into the
+ *      connection between beginPublish() and endPublish(), through IOTStream
+ *      which hands the bytes to the client IOT_STREAM_CHUNK at a time. The
+ *      small documents take the iotPublishDoc() path. A streamed message is
+ *      neither queued nor kept in the in-flight window, so it needs the
+ *      connection, and with IOT_NET_TASK it cannot be streamed at all.
+ */
+#ifndef IOT_STREAM_CHUNK
+#define             IOT_STREAM_CHUNK        128
+#endif
+
+struct IOTStream : Print {
+    uint8_t         buff[IOT_STREAM_CHUNK];
+    size_t          len;
+    bool            failed;
+
+    IOTStream() : len(0), failed(false) {}
+    size_t write(uint8_t c) {
+        buff[len++] = c;
+        if (len == sizeof(buff)) flush();
+        return 1;
+    }
+    size_t write(const uint8_t* b, size_t n) {
+        for (size_t i = 0; i < n; i++) write(b[i]);
+        return n;
+    }
+    void flush() {
+        if (len && client.write(buff, len) != len) failed = true;
+        len = 0;
+    }
+};
+
+bool iotPublishStream(const char* topic, JsonVariantConst root) {
+    bool msgpack = isMsgPackTopic(topic);
+    size_t len = msgpack ? measureMsgPack(root) : measureJson(root);
+    if (len < sizeof(msgBuffer) && len + strlen(topic) + 8 <= MQTT_MAX_PACKET_SIZE) {
+        return iotPublishDoc(topic, root);
+    }
+    iotMetrics.pubAttempted++;
+#ifdef IOT_NET_TASK
+    if (iotNetTaskHandle) {
+        iotMetrics.pubFailed++;
+        return false;
+    }
+#endif
+    if (!client.connected() || !client.beginPublish(topic, len, false)) {
+        iotMetrics.pubFailed++;
+        return false;
+    }
+    IOTStream out;
+    if (msgpack) {
+        serializeMsgPack(root, out);
+    } else {
+        serializeJson(root, out);
+    }
+    out.flush();
+    if (!client.endPublish() || out.failed) {
+        iotMetrics.pubFailed++;
+        return false;
+    }
+    iotMetrics.bytesOut += len;
+    return true;
+}
+
+/*
+ * Batched Telemetry
+ *      iotBatchSample() returns a new sample object stamped with millis() in
+ *      "t", and the samples are published together on publishTopic as
+ *          {"d":[{...,"t":1200},{...,"t":2200}],"t":2300}
+ *      when the next one would not fit in IOT_BATCH_BYTES or the oldest one
+ *      is IOT_BATCH_LATENCY ms old. The top level "t" is the millis() of the
+ *      flush, so the receiver can tell the age of each sample.
+ */
+#ifndef IOT_BATCH_BYTES
+#define             IOT_BATCH_BYTES         (MQTT_MAX_PACKET_SIZE - 64)     // room for the header and the topic
+#endif
+#ifndef IOT_BATCH_LATENCY
+#define             IOT_BATCH_LATENCY       5000
+#endif
+#ifndef IOT_BATCH_JSON_SIZE
+#define             IOT_BATCH_JSON_SIZE     1024
+#endif
+
+struct BatchStats {
+    unsigned long   samples;
+    unsigned long   messages;
+    unsigned long   bytes;
+    unsigned long   since;                  // millis() of the first sample
+};
+
+StaticJsonDocument<IOT_BATCH_JSON_SIZE> batchDoc;
+JsonArray           batchSamples;
+unsigned long       batchOpenedAt = 0;
+BatchStats          batchStats = {0, 0, 0, 0};
+
+size_t batchBudget() {
+    return min((size_t)IOT_BATCH_BYTES, sizeof(msgBuffer) - 1);
+}
+
+// publishes the first count samples
+void batchPublish(size_t count) {
+    size_t len;
+    if (isMsgPackTopic(publishTopic)) {
+        uint8_t* b = (uint8_t*)msgBuffer;
+        b[0] = 0x82;                        // map of d and t
+        b[1] = 0xa1; b[2] = 'd';
+        b[3] = 0xdc; b[4] = count >> 8; b[5] = count;
+        len = 6;
+        for (size_t i = 0; i < count; i++) {
+            len += serializeMsgPack(batchSamples[i], msgBuffer + len, sizeof(msgBuffer) - len);
+        }
+        uint32_t t = millis();
+        uint8_t tail[] = { 0xa1, 't', 0xce, (uint8_t)(t >> 24), (uint8_t)(t >> 16), (uint8_t)(t >> 8), (uint8_t)t };
+        if (len + sizeof(tail) <= sizeof(msgBuffer)) {
+            memcpy(msgBuffer + len, tail, sizeof(tail));
+            len += sizeof(tail);
+        }
+    } else {
+        len = snprintf(msgBuffer, sizeof(msgBuffer), "{\"d\":[");
+        for (size_t i = 0; i < count; i++) {
+            if (i) msgBuffer[len++] = ',';
+            len += serializeJson(batchSamples[i], msgBuffer + len, sizeof(msgBuffer) - len);
+        }
+        len += snprintf(msgBuffer + len, sizeof(msgBuffer) - len, "],\"t\":%lu}", millis());
+    }
+    iotPublish(publishTopic, msgBuffer, len);
+    batchStats.messages++;
+    batchStats.bytes += len;
+}
+
+void iotBatchFlush() {
+    size_t count = batchSamples.isNull() ? 0 : batchSamples.size();
+    if (count == 0) return;
+    if (count > 1 && measureJson(batchDoc) + 24 > batchBudget()) {
+        // the last sample went over the budget, it opens the next batch
+        batchPublish(count - 1);
+        StaticJsonDocument<IOT_BATCH_JSON_SIZE / 2> last;
+        last.set(batchSamples[count - 1]);
+        batchDoc.clear();
+        batchSamples = batchDoc.createNestedArray("d");
+        batchSamples.add(last.as<JsonObject>());
+        batchOpenedAt = last["t"];
+        return;
+    }
+    batchPublish(count);
+    batchDoc.clear();
+    batchSamples = JsonArray();
+}
+
+JsonObject iotBatchSample() {
+    size_t count = batchSamples.isNull() ? 0 : batchSamples.size();
+    if (count) {
+        size_t lastBytes = measureJson(batchSamples[count - 1]);
+        size_t lastMemory = batchDoc.memoryUsage() / count;
+        if (measureJson(batchDoc) + lastBytes + 24 > batchBudget() ||
+                    batchDoc.capacity() - batchDoc.memoryUsage() < 2 * lastMemory) {
+            iotBatchFlush();
+        }
+    }
+    if (batchSamples.isNull()) {
+        batchSamples = batchDoc.createNestedArray("d");
+        batchOpenedAt = millis();
+    }
+    if (batchStats.samples++ == 0) {
+        batchStats.since = millis();
+    }
+    JsonObject sample = batchSamples.createNestedObject();
+    sample["t"] = millis();
+    return sample;
+}
+
+void iotBatchPoll() {
+    if (!batchSamples.isNull() && batchSamples.size() &&
+                (millis() - batchOpenedAt >= IOT_BATCH_LATENCY ||
+                 measureJson(batchDoc) + 24 > batchBudget())) {
+        iotBatchFlush();
+    }
+}
+
+float iotBatchMessagesPerSec() {
+    unsigned long elapsed = millis() - batchStats.since;
+    return elapsed ? batchStats.messages * 1000.0 / elapsed : 0;
+}
+
+float iotBatchBytesPerSample() {
+    return batchStats.samples ? (float)batchStats.bytes / batchStats.samples : 0;
+}
+
+/*
+ * Report by Exception
+ *      iotPublishChanged(topic, root) publishes a status document only when
+ *      a field of its "d" moved past its deadband since the last published
+ *      document, or when maxSilence ms went by without one. The deadbands
+ *      are read from the metadata at initDevice() and on /device/update:
+ *      "db.<field>": 0.5 for an absolute one or "2%" for a part of the last
+ *      published value. A field without a deadband, or which is not a
+ *      number, counts on any change.
+ */
+#ifndef IOT_RBE_FIELDS
+#define             IOT_RBE_FIELDS          16
+#endif
+#ifndef IOT_RBE_MAX_SILENCE
+#define             IOT_RBE_MAX_SILENCE     900000  // ms, unless meta.maxSilence
+#endif
+#define             IOT_RBE_NAME_LENGTH     24
+
+struct RbeField {
+    char            name[IOT_RBE_NAME_LENGTH];
+    float           band;
+    bool            percent;
+    bool            seen;
+    float           last;                   // the published number
+    uint32_t        hash;                   // or the hash of the published value
+};
+
+struct RbeStats {
+    unsigned long   sent;
+    unsigned long   suppressed;
+};
+
+// FNV-1a of what is printed on it, to compare the values which are not numbers
+struct RbeHash : Print {
+    uint32_t        h;
+    RbeHash() : h(2166136261UL) {}
+    size_t write(uint8_t c) {
+        h = (h ^ c) * 16777619UL;
+        return 1;
+    }
+    size_t write(const uint8_t* b, size_t n) {
+        for (size_t i = 0; i < n; i++) write(b[i]);
+        return n;
+    }
+};
+
+RbeField            rbeFields[IOT_RBE_FIELDS];
+int                 rbeFieldCount = 0;
+unsigned long       rbeMaxSilence = IOT_RBE_MAX_SILENCE;
+unsigned long       rbeSentAt = 0;
+bool                rbeStarted = false;
+RbeStats            rbeStats = {0, 0};
+
+RbeField* rbeField(const char* name) {
+    for (int i = 0; i < rbeFieldCount; i++) {
+        if (!strcmp(rbeFields[i].name, name)) return &rbeFields[i];
+    }
+    if (rbeFieldCount == IOT_RBE_FIELDS || strlen(name) >= IOT_RBE_NAME_LENGTH) return NULL;
+    RbeField* f = &rbeFields[rbeFieldCount++];
+    memset(f, 0, sizeof(RbeField));
+    strcpy(f->name, name);
+    return f;
+}
+
+// the deadbands of cfg["meta"], the next document is published in full
+void rbeLoad() {
+    JsonObject meta = cfg["meta"];
+    rbeFieldCount = 0;
+    rbeStarted = false;
+    rbeMaxSilence = meta["maxSilence"] | (unsigned long)IOT_RBE_MAX_SILENCE;
+    for (JsonObject::iterator it = meta.begin(); it != meta.end(); ++it) {
+        const char* key = it->key().c_str();
+        if (strncmp(key, "db.", 3)) continue;
+        RbeField* f = rbeField(key + 3);
+        if (!f) continue;
+        const char* text = it->value().as<const char*>();
+        f->band = text ? atof(text) : it->value().as<float>();
+        f->percent = text && strchr(text, '%');
+    }
+}
+
+bool rbeChanged(RbeField* f, JsonVariantConst v, float* number, uint32_t* hash) {
+    if (v.is<float>()) {
+        *number = v.as<float>();
+        float band = f->percent ? fabs(f->last) * f->band / 100 : f->band;
+        return !f->seen || fabs(*number - f->last) > band;
+    }
+    RbeHash h;
+    serializeJson(v, h);
+    *hash = h.h;
+    return !f->seen || *hash != f->hash;
+}
+
+bool iotPublishChanged(const char* topic, JsonDocument& root) {
+    JsonObject d = root["d"];
+    bool changed = !rbeStarted || millis() - rbeSentAt >= rbeMaxSilence;
+    float number;
+    uint32_t hash;
+    for (JsonObject::iterator it = d.begin(); it != d.end() && !changed; ++it) {
+        RbeField* f = rbeField(it->key().c_str());
+        changed = !f || rbeChanged(f, it->value(), &number, &hash);
+    }
+    if (!changed) {
+        rbeStats.suppressed++;
+        return false;
+    }
+    for (JsonObject::iterator it = d.begin(); it != d.end(); ++it) {
+        RbeField* f = rbeField(it->key().c_str());
+        if (!f) continue;
+        number = 0;
+        hash = 0;
+        rbeChanged(f, it->value(), &number, &hash);
+        f->last = number;
+        f->hash = hash;
+        f->seen = true;
+    }
+    rbeStarted = true;
+    rbeSentAt = millis();
+    rbeStats.sent++;
+    return iotPublishDoc(topic, root);
+}
+
+float iotSuppressionRatio() {
+    unsigned long total = rbeStats.sent + rbeStats.suppressed;
+    return total ? (float)rbeStats.suppressed / total : 0;
+}
+
+size_t histJson(char* buff, size_t size, const char* name, IOTHist* h) {
+    if (h->count == 0) return 0;
+    int last = IOT_HIST_BUCKETS - 1;
+    while (h->bucket[last] == 0) last--;
+    size_t len = snprintf(buff, size, ",\"%s\":{\"n\":%lu,\"avg\":%lu,\"max\":%lu,\"b\":[",
+                name, h->count, (unsigned long)(h->sum / h->count), h->max);
+    for (int i = 0; i <= last && len < size; i++) {
+        len += snprintf(buff + len, size - len, i ? ",%lu" : "%lu", h->bucket[i]);
+    }
+    if (len < size) len += snprintf(buff + len, size - len, "]}");
+    return min(len, size - 1);
+}
+
+void iotMetricsPublish() {
+    const char* phases[IOT_METRIC_PHASES] = { "wifi", "socket", "mqtt", "subscribe", "announce" };
+    const char* kinds[IOT_METRIC_KINDS] = { "other", "response", "reboot", "factory_reset", "update", "command" };
+    iotMetrics.heapLow = ESP.getMinFreeHeap();
+    iotMetrics.loopStackLow = uxTaskGetStackHighWaterMark(NULL);
+#ifdef IOT_NET_TASK
+    if (iotNetTaskHandle) iotMetrics.netStackLow = uxTaskGetStackHighWaterMark(iotNetTaskHandle);
+#endif
+    size_t size = sizeof(msgBuffer) - 2;
+    size_t len = snprintf(msgBuffer, size,
+                "{\"metrics\":{\"pub\":%lu,\"pubFail\":%lu,\"out\":%lu,\"in\":%lu,\"reconn\":%lu,"
+                "\"heapLow\":%lu,\"stackLow\":[%lu,%lu],\"queued\":%u,\"inflight\":%u,"
+                "\"resent\":%lu,\"failed\":%lu,\"rbe\":{\"sent\":%lu,\"suppressed\":%lu,\"ratio\":%.2f},"
+                "\"cfgLoad\":%lu",
+                iotMetrics.pubAttempted, iotMetrics.pubFailed, iotMetrics.bytesOut, iotMetrics.bytesIn,
+                iotMetrics.reconnects, iotMetrics.heapLow, iotMetrics.loopStackLow,
+                iotMetrics.netStackLow, pubqPending(), inflightPending(),
+                inflightStats.resent, inflightStats.failed, rbeStats.sent, rbeStats.suppressed,
+                iotSuppressionRatio(), cfgLoadMicros);
+    for (int i = 0; i < IOT_METRIC_PHASES && len < size; i++) {
+        len += histJson(msgBuffer + len, size - len, phases[i], &iotMetrics.phase[i]);
+    }
+    if (len < size) len += histJson(msgBuffer + len, size - len, "tls", &iotMetrics.tls);
+    for (int i = 0; i < IOT_METRIC_KINDS && len < size; i++) {
+        len += histJson(msgBuffer + len, size - len, kinds[i], &iotMetrics.command[i]);
+    }
+    if (len < size) len += snprintf(msgBuffer + len, size - len, ",\"jobs\":[");
+    for (int i = 0, n = 0; i < IOT_MAX_JOBS && len < size; i++) {      // [runs, overruns, max late us]
+        if (!iotJobs[i].fn) continue;
+        len += snprintf(msgBuffer + len, size - len, n++ ? ",[%lu,%lu,%lu]" : "[%lu,%lu,%lu]",
+                    iotJobs[i].late.count, iotJobs[i].overruns, iotJobs[i].late.max);
+    }
+    if (len < size) len += snprintf(msgBuffer + len, size - len, "]");
+    len = min(len, size - 1);
+    msgBuffer[len++] = '}';
+    msgBuffer[len++] = '}';
+    iotPublish(infoTopic, msgBuffer, len);
+}
+
+// the lines kept in logRing, newest first, as {"log":["I 1200 MQ connected",...]}
+void iotLogPublish() {
+    IOTWriter w(msgBuffer, sizeof(msgBuffer));
+    LogLine line;
+    uint32_t head = __atomic_load_n(&logHead, __ATOMIC_ACQUIRE);
+    char text[IOT_LOG_LINE + 16];
+    w.add("{\"log\":[");
+    for (uint32_t seq = head, n = 0; seq != head - IOT_LOG_SLOTS && seq != 0; seq--) {
+        if (!logRead(seq - 1, &line)) continue;
+        snprintf(text, sizeof(text), "%c %lu %s", logLevels[line.level], line.ms, line.text);
+        size_t len = w.len;
+        if (n++) w.add(",");
+        w.addString(text);
+        if (w.overflow || w.len + 3 > w.size) {
+            w.len = len;                    // the older lines do not fit
+            break;
+        }
+    }
+    w.add("]}");
+    iotPublish(infoTopic, w.buff, w.len);
+}
+
+// forwards the last warning, at most once per IOT_LOG_FORWARD_INTERVAL
+void iotLogPoll() {
+#ifdef IOT_LOG_FORWARD
+    static uint32_t forwarded = 0;
+    static unsigned long forwardedAt = 0;
+    uint32_t seq = __atomic_load_n(&logWarnSeq, __ATOMIC_RELAXED);
+    LogLine line;
+    if (seq == forwarded || (forwardedAt && millis() - forwardedAt < IOT_LOG_FORWARD_INTERVAL)) return;
+    forwarded = seq;
+    forwardedAt = millis();
+    if (!logRead(seq - 1, &line)) return;
+    char payload[IOT_LOG_LINE + 64];
+    IOTWriter w(payload, sizeof(payload));
+    w.addf("{\"log\":{\"level\":\"%c\",\"t\":%lu,\"msg\":", logLevels[line.level], line.ms)
+     .addString(line.text).add("}}");
+    if (!w.overflow) {
+        iotPublish(infoTopic, w.buff, w.len);
+        logStats.forwarded++;
+    }
+#endif
+}
+
+void iotInitDevice() {
+    // check Factory Reset Request and reset if requested
+    // and initialize
+
+    startIOTLogTask();
+    if(!SPIFFS.begin()) {
+        SPIFFS.format();
+    }
+    pinMode(RESET_PIN, INPUT_PULLUP);
+    if( digitalRead(RESET_PIN) == 0 ) {
+        unsigned long t1 = millis();
+        while(digitalRead(RESET_PIN) == 0) {
+            delay(500);
+            Serial.print(".");
+        }
+        if (millis() - t1 > 5000) {
+            reset_config();             // Factory Reset
+        }
+    }
+    attachInterrupt(RESET_PIN, reboot, FALLING);
+    init_cfg();
+    pubqInit();
+}
+
+void saveEnv() {
+    int args = webServer.args();
+    for (int i = 0; i < args ; i++){
+        if (webServer.argName(i).indexOf(String("meta.")) == 0 ) {
+            cfg["meta"][webServer.argName(i).substring(5)] = webServer.arg(i);
+        } else {
+            cfg[webServer.argName(i)] = webServer.arg(i);
+        }
+    }
+    cfg["config"] = "done";
+    save_config_json();
+    webServer.send(200, "text/html", postSave_html);
+}
+
+/*
+ * Setup Portal
+ *      The page is assembled once when the portal starts and sent from that
+ *      buffer, or streamed from portalFile, a gzip of the page uploaded to
+ *      SPIFFS, with Content-Encoding: gzip. Both carry an ETag, so a browser
+ *      that has the page gets 304, and the connectivity probes of the phones
+ *      get a fixed redirect instead of the page.
+ */
+char                portalFile[] = "/portal.html.gz";
+char*               portalPage = NULL;
+size_t              portalLength = 0;
+char                portalETag[12];
+const char*         portalProbes[] = {
+    "/generate_204", "/gen_204", "/hotspot-detect.html", "/library/test/success.html",
+    "/connecttest.txt", "/ncsi.txt", "/success.txt", "/canonical.html", "/redirect", "/fwlink"
+};
+
+void portalBuild() {
+    portalLength = html_begin.length() + user_html.length() + html_end.length();
+    portalPage = (char*)malloc(portalLength + 1);
+    if (portalPage) {
+        IOTWriter w(portalPage, portalLength + 1);
+        w.add(html_begin.c_str()).add(user_html.c_str()).add(html_end.c_str());
+    }
+    uint32_t hash = 2166136261u;            // FNV-1a of the page and the gzip size
+    for (size_t i = 0; portalPage && i < portalLength; i++) {
+        hash = (hash ^ (uint8_t)portalPage[i]) * 16777619u;
+    }
+    if (SPIFFS.exists(portalFile)) {
+        File f = SPIFFS.open(portalFile, "r");
+        hash = (hash ^ f.size()) * 16777619u;
+        f.close();
+    }
+    snprintf(portalETag, sizeof(portalETag), "\"%08x\"", (unsigned)hash);
+}
+
+void portalSend() {
+    if (webServer.hasHeader("If-None-Match") && webServer.header("If-None-Match") == portalETag) {
+        webServer.send(304);
+        return;
+    }
+    webServer.sendHeader("ETag", portalETag);
+    webServer.sendHeader("Cache-Control", "no-cache");
+    if (SPIFFS.exists(portalFile)) {
+        File f = SPIFFS.open(portalFile, "r");
+        webServer.streamFile(f, "text/html");
+        f.close();
+    } else if (portalPage) {
+        webServer.send_P(200, "text/html", portalPage, portalLength);
+    } else {
+        webServer.setContentLength(portalLength);
+        webServer.send(200, "text/html", "");
+        webServer.sendContent(html_begin);
+        webServer.sendContent(user_html);
+        webServer.sendContent(html_end);
+    }
+}
+
+void portalProbe() {
+    webServer.sendHeader("Location", "http://192.168.1.1/");
+    webServer.send(302, "text/plain", "");
+}
+
+void iotConfigDevice() {
+    DNSServer   dnsServer;
+    const byte  DNS_PORT = 53;
+    IPAddress   apIP(192, 168, 1, 1);
+    WiFi.mode(WIFI_AP);
+    WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
+    char ap_name[100];
+    sprintf(ap_name, "%s_%08X", ssid_pfix, (unsigned int)ESP.getEfuseMac());
+    WiFi.softAP(ap_name);
+    delay(3000);
+    dnsServer.start(DNS_PORT, "*", apIP);
+
+    portalBuild();
+    const char* headerKeys[] = { "If-None-Match" };
+    webServer.collectHeaders(headerKeys, 1);
+    webServer.on("/save", saveEnv);
+    webServer.on("/reboot", reboot);
+    for (size_t i = 0; i < sizeof(portalProbes) / sizeof(portalProbes[0]); i++) {
+        webServer.on(portalProbes[i], portalProbe);
+    }
+    webServer.onNotFound(portalSend);
+    webServer.begin();
+    IOT_LOGI("starting the config");
+    while(1) {
+        dnsServer.processNextRequest();
+        webServer.handleClient();
+        if(userConfigLoop != NULL) {
+            (*userConfigLoop)();
+        }
+        delay(2);                           // lets the idle task and the WiFi stack run
+    }
+}
+
+bool subscribeTopic(const char* topic) {
+    if (client.subscribe(topic)) {
+        IOT_LOGI("Subscription to %s OK", topic);
+        return true;
+    } else {
+        IOT_LOGW("Subscription to %s Failed", topic);
+        return false;
+    }
+}
+
+/*
+ * Topic Router
+ *      The subscribed topics are matched once at initDevice() into iotRoutes,
+ *      so a message is routed by its length and one comparison, and the
+ *      command id and format are cut out of iot-2/cmd/+/fmt/+ in one pass.
+ *          iotOn("reboot", fn);            response, reboot, factory_reset, update
+ *          iotOnCommand("<cmdId>", fn);    "+" for any command id
+ *      reboot/factory_reset handlers run before the device acts on them,
+ *      the others after the library has handled the message.
+ */
+#ifndef IOT_MAX_COMMANDS
+#define             IOT_MAX_COMMANDS        8
+#endif
+#define             IOT_CMD_ID_LENGTH       32
+#define             IOT_FMT_LENGTH          16
+
+typedef void (*IOTHandler)(const char* cmdId, JsonDocument* root);
+
+enum IOTTopicKind {
+    IOT_TOPIC_NONE,
+    IOT_TOPIC_RESPONSE,
+    IOT_TOPIC_REBOOT,
+    IOT_TOPIC_RESET,
+    IOT_TOPIC_UPDATE,
+    IOT_TOPIC_COMMAND,
+    IOT_TOPIC_KINDS
+};
+
+struct IOTRoute {
+    const char*     topic;
+    uint16_t        len;
+    uint8_t         kind;
+};
+
+struct IOTCommandRoute {
+    char            cmdId[IOT_CMD_ID_LENGTH];
+    IOTHandler      handler;
+};
+
+const char*         iotTopicNames[IOT_TOPIC_KINDS] = { "", "response", "reboot", "factory_reset", "update", "command" };
+IOTRoute            iotRoutes[4];
+uint16_t            iotCmdPrefixLen = 0;    // length of "iot-2/cmd/" or its gateway form
+IOTHandler          iotHandlers[IOT_TOPIC_KINDS];
+IOTCommandRoute     iotCommands[IOT_MAX_COMMANDS];
+int                 iotCommandCount = 0;
+
+bool iotOn(const char* name, IOTHandler handler) {
+    for (int i = IOT_TOPIC_RESPONSE; i < IOT_TOPIC_COMMAND; i++) {
+        if (!strcmp(name, iotTopicNames[i])) {
+            iotHandlers[i] = handler;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool iotOnCommand(const char* cmdId, IOTHandler handler) {
+    if (iotCommandCount == IOT_MAX_COMMANDS || strlen(cmdId) >= IOT_CMD_ID_LENGTH) {
+        return false;
+    }
+    strcpy(iotCommands[iotCommandCount].cmdId, cmdId);
+    iotCommands[iotCommandCount++].handler = handler;
+    return true;
+}
+
+void iotRouterInit() {
+    const char* topics[] = { responseTopic, rebootTopic, resetTopic, updateTopic };
+    for (int i = 0; i < 4; i++) {
+        iotRoutes[i].topic = topics[i];
+        iotRoutes[i].len = strlen(topics[i]);
+        iotRoutes[i].kind = IOT_TOPIC_RESPONSE + i;
+    }
+    iotCmdPrefixLen = strchr(commandTopic, '+') - commandTopic;
+}
+
+// returns the IOTTopicKind, and for the commands fills cmdId and fmt
+int iotMatchTopic(const char* topic, char* cmdId, char* fmt) {
+    cmdId[0] = fmt[0] = '\0';
+    if (!strncmp(topic, commandTopic, iotCmdPrefixLen)) {
+        const char* p = topic + iotCmdPrefixLen;
+        int i = 0;
+        for (; *p && *p != '/'; p++) {
+            if (i == IOT_CMD_ID_LENGTH - 1) return IOT_TOPIC_NONE;
+            cmdId[i++] = *p;
+        }
+        cmdId[i] = '\0';
+        if (i == 0 || strncmp(p, "/fmt/", 5)) return IOT_TOPIC_NONE;
+        for (p += 5, i = 0; *p; p++) {
+            if (*p == '/' || i == IOT_FMT_LENGTH - 1) return IOT_TOPIC_NONE;
+            fmt[i++] = *p;
+        }
+        fmt[i] = '\0';
+        return IOT_TOPIC_COMMAND;
+    }
+    size_t len = strlen(topic);
+    for (int i = 0; i < 4; i++) {
+        if (iotRoutes[i].len == len && !memcmp(iotRoutes[i].topic, topic, len)) {
+            return iotRoutes[i].kind;
+        }
+    }
+    return IOT_TOPIC_NONE;
+}
+
+void iotDispatchCommand(const char* cmdId, JsonDocument* root) {
+    IOTHandler wildcard = NULL;
+    for (int i = 0; i < iotCommandCount; i++) {
+        if (!strcmp(iotCommands[i].cmdId, cmdId)) {
+            iotCommands[i].handler(cmdId, root);
+            return;
+        } else if (!strcmp(iotCommands[i].cmdId, "+")) {
+            wildcard = iotCommands[i].handler;
+        }
+    }
+    if (wildcard) wildcard(cmdId, root);
+}
+
+/*
+ * Child Devices
+ *      A gateway can publish for the devices behind it, Modbus or BLE
+ *      sensors for instance, over its own MQTT connection. iotAddDevice()
+ *      registers one in iotDevices, and its topics are put in the gateway
+ *      form only when they are used, so a device costs sizeof(IOTDevice)
+ *      and no topic buffers. Their commands come in through one wildcard
+ *      subscription, which replaces commandTopic, and are routed by type
+ *      and id to the handler of the device.
+ */
+#ifndef IOT_MAX_DEVICES
+#define             IOT_MAX_DEVICES         16
+#endif
+#define             IOT_DEV_TYPE_LENGTH     24
+#define             IOT_DEV_ID_LENGTH       32
+#define             IOT_DEVICE_TOPIC_LENGTH 160
+
+typedef void (*IOTDeviceHandler)(int dev, const char* cmdId, JsonDocument* root);
+
+struct IOTDevice {
+    char            devType[IOT_DEV_TYPE_LENGTH];
+    char            devId[IOT_DEV_ID_LENGTH];
+    const char*     metadata;                       // JSON object for the manage message, or NULL
+    IOTDeviceHandler handler;
+};
+
+IOTDevice           iotDevices[IOT_MAX_DEVICES];
+int                 iotDeviceCount = 0;
+int                 iotDeviceAnnounced = 0;         // children announced on this connection
+const char          iotDevicesCommandTopic[] = "iot-2/type/+/id/+/cmd/+/fmt/+";
+
+// gateway mode only, call before set_iot_server(), returns the device index or -1
+int iotAddDevice(const char* devType, const char* devId, IOTDeviceHandler handler, const char* metadata = NULL) {
+    if (!IOT_GATEWAY || iotDeviceCount == IOT_MAX_DEVICES ||
+                strlen(devType) >= IOT_DEV_TYPE_LENGTH || strlen(devId) >= IOT_DEV_ID_LENGTH) {
+        return -1;
+    }
+    IOTDevice* d = &iotDevices[iotDeviceCount];
+    strcpy(d->devType, devType);
+    strcpy(d->devId, devId);
+    d->metadata = metadata;
+    d->handler = handler;
+    return iotDeviceCount++;
+}
+
+// topic is given without the device, e.g. "iot-2/evt/status/fmt/json"
+bool iotDevicePublish(int dev, const char* topic, const char* payload, unsigned int len) {
+    char buffer[IOT_DEVICE_TOPIC_LENGTH];
+    if (dev < 0 || dev >= iotDeviceCount ||
+                !gatewayTopic(buffer, sizeof(buffer), topic, iotDevices[dev].devType, iotDevices[dev].devId)) {
+        return false;
+    }
+    return iotPublish(buffer, payload, len);
+}
+
+// routes "iot-2/type/<devType>/id/<devId>/cmd/<cmdId>/fmt/<fmt>" to its device
+bool iotDispatchDevice(const char* topic, JsonDocument* root) {
+    if (strncmp(topic, "iot-2/type/", 11)) return false;
+    const char* type = topic + 11;
+    const char* id = strstr(type, "/id/");
+    if (!id) return false;
+    const char* cmd = strstr(id + 4, "/cmd/");
+    if (!cmd) return false;
+    const char* fmt = strchr(cmd + 5, '/');
+    if (!fmt || fmt - (cmd + 5) >= IOT_CMD_ID_LENGTH) return false;
+    char cmdId[IOT_CMD_ID_LENGTH];
+    memcpy(cmdId, cmd + 5, fmt - (cmd + 5));
+    cmdId[fmt - (cmd + 5)] = '\0';
+    size_t typeLen = id - type;
+    size_t idLen = cmd - (id + 4);
+    for (int i = 0; i < iotDeviceCount; i++) {
+        IOTDevice* d = &iotDevices[i];
+        if (!strncmp(d->devType, type, typeLen) && d->devType[typeLen] == '\0' &&
+                    !strncmp(d->devId, id + 4, idLen) && d->devId[idLen] == '\0') {
+            if (d->handler) d->handler(i, cmdId, root);
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifndef IOT_TLS_HANDSHAKE_TIMEOUT
+#define             IOT_TLS_HANDSHAKE_TIMEOUT   10      // seconds
+#endif
+
+#ifndef IOT_MODE_GATEWAY
+/*
+ * TLS Transport
+ *      The direct connection runs on esp-tls rather than WiFiClientSecure,
+ *      which parses the CA PEM at every handshake and forgets the session
+ *      with the socket. iotTlsSetCA() parses the CA once into the global CA
+ *      store of esp-tls, and the session ticket of each connection is kept,
+ *      so the next one resumes the session with an abbreviated handshake,
+ *      no certificate chain and no key exchange. A ticket the broker no
+ *      longer takes gives a full handshake by itself, so the ticket is kept
+ *      across the failed connections and the first one after an outage
+ *      resumes. A ticket is only offered to the host and port it came from,
+ *      as a resumed session skips the certificate and the name check. The
+ *      tickets need CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS in
+ *      the sdkconfig; without it each connection is a full handshake.
+ *      The socket is non-blocking once connected, so available() and
+ *      read() never wait, as those of WiFiClient.
+ */
+class IOTTlsClient : public Client {
+public:
+    IOTTlsClient() : tls(NULL), session(NULL), sessionPort(0), timeoutMs(IOT_TLS_HANDSHAKE_TIMEOUT * 1000),
+                     rxPos(0), rxLen(0) {}
+
+    void setTimeout(unsigned long ms) { timeoutMs = ms; }
+    bool resumable() { return session != NULL; }
+
+    int connect(IPAddress ip, uint16_t port) { return connect(ip.toString().c_str(), port); }
+
+    int connect(const char* host, uint16_t port) {
+        stop();
+        esp_tls_cfg_t cfg = {};
+        cfg.use_global_ca_store = true;
+        cfg.timeout_ms = timeoutMs;
+        if (session && (port != sessionPort || strcmp(host, sessionHost))) {
+            forgetSession();                        // of another broker
+        }
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        cfg.client_session = session;
+#endif
+        tls = esp_tls_init();
+        int fd;
+        if (!tls || esp_tls_conn_new_sync(host, strlen(host), port, &cfg, tls) != 1 ||
+                    esp_tls_get_conn_sockfd(tls, &fd) != ESP_OK) {
+            stop();
+            return 0;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        esp_tls_client_session_t* resumed = esp_tls_get_client_session(tls);
+        if (resumed && strlen(host) < sizeof(sessionHost)) {
+            forgetSession();
+            session = resumed;
+            strcpy(sessionHost, host);
+            sessionPort = port;
+        }
+#endif
+        return 1;
+    }
+
+    size_t write(uint8_t b) { return write(&b, 1); }
+
+    size_t write(const uint8_t* buf, size_t size) {
+        size_t sent = 0;
+        unsigned long t0 = millis();
+        while (tls && sent < size) {
+            ssize_t n = esp_tls_conn_write(tls, buf + sent, size - sent);
+            if (n > 0) {
+                sent += n;
+            } else if ((n == ESP_TLS_ERR_SSL_WANT_WRITE || n == ESP_TLS_ERR_SSL_WANT_READ) &&
+                        millis() - t0 < timeoutMs) {
+                delay(1);
+            } else {
+                stop();
+            }
+        }
+        return sent;
+    }
+
+    int available() {
+        if (!fill()) return 0;
+        return rxLen - rxPos + (tls ? max(0, (int)esp_tls_get_bytes_avail(tls)) : 0);
+    }
+
+    int read() { return fill() ? rx[rxPos++] : -1; }
+
+    int read(uint8_t* buf, size_t size) {
+        size_t n = 0;
+        while (n < size && fill()) {
+            size_t k = min(size - n, rxLen - rxPos);
+            memcpy(buf + n, rx + rxPos, k);
+            rxPos += k;
+            n += k;
+        }
+        return n ? (int)n : -1;
+    }
+
+    int peek() { return fill() ? rx[rxPos] : -1; }
+    void flush() {}
+
+    void stop() {
+        if (tls) esp_tls_conn_destroy(tls);
+        tls = NULL;
+        rxPos = rxLen = 0;
+    }
+
+    uint8_t connected() {
+        fill();
+        return tls != NULL || rxPos < rxLen;
+    }
+
+    operator bool() { return tls != NULL; }
+
+private:
+    esp_tls_t*                  tls;
+    esp_tls_client_session_t*   session;
+    char                        sessionHost[sizeof(iot_server)];
+    uint16_t                    sessionPort;
+    unsigned long               timeoutMs;
+    uint8_t                     rx[256];
+    size_t                      rxPos;
+    size_t                      rxLen;
+
+    // reads a record into rx when it is empty, without waiting
+    bool fill() {
+        if (rxPos < rxLen) return true;
+        if (!tls) return false;
+        ssize_t n = esp_tls_conn_read(tls, rx, sizeof(rx));
+        if (n > 0) {
+            rxPos = 0;
+            rxLen = n;
+            return true;
+        }
+        if (n != ESP_TLS_ERR_SSL_WANT_READ && n != ESP_TLS_ERR_SSL_WANT_WRITE) {
+            stop();                                 // closed by the broker, or broken
+        }
+        return false;
+    }
+
+    void forgetSession() {
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        if (session) esp_tls_free_client_session(session);
+#endif
+        session = NULL;
+    }
+};
+
+IOTTlsClient        iotTlsClient;
+
+// parses the CA into the global CA store of esp-tls, once for all the connections
+bool iotTlsSetCA(const char* pem) {
+    static const char* parsed = NULL;
+    if (parsed == pem) return true;
+    if (esp_tls_set_global_ca_store((const unsigned char*)pem, strlen(pem) + 1) != ESP_OK) {
+        IOT_LOGE("the CA certificate does not parse");
+        return false;
+    }
+    parsed = pem;
+    return true;
+}
+#endif
+
+// reads caFile once into a buffer which is kept for the following connections
+void load_ca() {
+    static char* caBuffer = NULL;
+    if (caBuffer || !SPIFFS.exists(caFile)) return;
+    File f = SPIFFS.open(caFile, "r");
+    size_t len = f.size();
+    caBuffer = (char*)malloc(len + 1);
+    if (caBuffer) {
+        len = f.read((uint8_t*)caBuffer, len);
+        while (len && isspace(caBuffer[len - 1])) len--;
+        caBuffer[len] = '\0';
+        ca = caBuffer;
+    }
+    f.close();
+}
+
+#ifndef IOT_MODE_DIRECT
+// builds the gateway topics into iotTopicPool, publishTopic with the room for "msgpack"
+bool iotBuildGatewayTopics(const char* devType, const char* devId) {
+    const char** topics[IOT_TOPICS] = { &publishTopic, &infoTopic, &commandTopic, &responseTopic,
+                                        &manageTopic, &updateTopic, &rebootTopic, &resetTopic };
+    if (!devType || !devId) {
+        IOT_LOGE("devType and devId are needed for the gateway topics");
+        return false;
+    }
+    size_t size = strlen("msgpack") - strlen("json");
+    for (int i = 0; i < IOT_TOPICS; i++) {
+        size += strlen(iotTopicTemplates[i]) + strlen("/type//id/") + strlen(devType) + strlen(devId) + 1;
+    }
+    free(iotTopicPool);
+    iotTopicPool = (char*)malloc(size);
+    if (!iotTopicPool) {
+        IOT_LOGE("no memory for the topic pool of %u bytes", (unsigned)size);
+        return false;
+    }
+    char* p = iotTopicPool;
+    size_t left = size;
+    for (int i = 0; i < IOT_TOPICS; i++) {
+        size_t n = gatewayTopic(p, left, iotTopicTemplates[i], devType, devId);
+        if (n == 0) {
+            IOT_LOGE("topic pool of %u bytes too small", (unsigned)size);
+            return false;
+        }
+        if (i == 0) {
+            n += strlen("msgpack") - strlen("json");
+            iotPublishTopicSize = n + 1;
+        }
+        *topics[i] = p;
+        p += n + 1;
+        left -= n + 1;
+    }
+    return true;
+}
+#endif
+
+/*
+ * Connection Snapshot
+ *      With IOT_NET_TASK the connection runs on the network task while a
+ *      metadata update rewrites cfg on the application task, so the
+ *      connection reads nothing of cfg. The client id, the token and the org
+ *      are copied once in initDevice(), and the metadata of the manage
+ *      message is copied as text into connMeta by iotSnapshotMeta() after
+ *      each change, under connMetaSeq which is odd while it is written.
+ */
+#ifndef IOT_CONN_META_SIZE
+#define             IOT_CONN_META_SIZE      384
+#endif
+
+char                connClientId[128];
+char                connToken[64];
+char                connOrg[64];
+char                connMeta[IOT_CONN_META_SIZE] = "{}";
+volatile uint32_t   connMetaSeq = 0;
+
+void iotSnapshotConnection() {
+    if (!IOT_GATEWAY) {
+        snprintf(connClientId, sizeof(connClientId), "d:%s:%s:%s",
+                    (const char*)cfg["org"], (const char*)cfg["devType"], (const char*)cfg["devId"]);
+    } else {
+        snprintf(connClientId, sizeof(connClientId), "d:%s:%s", (const char*)cfg["devType"], (const char*)cfg["devId"]);
+    }
+    snprintf(connToken, sizeof(connToken), "%s", cfg["token"] | "");
+    snprintf(connOrg, sizeof(connOrg), "%s", cfg["org"] | "");
+}
+
+// on the application task, whenever cfg["meta"] changes
+void iotSnapshotMeta() {
+    uint32_t seq = connMetaSeq;
+    __atomic_store_n(&connMetaSeq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    JsonObject meta = cfg["meta"];
+    size_t n = meta.isNull() ? 0 : serializeJson(meta, connMeta, sizeof(connMeta));
+    if (n == 0 || n >= sizeof(connMeta) - 1) {
+        if (n) IOT_LOGW("metadata too long to announce");
+        strcpy(connMeta, "{}");
+    }
+    __atomic_store_n(&connMetaSeq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// on the network task, a consistent copy of connMeta
+bool iotReadMeta(char* out) {
+    for (int tries = 0; tries < 10; tries++) {
+        uint32_t seq = __atomic_load_n(&connMetaSeq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            memcpy(out, connMeta, IOT_CONN_META_SIZE);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&connMetaSeq, __ATOMIC_RELAXED) == seq) {
+                out[IOT_CONN_META_SIZE - 1] = '\0';
+                return true;
+            }
+        }
+        delay(1);
+    }
+    return false;
+}
+
+// the status events are published in cfg["meta"]["fmt"], json or msgpack
+void iotApplyFormat() {
+    const char* fmt = cfg["meta"]["fmt"] | "json";
+    bool msgpack = !strcmp(fmt, "msgpack");
+    if (!IOT_GATEWAY) {
+        publishTopic = msgpack ? "iot-2/evt/status/fmt/msgpack" : iotTopicTemplates[0];
+        return;
+    }
+#ifndef IOT_MODE_DIRECT
+    char* p = strstr(iotTopicPool, "/fmt/");
+    if (p && publishTopic == iotTopicPool) {
+        snprintf(p + 5, iotPublishTopicSize - (p + 5 - iotTopicPool), "%s", msgpack ? "msgpack" : "json");
+    }
+#endif
+}
+
+#ifndef IOT_MODE_GATEWAY
+void iotSetupDirect() {
+    load_ca();
+    snprintf(iot_server, sizeof(iot_server), "%s.messaging.internetofthings.ibmcloud.com", (const char*)cfg["org"]);
+    iotTlsSetCA(ca);
+    iotAckClient.inner = &iotTlsClient;
+    client.setClient(iotAckClient);
+    mqttPort = 8883;
+}
+#endif
+
+#ifndef IOT_MODE_DIRECT
+bool iotSetupGateway() {
+    iotAckClient.inner = &wifiClient;
+    client.setClient(iotAckClient);
+    mqttPort = 1883;
+    return iotBuildGatewayTopics((const char*)cfg["devType"], (const char*)cfg["devId"]);
+}
+#endif
+
+void initDevice() {
+    iotInitDevice();
+    if(!cfg.containsKey("config") || strcmp((const char*)cfg["config"], "done") || !cfg.containsKey("org")) {
+        reset_config();
+        iotConfigDevice();
+    }
+
+#if defined(IOT_MODE_DIRECT)
+    iotSetupDirect();
+#elif defined(IOT_MODE_GATEWAY)
+    if (!iotSetupGateway()) {
+        iotConfigDevice();                  // never with a part of the topics built
+    }
+#else
+    iotGateway = strchr((const char*)cfg["org"], '.') != NULL;
+    if (iotGateway) {
+        if (!iotSetupGateway()) {
+            iotConfigDevice();              // never with a part of the topics built
+        }
+    } else {
+        iotSetupDirect();
+    }
+#endif
+    iotSnapshotConnection();
+    iotSnapshotMeta();
+    iotApplyFormat();
+    iotRouterInit();
+    rbeLoad();
+    if (IOT_METRICS_INTERVAL) {
+        iotEvery(IOT_METRICS_INTERVAL, iotMetricsPublish);
+    }
+}
+
+void publishError(char *msg) {
+    char payload[256];
+    IOTWriter w(payload, sizeof(payload));
+    w.add("{\"info\":{\"error\":").addString(msg).add("}}");
+    iotPublish(infoTopic, w.buff, w.len);
+    IOT_LOGW("%s", msg);
+}
+
+/*
+ * Host Resolver
+ *      ip_resolve() answers from resolveCache, which is kept in resolveFile
+ *      over the reboots, so a reconnection does not wait for mDNS. An entry
+ *      older than IOT_RESOLVE_TTL, or loaded at boot, is still returned while
+ *      it is refreshed in the background, and only an unknown name blocks.
+ *      iotResolve() is the asynchronous query, its callback is called from
+ *      iotLoop(), and the connection resolves the broker with it, so the
+ *      IOT_SOCKET step waits for the answer without blocking. mDNS is
+ *      initialized once.
+ */
+#ifndef IOT_RESOLVE_ENTRIES
+#define             IOT_RESOLVE_ENTRIES     4
+#endif
+#ifndef IOT_RESOLVE_TTL
+#define             IOT_RESOLVE_TTL         3600000 // ms
+#endif
+#define             IOT_RESOLVE_TIMEOUT     5000
+
+typedef void (*ResolveCallback)(const char* name, IPAddress ip);
+
+struct ResolveEntry {
+    char            name[64];               // without .local
+    uint32_t        ip;
+    unsigned long   resolvedAt;
+    bool            fresh;                  // resolved since the boot and within the TTL
+};
+
+struct ResolveJob {
+    char            name[64];
+    uint32_t        ip;
+    ResolveCallback callback;
+    volatile bool   busy;
+    volatile bool   done;
+};
+
+char                resolveFile[] = "/resolve.dat";
+ResolveEntry        resolveCache[IOT_RESOLVE_ENTRIES];
+ResolveJob          resolveJob;
+bool                resolveLoaded = false;
+
+void mdnsInitOnce() {
+    static bool mdnsReady = false;
+    if (!mdnsReady) {
+        mdns_init();
+        mdnsReady = true;
+    }
+}
+
+void resolveLoad() {
+    resolveLoaded = true;
+    File f = SPIFFS.open(resolveFile, "r");
+    if (!f) return;
+    if (f.read((uint8_t*)resolveCache, sizeof(resolveCache)) != sizeof(resolveCache)) {
+        memset(resolveCache, 0, sizeof(resolveCache));
+    }
+    f.close();
+    for (int i = 0; i < IOT_RESOLVE_ENTRIES; i++) {
+        resolveCache[i].fresh = false;
+    }
+}
+
+void resolveStore(const char* name, uint32_t ip) {
+    ResolveEntry* e = resolveCache;
+    for (int i = 0; i < IOT_RESOLVE_ENTRIES; i++) {
+        if (!strcmp(resolveCache[i].name, name)) {
+            e = &resolveCache[i];
+            break;
+        }
+        if (resolveCache[i].resolvedAt < e->resolvedAt) e = &resolveCache[i];
+    }
+    bool changed = strcmp(e->name, name) || e->ip != ip;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->ip = ip;
+    e->resolvedAt = millis();
+    e->fresh = true;
+    if (changed) {
+        File f = SPIFFS.open(resolveFile, "w");
+        if (f) {
+            f.write((uint8_t*)resolveCache, sizeof(resolveCache));
+            f.close();
+        }
+    }
+}
+
+ResolveEntry* resolveLookup(const char* name) {
+    if (!resolveLoaded) resolveLoad();
+    for (int i = 0; i < IOT_RESOLVE_ENTRIES; i++) {
+        ResolveEntry* e = &resolveCache[i];
+        if (e->ip && !strcmp(e->name, name)) {
+            if (e->fresh && millis() - e->resolvedAt > IOT_RESOLVE_TTL) e->fresh = false;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// marks the name to be resolved again, e.g. when its address does not answer
+void resolveInvalidate(const char* name) {
+    char host[64];
+    snprintf(host, sizeof(host), "%s", name);
+    char* local = strstr(host, ".local");
+    if (local) *local = '\0';
+    ResolveEntry* e = resolveLookup(host);
+    if (e) e->fresh = false;
+}
+
+void resolveTask(void* arg) {
+    mdnsInitOnce();
+    resolveJob.ip = MDNS.queryHost(resolveJob.name, IOT_RESOLVE_TIMEOUT);
+    resolveJob.done = true;
+    vTaskDelete(NULL);
+}
+
+bool iotResolve(const char* name, ResolveCallback callback) {
+    IPAddress ipaddr;
+    if (ipaddr.fromString(name)) {
+        if (callback) callback(name, ipaddr);
+        return true;
+    }
+    if (resolveJob.busy) {
+        return false;                       // one query at a time
+    }
+    snprintf(resolveJob.name, sizeof(resolveJob.name), "%s", name);
+    char* local = strstr(resolveJob.name, ".local");
+    if (local) *local = '\0';
+    resolveJob.callback = callback;
+    resolveJob.done = false;
+    resolveJob.busy = true;
+    if (xTaskCreate(resolveTask, "iotResolve", 4096, NULL, 1, NULL) != pdPASS) {
+        resolveJob.busy = false;
+        return false;
+    }
+    return true;
+}
+
+void resolvePoll() {
+    if (!resolveJob.busy || !resolveJob.done) return;
+    if (resolveJob.ip) {
+        resolveStore(resolveJob.name, resolveJob.ip);
+    }
+    resolveJob.busy = false;
+    if (resolveJob.callback) {
+        resolveJob.callback(resolveJob.name, IPAddress(resolveJob.ip));
+    }
+}
+
+// writes the address of name, or 0.0.0.0 when it is not found, into ip
+void ip_resolve(const char* name, char* ip, size_t size) {
+    IPAddress ipaddr = IPAddress();
+    if(!ipaddr.fromString(name)) {
+        char host[64];
+        snprintf(host, sizeof(host), "%s", name);
+        char* local = strstr(host, ".local");
+        if (local) *local = '\0';
+        ResolveEntry* e = resolveLookup(host);
+        if (e) {
+            if (!e->fresh) iotResolve(host, NULL);      // stale while revalidate
+            ipaddr = IPAddress(e->ip);
+        } else {
+            mdnsInitOnce();
+            ipaddr = MDNS.queryHost(host, IOT_RESOLVE_TIMEOUT);
+            if ((uint32_t)ipaddr) resolveStore(host, ipaddr);
+        }
+    }
+    snprintf(ip, size, "%u.%u.%u.%u", ipaddr[0], ipaddr[1], ipaddr[2], ipaddr[3]);
+}
+
+String ip_resolve(String name){
+    char ip[16];
+    ip_resolve(name.c_str(), ip, sizeof(ip));
+    return String(ip);
+}
+
+/*
+ * OTA Engine
+ *      d.upgrade starts otaTask, which downloads the image in chunks of
+ *      IOT_OTA_CHUNK bytes and writes it with Update. A dropped download is
+ *      resumed with an HTTP Range request, and the image is checked against
+ *      the md5 of the command when it is given. otaPoll() in iotLoop()
+ *      publishes the progress on infoTopic, so the loop and the MQTT session
+ *      keep running during the upgrade.
+ */
+#ifndef IOT_OTA_CHUNK
+#define             IOT_OTA_CHUNK           1024
+#endif
+#ifndef IOT_OTA_RETRIES
+#define             IOT_OTA_RETRIES         5
+#endif
+#define             IOT_OTA_STALL           10000   // ms without data before a resume
+
+enum OTAState {
+    OTA_IDLE,
+    OTA_RUNNING,
+    OTA_DONE,
+    OTA_FAILED
+};
+
+struct OTAJob {
+    char            server[64];
+    uint16_t        port;
+    char            uri[128];
+    char            md5[33];
+    volatile OTAState state;
+    volatile size_t total;
+    volatile size_t written;
+    int             reported;               // the last progress published, in %
+    unsigned long   rebootAt;
+    char            error[64];
+};
+
+OTAJob              otaJob;
+
+void otaFail(const char* error) {
+    snprintf(otaJob.error, sizeof(otaJob.error), "%s", error);
+    if (Update.isRunning()) Update.abort();
+    otaJob.state = OTA_FAILED;
+}
+
+void otaTask(void* arg) {
+    WiFiClient cli;
+    HTTPClient http;
+    uint8_t buff[IOT_OTA_CHUNK];
+    char range[32];
+
+    for (int retries = 0; otaJob.state == OTA_RUNNING; ) {
+        http.begin(cli, otaJob.server, otaJob.port, otaJob.uri);
+        if (otaJob.written) {
+            snprintf(range, sizeof(range), "bytes=%u-", (unsigned)otaJob.written);
+            http.addHeader("Range", range);
+        }
+        int code = http.GET();
+        if (code == HTTP_CODE_OK && otaJob.written == 0) {
+            int size = http.getSize();
+            if (size <= 0 || !Update.begin(size)) {
+                http.end();
+                otaFail(size <= 0 ? "no content length" : Update.errorString());
+                break;
+            }
+            if (otaJob.md5[0]) Update.setMD5(otaJob.md5);
+            otaJob.total = size;
+        } else if (code != HTTP_CODE_PARTIAL_CONTENT || otaJob.written == 0) {
+            http.end();
+            if (code == HTTP_CODE_OK) {
+                otaFail("server does not resume");
+                break;
+            }
+            if (++retries > IOT_OTA_RETRIES) {
+                snprintf(range, sizeof(range), "HTTP error %d", code);
+                otaFail(range);
+                break;
+            }
+            vTaskDelay(pdMS_TO_TICKS(1000 * retries));
+            continue;
+        }
+        WiFiClient* stream = http.getStreamPtr();
+        unsigned long lastData = millis();
+        while (otaJob.written < otaJob.total && millis() - lastData < IOT_OTA_STALL) {
+            size_t avail = stream->available();
+            if (avail == 0) {
+                if (!stream->connected()) break;
+                vTaskDelay(1);
+                continue;
+            }
+            size_t n = stream->readBytes(buff, min(avail, sizeof(buff)));
+            if (Update.write(buff, n) != n) {
+                otaFail(Update.errorString());
+                break;
+            }
+            otaJob.written += n;
+            lastData = millis();
+        }
+        http.end();
+        if (otaJob.state != OTA_RUNNING) break;
+        if (otaJob.written == otaJob.total) {
+            if (Update.end()) {
+                otaJob.state = OTA_DONE;
+            } else {
+                otaFail(Update.errorString());
+            }
+        } else if (++retries > IOT_OTA_RETRIES) {
+            otaFail("download interrupted");
+        } else {
+            vTaskDelay(pdMS_TO_TICKS(1000 * retries));
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+bool otaStart(const char* server, int port, const char* uri, const char* md5) {
+    if (otaJob.state == OTA_RUNNING) {
+        return false;
+    }
+    snprintf(otaJob.server, sizeof(otaJob.server), "%s", server);
+    snprintf(otaJob.uri, sizeof(otaJob.uri), "%s", uri);
+    snprintf(otaJob.md5, sizeof(otaJob.md5), "%s", md5 ? md5 : "");
+    otaJob.port = port;
+    otaJob.total = otaJob.written = 0;
+    otaJob.reported = -10;
+    otaJob.error[0] = '\0';
+    otaJob.state = OTA_RUNNING;
+    if (xTaskCreate(otaTask, "iotOTA", 8192, NULL, 1, NULL) != pdPASS) {
+        otaJob.state = OTA_FAILED;
+        snprintf(otaJob.error, sizeof(otaJob.error), "no memory for the OTA task");
+    }
+    return true;
+}
+
+void otaPoll() {
+    char response[128];
+    if (otaJob.state == OTA_RUNNING && otaJob.total) {
+        int progress = otaJob.written * 100 / otaJob.total;
+        if (progress / 10 != otaJob.reported / 10) {
+            otaJob.reported = progress;
+            snprintf(response, sizeof(response), "{\"OTA\":{\"status\":\"downloading\",\"progress\":%d}}", progress);
+            iotPublish(infoTopic, response);
+        }
+    } else if (otaJob.state == OTA_DONE && otaJob.rebootAt == 0) {
+        iotPublish(infoTopic, "{\"OTA\":{\"status\":\"[update] Update ok.\",\"progress\":100}}");
+        IOT_LOGI("[update] Update ok.");
+        otaJob.rebootAt = millis() + 2000;  // a moment to send the message
+    } else if (otaJob.state == OTA_DONE && (long)(millis() - otaJob.rebootAt) >= 0) {
+        iotConfigSync();
+        reboot();
+    } else if (otaJob.state == OTA_FAILED) {
+        IOTWriter w(response, sizeof(response));
+        char status[96];
+        snprintf(status, sizeof(status), "[update] Update failed. %s", otaJob.error);
+        w.add("{\"OTA\":{\"status\":").addString(status).add("}}");
+        iotPublish(infoTopic, w.buff, w.len);
+        IOT_LOGE("%s", status);
+        otaJob.state = OTA_IDLE;
+    }
+}
+
+// replaces cfg["meta"] with a deep copy of value. An assignment copies only
+// the pointers of the strings of rxDoc, which point into rxBuffer, so cfg is
+// written out as text and parsed back from the const char*, which copies
+// every string. It also compacts cfg, whose pool does not reuse the old meta.
+// When the new cfg does not fit, the old one is parsed back from msgBuffer.
+bool iotUpdateMeta(JsonObject value) {
+    size_t old = serializeJson(cfg, msgBuffer, sizeof(msgBuffer));
+    if (old == 0 || old >= sizeof(msgBuffer) - 1) {
+        IOT_LOGE("config too long to update");
+        return false;
+    }
+    cfg.remove("meta");
+    cfg["meta"] = value;                            // still linked into rxBuffer
+    size_t n = cfg.overflowed() ? 0 : serializeJson(cfg, cfgBuffer, sizeof(cfgBuffer));
+    if (n == 0 || n >= sizeof(cfgBuffer) - 1 || deserializeJson(cfg, (const char*)cfgBuffer)) {
+        IOT_LOGE("metadata update does not fit in the config, ignored");
+        deserializeJson(cfg, (const char*)msgBuffer);
+        return false;
+    }
+    iotConfigChanged();
+    iotSnapshotMeta();
+    return true;
+}
+
+void handleIOTCommand(char* topic, JsonDocument* root) {
+    unsigned long t0 = micros();
+    JsonObject d = (*root)["d"];
+    char cmdId[IOT_CMD_ID_LENGTH];
+    char fmt[IOT_FMT_LENGTH];
+    int kind = iotMatchTopic(topic, cmdId, fmt);
+
+    if (kind == IOT_TOPIC_RESPONSE) {
+        if (iotHandlers[kind]) iotHandlers[kind](cmdId, root);
+    } else if (kind == IOT_TOPIC_REBOOT) {          // rebooting
+        if (iotHandlers[kind]) iotHandlers[kind](cmdId, root);
+        iotConfigSync();
+        reboot();
+    } else if (kind == IOT_TOPIC_RESET) {           // clear the configuration and reboot
+        if (iotHandlers[kind]) iotHandlers[kind](cmdId, root);
+        reset_config();
+        ESP.restart();
+    } else if (kind == IOT_TOPIC_UPDATE) {
+        JsonArray fields = d["fields"];
+        for(JsonArray::iterator it=fields.begin(); it!=fields.end(); ++it) {
+            JsonObject field = *it;
+            const char* fieldName = field["field"];
+            if (strstr(fieldName, "metadata")) {
+                iotUpdateMeta(field["value"]);
+            }
+        }
+        pubInterval = cfg["meta"]["pubInterval"];
+        iotApplyFormat();
+        rbeLoad();
+        if (iotHandlers[kind]) iotHandlers[kind](cmdId, root);
+    } else if (kind == IOT_TOPIC_COMMAND) {
+        if (d.containsKey("upgrade")) {
+            JsonObject upgrade = d["upgrade"];
+            if(upgrade.containsKey("server") && 
+                        upgrade.containsKey("port") && 
+                        upgrade.containsKey("uri")) {
+		        IOT_LOGI("firmware upgrading");
+
+	            char fw_server[64];
+	            ip_resolve((const char*)upgrade["server"], fw_server, sizeof(fw_server));
+	            int fw_server_port = atoi(upgrade["port"]);
+	            const char *fw_uri = upgrade["uri"];
+                if (otaStart(fw_server, fw_server_port, fw_uri, upgrade["md5"])) {
+                    iotPublish(infoTopic,"{\"info\":{\"upgrade\":\"Device will be upgraded.\"}}" );
+                } else {
+                    iotPublish(infoTopic, "{\"OTA\":{\"status\":\"[update] Update in progress.\"}}");
+                }
+            } else {
+                iotPublish(infoTopic, "{\"OTA\":{\"status\":\"OTA Information Error\"}}");
+                IOT_LOGW("OTA Information Error");
+            }
+        } else if (d.containsKey("config")) {
+            IOTWriter w(msgBuffer, sizeof(msgBuffer));
+            w.add("{\"config\":");
+            maskConfigTo(w, compile_date);
+            w.add("}");
+            iotPublish(infoTopic, w.buff, w.len);
+        } else if (d.containsKey("metrics")) {
+            iotMetricsPublish();
+        } else if (d.containsKey("log")) {
+            iotLogPublish();
+        }
+        iotDispatchCommand(cmdId, root);
+    }
+    iotHistRecord(&iotMetrics.command[kind], micros() - t0);
+}
+
+/*
+ * Receive Path
+ *      iotCallback() copies the topic and the payload once into rxBuffer,
+ *      which is used for nothing else, and parses it there in place, so the
+ *      strings of rxDoc point into rxBuffer. The handlers may publish with
+ *      msgBuffer or the PubSubClient buffer without breaking the message,
+ *      but must not store a value of the message in cfg, or anywhere it
+ *      outlives the handler: a string is to be copied, e.g. with (char*) or
+ *      as<String>(), as iotUpdateMeta() does for the metadata.
+ *      PubSubClient reads a whole message before the callback, so a larger
+ *      command needs -D IOT_MQTT_BUFFER_SIZE, which grows its buffer with
+ *      setBufferSize(), and rxBuffer, rxDoc and the ring slots with it.
+ */
+#ifndef IOT_RX_BUFFER_LENGTH
+#ifdef IOT_MQTT_BUFFER_SIZE
+#define             IOT_RX_BUFFER_LENGTH    (IOT_MQTT_BUFFER_SIZE + 2)
+#else
+#define             IOT_RX_BUFFER_LENGTH    (MQTT_MAX_PACKET_SIZE + 2)
+#endif
+#endif
+#ifndef IOT_RX_JSON_SIZE
+#ifdef IOT_MQTT_BUFFER_SIZE
+#define             IOT_RX_JSON_SIZE        (IOT_MQTT_BUFFER_SIZE * 2)  // the values, the strings stay in rxBuffer
+#else
+#define             IOT_RX_JSON_SIZE        512
+#endif
+#endif
+
+char                rxBuffer[IOT_RX_BUFFER_LENGTH];
+StaticJsonDocument<IOT_RX_JSON_SIZE> rxDoc;
+
+// parses the message in place, topic and payload must be writable
+void iotHandleMessage(char* topic, char* payload, unsigned int payloadLength) {
+    DeserializationError error = isMsgPackTopic(topic) ?
+                deserializeMsgPack(rxDoc, payload, payloadLength) :
+                deserializeJson(rxDoc, payload, payloadLength);
+    if (error) {
+        IOT_LOGW("handleCommand: payload parse FAILED");
+        return;
+    }
+    if (iotDeviceCount && strncmp(topic, commandTopic, iotCmdPrefixLen) &&
+                iotDispatchDevice(topic, &rxDoc)) {
+        return;
+    }
+    handleIOTCommand(topic, &rxDoc);
+}
+
+void iotCallback(char* topic, byte* payload, unsigned int payloadLength) {
+    iotMetrics.bytesIn += payloadLength;
+#ifdef IOT_NET_TASK
+    if (iotNetTaskHandle) {                 // handled in iotLoop() of the application
+        if (!ringPush(&rxRing, topic, (const char*)payload, payloadLength)) {
+            netStats.rxDropped++;
+        }
+        return;
+    }
+#endif
+    size_t topicLength = strlen(topic);
+    if (topicLength + payloadLength + 2 > sizeof(rxBuffer)) {
+        IOT_LOGW("message on %s too long: %u", topic, payloadLength);
+        return;
+    }
+    char* rxTopic = rxBuffer;
+    char* rxPayload = rxBuffer + topicLength + 1;
+    memcpy(rxTopic, topic, topicLength + 1);
+    memcpy(rxPayload, payload, payloadLength);
+    rxPayload[payloadLength] = '\0';
+    iotHandleMessage(rxTopic, rxPayload, payloadLength);
+}
+
+/*
+ * Connection State Machine
+ *      iotConnectStep() advances the connection by one step per call, so the
+ *      loop() keeps running while the device is offline:
+ *          IOT_WIFI -> IOT_SOCKET -> IOT_MQTT -> IOT_SUBSCRIBE -> IOT_ANNOUNCE -> IOT_CONNECTED
+ *      A failed step is retried after a jittered exponential backoff and a
+ *      failed subscription is resumed from the same topic. The WiFi stack
+ *      reconnects by itself, so it is given IOT_WIFI_TIMEOUT ms to associate
+ *      before the association is restarted with WiFi.begin().
+ */
+#ifndef IOT_BACKOFF_MIN
+#define             IOT_BACKOFF_MIN         1000
+#endif
+#ifndef IOT_BACKOFF_MAX
+#define             IOT_BACKOFF_MAX         60000
+#endif
+#ifndef IOT_WIFI_TIMEOUT
+#define             IOT_WIFI_TIMEOUT        10000
+#endif
+
+enum IOTConnState {
+    IOT_WIFI,
+    IOT_SOCKET,
+    IOT_MQTT,
+    IOT_SUBSCRIBE,
+    IOT_ANNOUNCE,
+    IOT_CONNECTED
+};
+
+char                connBuffer[512];        // the connection may run on the network task
+char                connMetaCopy[IOT_CONN_META_SIZE];
+IOTConnState        iotState = IOT_WIFI;
+unsigned long       iotStateSince = 0;      // millis() when iotState was entered
+unsigned long       iotRetryAt = 0;         // millis() of the next attempt
+unsigned long       iotBackoff = 0;
+unsigned long       iotConnAttempts = 0;
+int                 iotSubIdx = 0;
+int                 iotAnnouncePart = 0;    // the messages sent of the announce in progress
+const char**        iotSubTopics[] = { &responseTopic, &rebootTopic, &resetTopic, &updateTopic, &commandTopic };
+
+void iotSetState(IOTConnState state) {
+    if (iotState == IOT_CONNECTED) {
+        if (state != IOT_CONNECTED) {
+            iotMetrics.reconnects++;
+        }
+    } else {
+        iotHistRecord(&iotMetrics.phase[iotState], min(millis() - iotStateSince, 4000000UL) * 1000);
+    }
+    iotState = state;
+    iotStateSince = millis();
+}
+
+void iotRetryLater() {
+    iotBackoff = iotBackoff ? min(iotBackoff * 2, (unsigned long)IOT_BACKOFF_MAX) : IOT_BACKOFF_MIN;
+    iotRetryAt = millis() + iotBackoff / 2 + random(iotBackoff / 2 + 1);
+}
+
+bool iotRetryDue() {
+    return (long)(millis() - iotRetryAt) >= 0;
+}
+
+Client& iotTransport() {
+#ifndef IOT_MODE_GATEWAY
+    if (!IOT_GATEWAY) {
+        return iotTlsClient;
+    }
+#endif
+    return wifiClient;
+}
+
+// the manage and then the info message of the metadata meta, at QoS 1
+// through the in-flight window, from the one not sent yet. False when the
+// window has no room, for the next step; one too long is left out.
+bool iotAnnounceTo(const char* manage, const char* info, const char* meta, bool actions) {
+    const char* prefix[] = { "{\"d\":{\"metadata\":", "{\"info\":{\"metadata\":" };
+    const char* topic[] = { manage, info };
+    for (; iotAnnouncePart < 2; iotAnnouncePart++) {
+        IOTWriter w(connBuffer, sizeof(connBuffer));
+        w.add(prefix[iotAnnouncePart]).add(meta).add(",\"supports\":{\"deviceActions\":")
+         .add(actions ? "true}}}" : "false}}}");
+        if (w.overflow) {
+            IOT_LOGW("metadata too long to announce on %s", topic[iotAnnouncePart]);
+        } else if (!inflightPublish(topic[iotAnnouncePart], w.buff, w.len)) {
+            return false;
+        }
+    }
+    iotAnnouncePart = 0;
+    return true;
+}
+
+// reads only the snapshot, cfg may be changing on the application task
+bool iotAnnounce() {
+    if (!iotReadMeta(connMetaCopy)) {
+        return false;                               // again on the next step
+    }
+    IOT_LOGD("publishing device metadata: %s", connMetaCopy);
+    return iotAnnounceTo(manageTopic, infoTopic, connMetaCopy, true);
+}
+
+// the manage and info messages of the child devices, a few per step
+void iotAnnounceDevices() {
+    char manage[IOT_DEVICE_TOPIC_LENGTH];
+    char info[IOT_DEVICE_TOPIC_LENGTH];
+    for (int n = 0; n < IOT_PUBQ_BATCH && iotDeviceAnnounced < iotDeviceCount; n++) {
+        IOTDevice* d = &iotDevices[iotDeviceAnnounced];
+        if (!gatewayTopic(manage, sizeof(manage), iotTopicTemplates[4], d->devType, d->devId) ||
+                    !gatewayTopic(info, sizeof(info), iotTopicTemplates[1], d->devType, d->devId)) {
+            IOT_LOGW("device %s too long to announce", d->devId);
+        } else if (!iotAnnounceTo(manage, info, d->metadata ? d->metadata : "{}", false)) {
+            return;                                 // no room in the window, again on the next step
+        }
+        iotDeviceAnnounced++;
+    }
+}
+
+// the address of the broker of a gateway, into iot_server, from resolveCache
+// or by iotResolve(), so the connection never waits for mDNS
+volatile bool       iotBrokerResolving = false;
+
+void iotBrokerResolved(const char* name, IPAddress ip) {
+    iotBrokerResolving = false;
+    if (iot_server[0]) {
+        return;                                     // set_iot_server() ran since
+    }
+    if (!(uint32_t)ip) {
+        IOT_LOGW("broker address resolution failed");
+        iotRetryLater();
+        return;
+    }
+    snprintf(iot_server, sizeof(iot_server), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
+
+bool iotBrokerAddress() {
+    if (iot_server[0]) return true;
+    if (iotBrokerResolving) return false;
+    char host[64];
+    snprintf(host, sizeof(host), "%s", connOrg);
+    char* local = strstr(host, ".local");
+    if (local) *local = '\0';
+    ResolveEntry* e = resolveLookup(host);
+    if (e) {
+        if (!e->fresh) iotResolve(host, NULL);      // stale while revalidate
+        IPAddress ip(e->ip);
+        snprintf(iot_server, sizeof(iot_server), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+        return true;
+    }
+    iotBrokerResolving = true;
+    if (!iotResolve(host, iotBrokerResolved)) {
+        iotBrokerResolving = false;                 // another query is running, again on the next step
+    }
+    return iot_server[0] != '\0';                  // an address calls back at once
+}
+
+// the commandTopic subscription covers the child devices when there are some
+const char* iotSubTopic(int i) {
+    if (iotSubTopics[i] == &commandTopic && iotDeviceCount) {
+        return iotDevicesCommandTopic;
+    }
+    return *iotSubTopics[i];
+}
+
+bool iotConnectStep() {
+    if (iotState > IOT_WIFI && WiFi.status() != WL_CONNECTED) {
+        IOT_LOGW("WiFi connection lost");
+        iotTransport().stop();
+        iotSetState(IOT_WIFI);
+        iotBackoff = 0;
+        iotRetryAt = millis() + IOT_WIFI_TIMEOUT;   // let the WiFi stack reconnect first
+    }
+    switch (iotState) {
+        case IOT_WIFI:
+            if (WiFi.status() == WL_CONNECTED) {
+                IOT_LOGI("IP address : %s", WiFi.localIP().toString().c_str());
+                iotBackoff = 0;
+                iotRetryAt = millis();
+                iotSetState(IOT_SOCKET);
+            } else if (iotRetryDue()) {
+                IOT_LOGI("Reconnecting to WiFi");
+                WiFi.disconnect();
+                WiFi.begin();
+                iotRetryLater();
+                iotRetryAt += IOT_WIFI_TIMEOUT;     // the association takes a few seconds
+            }
+            break;
+        case IOT_SOCKET: {
+            if (!iotRetryDue()) break;
+            if (IOT_GATEWAY && !iotBrokerAddress()) {
+                break;                              // until the query calls back
+            }
+            iotConnAttempts++;
+            unsigned long t0 = micros();
+            if (iotTransport().connected()) {
+                iotSetState(IOT_MQTT);
+            } else if (iotTransport().connect(iot_server, mqttPort)) {
+                if (!IOT_GATEWAY) {
+                    iotHistRecord(&iotMetrics.tls, micros() - t0);
+                    IOT_LOGI("TLS handshake %lu ms", (micros() - t0) / 1000);
+                }
+                iotSetState(IOT_MQTT);
+            } else {
+                IOT_LOGW(IOT_GATEWAY ? "connection failed" : "ssl connection failed");
+                if (IOT_GATEWAY) {
+                    resolveInvalidate(connOrg);
+                    iot_server[0] = '\0';       // the broker may have moved
+                }
+                iotRetryLater();
+            }
+            break;
+        }
+        case IOT_MQTT: {
+            if (!iotRetryDue()) break;
+            if (!iotTransport().connected()) {
+                iotSetState(IOT_SOCKET);        // no handshake hidden in client.connect()
+                break;
+            }
+            int mqConnected;
+            iotAckClient.reset();
+            if (!IOT_GATEWAY) {
+                mqConnected = client.connect(connClientId, "use-token-auth", connToken);
+            } else {
+                mqConnected = client.connect(connClientId);
+            }
+            if (mqConnected) {
+                IOT_LOGI("MQ connected");
+                inflightConn++;                     // the frames of the last one are written again
+                iotSubIdx = 0;
+                iotAnnouncePart = 0;
+                iotDeviceAnnounced = 0;
+                iotSetState(IOT_SUBSCRIBE);
+            } else {
+                iotRetryLater();
+                IOT_LOGW("MQ Connection fail RC = %d, retry in %lu ms", client.state(), iotRetryAt - millis());
+                if (!iotTransport().connected()) {
+                    iotSetState(IOT_SOCKET);
+                }
+            }
+            break;
+        }
+        case IOT_SUBSCRIBE:
+            if (!iotRetryDue()) break;
+            if (!client.connected()) {
+                iotSetState(IOT_SOCKET);
+            } else if (!subscribeTopic(iotSubTopic(iotSubIdx))) {
+                iotRetryLater();                    // resume from this topic
+            } else if (++iotSubIdx == sizeof(iotSubTopics) / sizeof(iotSubTopics[0])) {
+                iotSetState(IOT_ANNOUNCE);
+            }
+            break;
+        case IOT_ANNOUNCE:
+            if (!iotRetryDue()) break;
+            if (iotAnnounce()) {
+                iotBackoff = 0;
+                iotSetState(IOT_CONNECTED);
+            } else {
+                iotRetryLater();
+                if (!client.connected()) iotSetState(IOT_SOCKET);
+            }
+            break;
+        case IOT_CONNECTED:
+            if (!client.connected()) {
+                IOT_LOGW("MQ connection lost RC = %d", client.state());
+                iotTransport().stop();
+                iotRetryAt = millis();
+                iotSetState(IOT_SOCKET);
+            } else if (iotDeviceAnnounced < iotDeviceCount) {
+                iotAnnounceDevices();
+            }
+            break;
+    }
+    return iotState == IOT_CONNECTED;
+}
+
+void iot_connect() {
+    // blocking variant, kept for the existing sketches
+#ifdef IOT_NET_TASK
+    if (iotNetTaskHandle) {
+        while (iotState != IOT_CONNECTED) {
+            iotRunJobs();
+            resolvePoll();
+            delay(10);
+        }
+        return;
+    }
+#endif
+    while (!iotConnectStep()) {
+        iotRunJobs();
+        resolvePoll();
+        delay(10);
+    }
+}
+
+void iotLoop() {
+#ifdef IOT_NET_TASK
+    if (iotNetTaskHandle) {
+        char* payload;
+        unsigned int len;
+        for (char* topic; (topic = ringPeek(&rxRing, &payload, &len)) != NULL; ringPop(&rxRing)) {
+            iotHandleMessage(topic, payload, len);
+        }
+        iotBatchPoll();
+        iotRunJobs();
+        iotLogPoll();
+        iotConfigFlush();
+        otaPoll();
+        resolvePoll();
+        return;
+    }
+#endif
+    iotConnectStep();
+    client.loop();
+    iotBatchPoll();
+    iotRunJobs();
+    iotLogPoll();
+    iotConfigFlush();
+    otaPoll();
+    resolvePoll();
+    pubqDrain();
+}
+
+#ifdef IOT_NET_TASK
+void iotNetTask(void* arg) {
+    char* payload;
+    unsigned int len;
+    while(true) {
+        iotConnectStep();
+        client.loop();
+        for (char* topic; (topic = ringPeek(&txRing, &payload, &len)) != NULL; ringPop(&txRing)) {
+            if (!iotPublishNow(topic, payload, len) && client.connected() && iotClientFits(topic, len)) {
+                break;                              // inflightBuffer is full, the ring waits
+            }
+        }
+        pubqDrain();
+        vTaskDelay(1);
+    }
+}
+
+// call after set_iot_server(), the client is used only by the network task from then on
+void startIOTNetTask() {
+    xTaskCreatePinnedToCore(iotNetTask, "iotNetTask", IOT_NET_STACK, NULL, 2, &iotNetTaskHandle, IOT_NET_CORE);
+}
+#endif
+
+void set_iot_server() {
+    if (IOT_GATEWAY) {
+        iot_server[0] = '\0';              // resolved on the first connection
+    }
     client.setServer(iot_server, mqttPort);   //IOT Server
-    iot_connect();
+#ifdef IOT_MQTT_BUFFER_SIZE
+    client.setBufferSize(IOT_MQTT_BUFFER_SIZE);
+#endif
+    client.setCallback(iotCallback);
+    iotBackoff = 0;
+    iotRetryAt = millis() + IOT_WIFI_TIMEOUT;      // WiFi.begin() may still be associating
+    iotSetState(IOT_WIFI);
 }
 /* FW Upgrade informaiton 
  * var evt1 = { 'd': { 
  *   'upgrade' : {
  *       'server':'192.168.0.9',
  *       'port':'3000',
- *       'uri' : '/file/IOTPurifier4GW.ino.nodemcu.bin'
+ *       'uri' : '/file/IOTPurifier4GW.ino.nodemcu.bin',
+ *       'md5' : '0123456789abcdef0123456789abcdef'     (optional)
  *       }
  *   }
  * };